@@ -0,0 +1,189 @@
+#include "binlog.h"
+
+#include <esp_timer.h>
+#include <sdkconfig.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define BINLOG_MAGIC "BLOG"
+#define BINLOG_FORMAT_VERSION 1
+#define RING_MASK (CONFIG_BINLOG_RING_ENTRIES - 1)
+#define READ_BATCH 8
+
+_Static_assert((CONFIG_BINLOG_RING_ENTRIES & RING_MASK) == 0, "CONFIG_BINLOG_RING_ENTRIES must be a power of two");
+
+// seq is 0 while a writer owns the slot, otherwise the write index + 1. Readers use it to detect torn entries.
+typedef struct {
+    _Atomic uint32_t seq;
+    uint16_t id;
+    uint8_t nargs;
+    uint8_t reserved;
+    int64_t timestamp_us;
+    int32_t args[BINLOG_MAX_ARGS];
+} binlog_entry_t;
+
+_Static_assert(sizeof(binlog_entry_t) == 32, "binlog entry layout is part of the dump format");
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t num_events;
+    uint32_t num_entries;
+    int64_t uptime_us; // esp_timer time when the dump was taken
+    int64_t epoch_us;  // wall clock time when the dump was taken, lets a decoder convert entry timestamps
+} binlog_dump_header_t;
+
+static binlog_entry_t ring[CONFIG_BINLOG_RING_ENTRIES];
+static _Atomic uint32_t head;
+static const binlog_event_t *event_table;
+static size_t event_count;
+
+void binlog_init(const binlog_event_t *events, size_t num_events) {
+    event_table = events;
+    event_count = num_events;
+}
+
+void binlog_write(uint16_t id, size_t nargs, const int32_t *args) {
+    uint32_t index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    binlog_entry_t *entry = &ring[index & RING_MASK];
+
+    atomic_store_explicit(&entry->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->id = id;
+    entry->nargs = nargs;
+    entry->timestamp_us = esp_timer_get_time();
+    memcpy(entry->args, args, nargs * sizeof(int32_t));
+    atomic_store_explicit(&entry->seq, index + 1, memory_order_release);
+
+    // Warnings and errors also go to the serial port, where they were before the ring existed
+    if (id < event_count && event_table[id].level != ESP_LOG_NONE && event_table[id].level <= ESP_LOG_WARN) {
+        int32_t a[BINLOG_MAX_ARGS] = {0};
+        memcpy(a, args, nargs * sizeof(int32_t));
+        char msg[128];
+        snprintf(msg, sizeof(msg), event_table[id].fmt, (int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+        ESP_LOG_LEVEL(event_table[id].level, event_table[id].tag, "%s", msg);
+    }
+}
+
+// Copies the entry with the given write index, returning false if it was overwritten or is still being written
+static bool read_entry(uint32_t index, binlog_entry_t *out) {
+    const binlog_entry_t *entry = &ring[index & RING_MASK];
+    uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+    if (seq != index + 1) {
+        return false;
+    }
+    out->id = entry->id;
+    out->nargs = entry->nargs;
+    out->timestamp_us = entry->timestamp_us;
+    memcpy(out->args, entry->args, sizeof(out->args));
+    atomic_thread_fence(memory_order_acquire);
+    atomic_store_explicit(&out->seq, seq, memory_order_relaxed);
+    return atomic_load_explicit(&entry->seq, memory_order_relaxed) == seq;
+}
+
+static uint32_t oldest_index(uint32_t end) {
+    return end > CONFIG_BINLOG_RING_ENTRIES ? end - CONFIG_BINLOG_RING_ENTRIES : 0;
+}
+
+static char level_char(esp_log_level_t level) {
+    switch (level) {
+    case ESP_LOG_ERROR:
+        return 'E';
+    case ESP_LOG_WARN:
+        return 'W';
+    case ESP_LOG_INFO:
+        return 'I';
+    case ESP_LOG_DEBUG:
+        return 'D';
+    default:
+        return 'V';
+    }
+}
+
+static int format_entry(const binlog_entry_t *entry, char *buf, size_t len) {
+    int64_t ms = entry->timestamp_us / 1000;
+    if (entry->id >= event_count) {
+        return snprintf(buf, len, "(%lld) ? unknown event %u\n", (long long)ms, entry->id);
+    }
+    const binlog_event_t *event = &event_table[entry->id];
+    int n = snprintf(buf, len, "(%lld) %c %s: ", (long long)ms, level_char(event->level), event->tag);
+    if (n < 0 || (size_t)n >= len) {
+        return n;
+    }
+    // Unused trailing arguments are ignored by snprintf, so every event can be formatted with the same call
+    const int32_t *a = entry->args;
+    int m = snprintf(buf + n, len - n, event->fmt, (int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+    if (m < 0) {
+        return m;
+    }
+    n = (size_t)(n + m) < len - 1 ? n + m : (int)len - 2;
+    buf[n++] = '\n';
+    buf[n] = '\0';
+    return n;
+}
+
+esp_err_t binlog_dump_text(binlog_sink_t sink, void *ctx) {
+    uint32_t end = atomic_load_explicit(&head, memory_order_acquire);
+    char line[160];
+    for (uint32_t i = oldest_index(end); i != end; i++) {
+        binlog_entry_t entry;
+        if (!read_entry(i, &entry)) {
+            continue;
+        }
+        int n = format_entry(&entry, line, sizeof(line));
+        if (n > 0) {
+            esp_err_t err = sink(ctx, line, n);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t binlog_dump_binary(binlog_sink_t sink, void *ctx) {
+    uint32_t end = atomic_load_explicit(&head, memory_order_acquire);
+    uint32_t start = oldest_index(end);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    binlog_dump_header_t header = {
+        .magic = BINLOG_MAGIC,
+        .version = BINLOG_FORMAT_VERSION,
+        .entry_size = sizeof(binlog_entry_t),
+        .num_events = event_count,
+        .num_entries = end - start,
+        .uptime_us = esp_timer_get_time(),
+        .epoch_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec,
+    };
+    esp_err_t err = sink(ctx, (const char *)&header, sizeof(header));
+
+    // Event table: level byte followed by the null terminated tag and format string
+    for (size_t i = 0; i < event_count && err == ESP_OK; i++) {
+        uint8_t level = event_table[i].level;
+        err = sink(ctx, (const char *)&level, 1);
+        if (err == ESP_OK) {
+            err = sink(ctx, event_table[i].tag, strlen(event_table[i].tag) + 1);
+        }
+        if (err == ESP_OK) {
+            err = sink(ctx, event_table[i].fmt, strlen(event_table[i].fmt) + 1);
+        }
+    }
+
+    // Entries that were overwritten while dumping are sent with seq 0 so the count in the header stays correct
+    binlog_entry_t batch[READ_BATCH];
+    size_t n = 0;
+    for (uint32_t i = start; i != end && err == ESP_OK; i++) {
+        if (!read_entry(i, &batch[n])) {
+            memset(&batch[n], 0, sizeof(batch[n]));
+        }
+        if (++n == READ_BATCH || i + 1 == end) {
+            err = sink(ctx, (const char *)batch, n * sizeof(batch[0]));
+            n = 0;
+        }
+    }
+    return err;
+}
@@ -0,0 +1,46 @@
+#ifndef __BINLOG_H__
+#define __BINLOG_H__
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BINLOG_MAX_ARGS 4
+
+// Describes one event. fmt is only used when the log is read, and may use up to BINLOG_MAX_ARGS %d, %u, %i or %x
+// conversions, each consuming one 32 bit argument.
+typedef struct {
+    esp_log_level_t level;
+    const char *tag;
+    const char *fmt;
+} binlog_event_t;
+
+// Receives the formatted or binary log in pieces, e.g. to send it as HTTP chunks
+typedef esp_err_t (*binlog_sink_t)(void *ctx, const char *data, size_t len);
+
+/*
+ * Registers the event table. The event ID passed to BINLOG is an index into this table.
+ * The table must stay valid for the lifetime of the program.
+ */
+void binlog_init(const binlog_event_t *events, size_t num_events);
+
+// Records an event from any task. Only events at ESP_LOG_WARN or above are formatted, and those are also printed
+// through ESP_LOG so they still reach the serial port. Not for ISRs: the code and ring are not in IRAM.
+void binlog_write(uint16_t id, size_t nargs, const int32_t *args);
+
+// Writes every entry still in the ring as text lines, oldest first
+esp_err_t binlog_dump_text(binlog_sink_t sink, void *ctx);
+
+// Writes a self-describing binary dump (header, event table and raw entries) for tools/binlog_decode.py
+esp_err_t binlog_dump_binary(binlog_sink_t sink, void *ctx);
+
+#define BINLOG(id, ...)                                                                  \
+    do {                                                                                 \
+        const int32_t binlog_args_[] = {0, ##__VA_ARGS__};                               \
+        _Static_assert(sizeof(binlog_args_) <= (BINLOG_MAX_ARGS + 1) * sizeof(int32_t), \
+                       "too many binlog arguments");                                     \
+        binlog_write((id), sizeof(binlog_args_) / sizeof(int32_t) - 1, &binlog_args_[1]); \
+    } while (0)
+
+#endif // __BINLOG_H__
@@ -0,0 +1,79 @@
+#include "distance_filter.h"
+
+int32_t convert_time_to_um(int32_t echo_us) {
+    return Q16_MUL_INT(DISTANCE_UM_PER_US_Q16, echo_us);
+}
+
+int32_t distance_filter_mean_um(const int32_t *samples, int n) {
+    int32_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    return sum / n;
+}
+
+int32_t distance_filter_median_um(int32_t *samples, int n) {
+    for (int i = 1; i < n; i++) {
+        int32_t value = samples[i];
+        int j = i;
+        for (; j > 0 && samples[j - 1] > value; j--) {
+            samples[j] = samples[j - 1];
+        }
+        samples[j] = value;
+    }
+    if (n % 2 == 0) {
+        return (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    }
+    return samples[n / 2];
+}
+
+int32_t distance_filter_um(distance_filter_t filter, int32_t *samples, int n) {
+    if (filter == DISTANCE_FILTER_MEDIAN) {
+        return distance_filter_median_um(samples, n);
+    }
+    return distance_filter_mean_um(samples, n);
+}
+
+bool distance_samples_agree(int32_t reference, const int32_t *samples, int n, int32_t tolerance) {
+    for (int i = 0; i < n; i++) {
+        if (samples[i] < reference - tolerance || samples[i] > reference + tolerance) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int take_ping(const distance_params_t *params, distance_ping_t ping, void *ctx, int index, bool retry, int32_t *echo_us) {
+    int res = ping(ctx, index, retry, echo_us);
+    if (res == 0 && *echo_us < params->min_echo_us) {
+        res = ESP_ERR_ULTRASONIC_TOO_CLOSE;
+    }
+    return res;
+}
+
+int distance_read_pings(const distance_params_t *params, distance_ping_t ping, void *ctx, int32_t *samples_um) {
+    int n = params->num_pings < DISTANCE_MAX_PINGS ? params->num_pings : DISTANCE_MAX_PINGS;
+    for (int i = 0; i < n; i++) {
+        int32_t echo_us;
+        int res = take_ping(params, ping, ctx, i, false, &echo_us);
+        for (int retry = 0; res != 0 && retry < params->max_retries; retry++) {
+            res = take_ping(params, ping, ctx, i, true, &echo_us);
+        }
+        if (res != 0) {
+            return res;
+        }
+        samples_um[i] = convert_time_to_um(echo_us);
+    }
+    return 0;
+}
+
+int distance_read_filtered(const distance_params_t *params, distance_ping_t ping, void *ctx, int32_t *distance_um) {
+    int32_t samples[DISTANCE_MAX_PINGS];
+    int n = params->num_pings < DISTANCE_MAX_PINGS ? params->num_pings : DISTANCE_MAX_PINGS;
+    int res = distance_read_pings(params, ping, ctx, samples);
+    if (res != 0) {
+        return res;
+    }
+    *distance_um = distance_filter_um(params->filter, samples, n);
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef __DISTANCE_FILTER_H__
+#define __DISTANCE_FILTER_H__
+
+/*
+ * The hardware independent part of a reading: echo time conversion, retries and filtering. It only depends on
+ * the C library so that tools/trace_replay.c can run recorded traces through exactly the same code on a PC.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ESP_ERR_ULTRASONIC_PING_TIMEOUT 0x201
+#define ESP_ERR_ULTRASONIC_ECHO_TIMEOUT 0x202
+#define ESP_ERR_ULTRASONIC_TOO_CLOSE 0x203
+
+/*
+ * The measurement path is integer only, as the ESP32-C6 has no FPU. Echo times are in microseconds and
+ * distances in micrometres. The time to distance scale factor is a Q16.16 fixed point constant, so a
+ * conversion is one multiply and a shift.
+ */
+typedef int32_t q16_16_t;
+#define Q16_ONE (1 << 16)
+#define Q16_FROM_INT(x) ((q16_16_t)(x) << 16)
+#define Q16_MUL_INT(q, x) ((int32_t)(((int64_t)(q) * (x) + (Q16_ONE / 2)) >> 16)) // rounds to nearest
+
+#define ROUNDTRIP_US_PER_CM 58.2377                   // only used by the benchmark and host tools
+#define DISTANCE_UM_PER_US_Q16 ((q16_16_t)11253192)    // 10000 / ROUNDTRIP_US_PER_CM in Q16.16
+#define DISTANCE_UM_PER_CM 10000
+#define DISTANCE_MAX_PINGS 32
+
+typedef enum {
+    DISTANCE_FILTER_MEAN,
+    DISTANCE_FILTER_MEDIAN,
+} distance_filter_t;
+
+typedef struct {
+    int num_pings;       // pings combined into one reading, at most DISTANCE_MAX_PINGS
+    int max_retries;     // a failed ping is retried this many times before the reading fails
+    int32_t min_echo_us; // shorter echoes are the transducer still ringing, 0 to accept any
+    distance_filter_t filter;
+} distance_params_t;
+
+// Takes ping number ping of a reading, or a retry of it. Returns 0 and the echo time, or an error code.
+typedef int (*distance_ping_t)(void *ctx, int ping, bool retry, int32_t *echo_us);
+
+int32_t convert_time_to_um(int32_t echo_us);
+
+int32_t distance_filter_mean_um(const int32_t *samples, int n);
+
+// Reorders samples
+int32_t distance_filter_median_um(int32_t *samples, int n);
+
+// Combines n distances into one with a filter chosen at run time, for the shadow parameters and host tools. The
+// sensor's own readings use the filter picked in menuconfig directly. The median filter reorders samples.
+int32_t distance_filter_um(distance_filter_t filter, int32_t *samples, int n);
+
+// True if every sample is within tolerance of reference. Ghost echoes from an earlier ping show up as outliers.
+bool distance_samples_agree(int32_t reference, const int32_t *samples, int n, int32_t tolerance);
+
+// Takes a reading using ping, filtered with params->filter. Returns 0, or the error of the last attempt of the ping
+// that failed. Used by tools/trace_replay.c, the firmware filters the result of distance_read_pings().
+int distance_read_filtered(const distance_params_t *params, distance_ping_t ping, void *ctx, int32_t *distance_um);
+
+// Takes a reading using ping, but returns the num_pings distances of the reading unfiltered and in ping order
+int distance_read_pings(const distance_params_t *params, distance_ping_t ping, void *ctx, int32_t *samples_um);
+
+#endif // __DISTANCE_FILTER_H__
@@ -1,26 +1,78 @@
 #include "distance_sensor.h"
+#include "distance_trace.h"
 
+#include <esp_cpu.h>
 #include <esp_timer.h>
 #include <inttypes.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <rom/ets_sys.h>
+#include <sdkconfig.h>
+#include <string.h>
+#include <sys/time.h>
 
 #define NUM_SENSOR_ERROR_RETRIES 10
-#define NUM_SENSOR_AVERAGE 5.0f
+#define NUM_SENSOR_AVERAGE CONFIG_DISTANCE_SENSOR_NUM_AVERAGE
 #define TRIGGER_LOW_DELAY 4
+#define PING_TIMEOUT CONFIG_DISTANCE_SENSOR_PING_TIMEOUT_US
+#define MAX_ECHO_TIME (CONFIG_DISTANCE_SENSOR_MAX_RANGE_CM * 58238 / 1000) // us, round trip at ROUNDTRIP_US_PER_CM
+#define DATASHEET_PING_SPACING 60000 // us, trigger to trigger
+#define CALIBRATION_PINGS 8
+#define GHOST_TOLERANCE_US 30 // about 5mm
+
+#if CONFIG_DISTANCE_SENSOR_JSN_SR04T
+#define TRIGGER_HIGH_DELAY 20
+#define MIN_ECHO_TIME 1165 // us, about 20cm. Shorter echoes are the transducer still ringing from the ping.
+#else
 #define TRIGGER_HIGH_DELAY 10
-#define PING_TIMEOUT 600000
-#define ROUNDTRIP_CM 58.2377
-#define MAX_ECHO_TIME 250 * ROUNDTRIP_CM // 10cm max distance
-#define MAX_DISTANCE 7.0f // The maximum distance accepted for a 
+#define MIN_ECHO_TIME 0
+#endif
+
+// Resolved at build time, so a reading does not branch on the filter
+#if CONFIG_DISTANCE_SENSOR_FILTER_MEDIAN
+#define SENSOR_FILTER DISTANCE_FILTER_MEDIAN
+#define sensor_filter_um distance_filter_median_um
+#else
+#define SENSOR_FILTER DISTANCE_FILTER_MEAN
+#define sensor_filter_um distance_filter_mean_um
+#endif
+
+_Static_assert(GPIO_IS_VALID_OUTPUT_GPIO(CONFIG_DISTANCE_SENSOR_TRIGGER_GPIO), "trigger GPIO cannot be used as an output on this target");
+_Static_assert(GPIO_IS_VALID_GPIO(CONFIG_DISTANCE_SENSOR_ECHO_GPIO), "echo GPIO does not exist on this target");
+_Static_assert(CONFIG_DISTANCE_SENSOR_TRIGGER_GPIO != CONFIG_DISTANCE_SENSOR_ECHO_GPIO, "trigger and echo need separate GPIOs");
+_Static_assert(MAX_ECHO_TIME < PING_TIMEOUT, "ping timeout must be longer than the echo from the maximum range");
+_Static_assert(MIN_ECHO_TIME < MAX_ECHO_TIME, "maximum range is below the sensor's minimum distance");
+_Static_assert(NUM_SENSOR_AVERAGE <= DISTANCE_MAX_PINGS, "too many pings per reading");
+_Static_assert(MAX_ECHO_TIME <= UINT16_MAX, "echo times must fit the trace records");
+
+static const distance_params_t params = {
+    .num_pings = NUM_SENSOR_AVERAGE,
+    .max_retries = NUM_SENSOR_ERROR_RETRIES,
+    .min_echo_us = MIN_ECHO_TIME,
+    .filter = SENSOR_FILTER,
+};
+
 static const char *TAG = "DISTANCE_SENSOR";
 
+static portMUX_TYPE spacing_lock = portMUX_INITIALIZER_UNLOCKED; // guards spacing, the rest is sampler task only
+static distance_spacing_t spacing = {.floor_us = DATASHEET_PING_SPACING, .spacing_us = DATASHEET_PING_SPACING};
+static int64_t last_trigger_us;
+
 esp_err_t distance_init(const distance_sensor_t *dev) {
     gpio_set_direction(dev->trigger_pin, GPIO_MODE_OUTPUT);
     gpio_set_direction(dev->echo_pin, GPIO_MODE_INPUT);
     return gpio_set_level(dev->trigger_pin, 0);
 }
 
-esp_err_t distance_measure_cm(const distance_sensor_t *dev, float *distance) {
+esp_err_t distance_measure_echo_us(const distance_sensor_t *dev, int32_t *echo_us) {
+    // A module still sending the previous echo pulse ignores the trigger
+    int64_t idle_start = esp_timer_get_time();
+    while (gpio_get_level(dev->echo_pin)) {
+        if (timeout_expired(idle_start, PING_TIMEOUT)) {
+            return ESP_ERR_ULTRASONIC_PING_TIMEOUT;
+        }
+    }
+
     gpio_set_level(dev->trigger_pin, 0);
     ets_delay_us(TRIGGER_LOW_DELAY);
     gpio_set_level(dev->trigger_pin, 1);
@@ -46,28 +98,124 @@ esp_err_t distance_measure_cm(const distance_sensor_t *dev, float *distance) {
         }
     }
 
-    int64_t time_delta = time - echo_start;
-    convert_time_to_cm(time_delta, distance);
+    *echo_us = time - echo_start;
     return ESP_OK;
 }
 
-void convert_time_to_cm(volatile int64_t time, float *distance) {
-    float calculated_distance = (float)time / ROUNDTRIP_CM;
-    *distance = calculated_distance;
-}
-
 bool timeout_expired(int64_t time, int64_t dur) {
     int64_t curr_dur = esp_timer_get_time() - time;
     return curr_dur >= dur;
 }
 
-float get_temperature_cm() {
-    return 0.0f;
+#if CONFIG_DISTANCE_SENSOR_TRACE
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+static distance_trace_record_t trace[CONFIG_DISTANCE_SENSOR_TRACE_ENTRIES];
+static uint32_t trace_head; // total records written, the ring index is this modulo the ring size
+
+static void trace_record(int ping, bool retry, esp_err_t res, int32_t echo_us) {
+    distance_trace_record_t record = {
+        .time_ms = esp_timer_get_time() / 1000,
+        .echo_us = echo_us,
+        .result = res == ESP_OK                                ? DISTANCE_TRACE_OK
+                  : res == ESP_ERR_ULTRASONIC_PING_TIMEOUT ? DISTANCE_TRACE_PING_TIMEOUT
+                                                             : DISTANCE_TRACE_ECHO_TIMEOUT,
+        .flags = (ping == 0 && !retry ? DISTANCE_TRACE_FLAG_READING_START : 0) | (retry ? DISTANCE_TRACE_FLAG_RETRY : 0),
+    };
+    portENTER_CRITICAL(&trace_lock);
+    trace[trace_head % CONFIG_DISTANCE_SENSOR_TRACE_ENTRIES] = record;
+    trace_head++;
+    portEXIT_CRITICAL(&trace_lock);
 }
 
-esp_err_t get_distance(const distance_sensor_t *dev, float *distance) {
-    esp_err_t res = distance_measure_cm(dev, distance);
-    if (res != ESP_OK) {
+esp_err_t distance_trace_dump(distance_trace_sink_t sink, void *ctx) {
+    portENTER_CRITICAL(&trace_lock);
+    uint32_t head = trace_head;
+    portEXIT_CRITICAL(&trace_lock);
+    uint32_t count = head < CONFIG_DISTANCE_SENSOR_TRACE_ENTRIES ? head : CONFIG_DISTANCE_SENSOR_TRACE_ENTRIES;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    distance_trace_header_t header = {
+        .version = DISTANCE_TRACE_VERSION,
+        .record_size = sizeof(distance_trace_record_t),
+        .num_records = count,
+        .dropped = head - count,
+        .uptime_us = esp_timer_get_time(),
+        .epoch_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec,
+        .num_pings = params.num_pings,
+        .max_retries = params.max_retries,
+        .filter = params.filter,
+        .min_echo_us = params.min_echo_us,
+        .max_echo_us = MAX_ECHO_TIME,
+    };
+    memcpy(header.magic, DISTANCE_TRACE_MAGIC, sizeof(header.magic));
+    esp_err_t err = sink(ctx, (const char *)&header, sizeof(header));
+
+    // Copied out in small batches so the sampler is never held up for long. Records overwritten during the
+    // dump are sent as they are now, the replay tool only relies on their order.
+    distance_trace_record_t batch[32];
+    for (uint32_t seq = head - count; err == ESP_OK && seq != head;) {
+        uint32_t n = head - seq < 32 ? head - seq : 32;
+        portENTER_CRITICAL(&trace_lock);
+        for (uint32_t i = 0; i < n; i++) {
+            batch[i] = trace[(seq + i) % CONFIG_DISTANCE_SENSOR_TRACE_ENTRIES];
+        }
+        portEXIT_CRITICAL(&trace_lock);
+        err = sink(ctx, (const char *)batch, n * sizeof(distance_trace_record_t));
+        seq += n;
+    }
+    return err;
+}
+#endif
+
+// Shortest safe spacing after a ping with this echo time, 0 if it failed
+static uint32_t spacing_for_echo(int32_t echo_us) {
+#if CONFIG_DISTANCE_SENSOR_ADAPTIVE_SPACING
+    if (echo_us > 0) {
+        int32_t residual_us = CONFIG_DISTANCE_SENSOR_RESIDUAL_ECHOES * echo_us;
+        return (residual_us > MAX_ECHO_TIME ? residual_us : MAX_ECHO_TIME) + CONFIG_DISTANCE_SENSOR_RINGDOWN_US;
+    }
+#endif
+    return DATASHEET_PING_SPACING;
+}
+
+static void update_spacing(int32_t echo_us) {
+    uint32_t next_us = spacing_for_echo(echo_us);
+    portENTER_CRITICAL(&spacing_lock);
+    spacing.spacing_us = next_us > spacing.floor_us ? next_us : spacing.floor_us;
+    portEXIT_CRITICAL(&spacing_lock);
+}
+
+// Waits until spacing_us after the last trigger. Whole ticks are slept so lower priority tasks can run.
+static void wait_for_spacing(uint32_t spacing_us) {
+    int64_t deadline = last_trigger_us + spacing_us;
+    int64_t remaining = deadline - esp_timer_get_time();
+    if (remaining > 2000LL * portTICK_PERIOD_MS) {
+        vTaskDelay(remaining / (1000LL * portTICK_PERIOD_MS) - 1);
+        remaining = deadline - esp_timer_get_time();
+    }
+    if (remaining > 0) {
+        ets_delay_us(remaining);
+    }
+}
+
+// A ping at the given spacing from the previous one, without the logging and tracing of a reading
+static esp_err_t spaced_ping(const distance_sensor_t *dev, uint32_t spacing_us, int32_t *echo_us) {
+    wait_for_spacing(spacing_us);
+    last_trigger_us = esp_timer_get_time();
+    return distance_measure_echo_us(dev, echo_us);
+}
+
+static int sensor_ping(void *ctx, int ping, bool retry, int32_t *echo_us) {
+    portENTER_CRITICAL(&spacing_lock);
+    uint32_t spacing_us = spacing.spacing_us;
+    portEXIT_CRITICAL(&spacing_lock);
+    esp_err_t res = spaced_ping(ctx, spacing_us, echo_us); // lets the previous ping's echoes die down
+    update_spacing(res == ESP_OK ? *echo_us : 0);
+#if CONFIG_DISTANCE_SENSOR_TRACE
+    trace_record(ping, retry, res, res == ESP_ERR_ULTRASONIC_ECHO_TIMEOUT ? MAX_ECHO_TIME : res == ESP_OK ? *echo_us : 0);
+#endif
+    if (res != ESP_OK && !retry) {
         ESP_LOGE(TAG, "Sensor Error %d: ", res);
         switch (res) {
         case ESP_ERR_ULTRASONIC_PING_TIMEOUT:
@@ -80,34 +228,154 @@ esp_err_t get_distance(const distance_sensor_t *dev, float *distance) {
             ESP_LOGE(TAG, "UNKNOWN sensor error - %s", esp_err_to_name(res));
             break;
         }
-        int num_errors = 0;
-        while (num_errors < NUM_SENSOR_ERROR_RETRIES && res != ESP_OK) { // attempt to get sensor reading
-            num_errors++;
-            ets_delay_us(60000);
-            res = distance_measure_cm(dev, distance);
+    }
+    return res;
+}
+
+static esp_err_t reading_result(int res) {
+    if (res == ESP_ERR_ULTRASONIC_TOO_CLOSE) {
+        ESP_LOGE(TAG, "Sensor echo shorter than the minimum distance - water is likely too close to the sensor");
+    }
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "FAILED TO GET SENSOR READING AFTER %i reties", NUM_SENSOR_ERROR_RETRIES);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t read_filtered(const distance_sensor_t *dev, const distance_params_t *read_params, int32_t *distance_um) {
+    int32_t samples[DISTANCE_MAX_PINGS];
+    esp_err_t err = reading_result(distance_read_pings(read_params, sensor_ping, (void *)dev, samples));
+    if (err == ESP_OK) {
+        *distance_um = sensor_filter_um(samples, read_params->num_pings);
+    }
+    return err;
+}
+
+esp_err_t get_distance_um(const distance_sensor_t *dev, int32_t *distance_um) {
+    distance_params_t single = params;
+    single.num_pings = 1;
+    return read_filtered(dev, &single, distance_um);
+}
+
+esp_err_t get_distance_average_um(const distance_sensor_t *dev, int32_t *distance_um) {
+    return read_filtered(dev, &params, distance_um);
+}
+
+esp_err_t get_distance_pings_um(const distance_sensor_t *dev, int32_t *distance_um, int32_t *pings_um, int *num_pings) {
+    esp_err_t err = reading_result(distance_read_pings(&params, sensor_ping, (void *)dev, pings_um));
+    if (err != ESP_OK) {
+        return err;
+    }
+    int32_t samples[DISTANCE_MAX_PINGS];
+    memcpy(samples, pings_um, params.num_pings * sizeof(int32_t)); // the median filter reorders
+    *distance_um = sensor_filter_um(samples, params.num_pings);
+    *num_pings = params.num_pings;
+    return ESP_OK;
+}
+
+// Takes CALIBRATION_PINGS pings spacing_us apart, returns false if any failed
+static bool calibration_burst(const distance_sensor_t *dev, uint32_t spacing_us, int32_t *echo_us) {
+    for (int i = 0; i < CALIBRATION_PINGS; i++) {
+        if (spaced_ping(dev, spacing_us, &echo_us[i]) != ESP_OK) {
+            return false;
         }
-        if (res != ESP_OK) {
-            ESP_LOGE(TAG, "FAILED TO GET SENSOR READING AFTER %i reties", NUM_SENSOR_ERROR_RETRIES);
-            return ESP_FAIL;
-        } else {
-            return ESP_OK;
+    }
+    return true;
+}
+
+esp_err_t distance_calibrate_spacing(const distance_sensor_t *dev) {
+#if CONFIG_DISTANCE_SENSOR_ADAPTIVE_SPACING
+    int32_t reference[CALIBRATION_PINGS];
+    if (!calibration_burst(dev, DATASHEET_PING_SPACING, reference)) {
+        return ESP_FAIL;
+    }
+    int32_t echo_us = distance_filter_median_um(reference, CALIBRATION_PINGS);
+    int32_t tolerance_us = echo_us / 50 > GHOST_TOLERANCE_US ? echo_us / 50 : GHOST_TOLERANCE_US;
+    if (!distance_samples_agree(echo_us, reference, CALIBRATION_PINGS, tolerance_us)) {
+        return ESP_ERR_INVALID_STATE; // the water is moving too much to tell ghosts apart
+    }
+
+    // Each step is a quarter faster, down to what the echo time allows
+    uint32_t limit_us = spacing_for_echo(echo_us);
+    uint32_t fastest_us = DATASHEET_PING_SPACING;
+    uint32_t ghost_us = 0;
+    while (fastest_us > limit_us) {
+        uint32_t try_us = fastest_us * 3 / 4 > limit_us ? fastest_us * 3 / 4 : limit_us;
+        int32_t burst[CALIBRATION_PINGS];
+        if (!calibration_burst(dev, try_us, burst) ||
+            !distance_samples_agree(echo_us, burst, CALIBRATION_PINGS, tolerance_us)) {
+            ghost_us = try_us;
+            break;
         }
+        fastest_us = try_us;
     }
+    // Right next to where ghosts appeared, so leave some margin
+    uint32_t floor_us = ghost_us ? fastest_us + fastest_us / 4 : fastest_us;
+    floor_us = floor_us < DATASHEET_PING_SPACING ? floor_us : DATASHEET_PING_SPACING;
+
+    portENTER_CRITICAL(&spacing_lock);
+    spacing.calibrated = true;
+    spacing.floor_us = floor_us;
+    spacing.ghost_us = ghost_us;
+    portEXIT_CRITICAL(&spacing_lock);
+    update_spacing(echo_us);
     return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void distance_get_spacing(distance_spacing_t *out) {
+    portENTER_CRITICAL(&spacing_lock);
+    *out = spacing;
+    portEXIT_CRITICAL(&spacing_lock);
 }
 
-esp_err_t get_distance_average(const distance_sensor_t *dev, float *distance) {
-    float sum = 0;
-    for (int i = 0; i < NUM_SENSOR_AVERAGE; i++) {
-        ets_delay_us(60000);
-        float measurement;
-        esp_err_t err = get_distance(dev, &measurement);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Cannot get average - sensor fail");
-            return ESP_FAIL;
+#if CONFIG_DISTANCE_SENSOR_BENCHMARK
+#define BENCHMARK_SAMPLES 1000
+
+void distance_benchmark(void) {
+    // Synthetic echo times covering the sensor's range, generated up front so both paths see the same input
+    static int32_t echo_us[BENCHMARK_SAMPLES];
+    uint32_t seed = 1;
+    for (int i = 0; i < BENCHMARK_SAMPLES; i++) {
+        seed = seed * 1103515245 + 12345;
+        echo_us[i] = 300 + (seed >> 16) % (MAX_ECHO_TIME - 300);
+    }
+
+    // The previous implementation: per ping float division by a double constant, float average and compare
+    volatile float float_trigger = 3.0f;
+    volatile int float_hits = 0;
+    esp_cpu_cycle_count_t start = esp_cpu_get_cycle_count();
+    for (int i = 0; i + NUM_SENSOR_AVERAGE <= BENCHMARK_SAMPLES; i += NUM_SENSOR_AVERAGE) {
+        float sum = 0;
+        for (int j = 0; j < NUM_SENSOR_AVERAGE; j++) {
+            float distance = (float)echo_us[i + j] / ROUNDTRIP_US_PER_CM;
+            sum += distance;
+        }
+        if (sum / (float)NUM_SENSOR_AVERAGE >= float_trigger) {
+            float_hits++;
         }
-        sum += measurement;
     }
-    *distance = sum / NUM_SENSOR_AVERAGE;
-    return ESP_OK;
+    esp_cpu_cycle_count_t float_cycles = esp_cpu_get_cycle_count() - start;
+
+    volatile int32_t fixed_trigger = 3 * DISTANCE_UM_PER_CM;
+    volatile int fixed_hits = 0;
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i + NUM_SENSOR_AVERAGE <= BENCHMARK_SAMPLES; i += NUM_SENSOR_AVERAGE) {
+        int32_t sum = 0;
+        for (int j = 0; j < NUM_SENSOR_AVERAGE; j++) {
+            sum += convert_time_to_um(echo_us[i + j]);
+        }
+        if (sum / NUM_SENSOR_AVERAGE >= fixed_trigger) {
+            fixed_hits++;
+        }
+    }
+    esp_cpu_cycle_count_t fixed_cycles = esp_cpu_get_cycle_count() - start;
+
+    ESP_LOGW(TAG, "Conversion benchmark over %d pings: float %" PRIu32 " cycles/ping, fixed point %" PRIu32 " cycles/ping",
+             BENCHMARK_SAMPLES, (uint32_t)(float_cycles / BENCHMARK_SAMPLES), (uint32_t)(fixed_cycles / BENCHMARK_SAMPLES));
+    ESP_LOGW(TAG, "Averages past the trigger: float %d, fixed point %d", float_hits, fixed_hits);
 }
+#endif
@@ -2,26 +2,59 @@
 #define __DISTANCE_SENSOR_H__
 
 
+#include "distance_filter.h"
+
 #include <driver/gpio.h>
 #include <esp_err.h>
 #include <esp_log.h>
-
-#define ESP_ERR_ULTRASONIC_PING_TIMEOUT 0x201
-#define ESP_ERR_ULTRASONIC_ECHO_TIMEOUT 0x202
+#include <sdkconfig.h>
 
 typedef struct
 {
-    gpio_num_t trigger_pin; 
-    gpio_num_t echo_pin;    
+    gpio_num_t trigger_pin;
+    gpio_num_t echo_pin;
 } distance_sensor_t;
 
+#define DISTANCE_SENSOR_DEFAULT_CONFIG()                   \
+    {                                                      \
+        .trigger_pin = CONFIG_DISTANCE_SENSOR_TRIGGER_GPIO, \
+        .echo_pin = CONFIG_DISTANCE_SENSOR_ECHO_GPIO,       \
+    }
 
 esp_err_t distance_init(const distance_sensor_t *dev);
-esp_err_t get_distance(const distance_sensor_t *dev, float *distance);
-esp_err_t get_distance_average(const distance_sensor_t *dev, float *distance);
-esp_err_t distance_measure_cm(const distance_sensor_t *dev, float *distance);
-void convert_time_to_cm(volatile int64_t time, float *distance);
+esp_err_t get_distance_um(const distance_sensor_t *dev, int32_t *distance_um);
+esp_err_t get_distance_average_um(const distance_sensor_t *dev, int32_t *distance_um);
+// As get_distance_average_um, and also returns the unfiltered distance of every ping in the reading
+esp_err_t get_distance_pings_um(const distance_sensor_t *dev, int32_t *distance_um, int32_t *pings_um, int *num_pings);
+esp_err_t distance_measure_echo_us(const distance_sensor_t *dev, int32_t *echo_us);
 bool timeout_expired(int64_t start, int64_t dur);
-float get_temperature_cm();
 
-#endif // __DISTANCE_SENSOR_H__
\ No newline at end of file
+typedef struct {
+    bool calibrated;
+    uint32_t floor_us;   // fastest spacing calibration found free of ghost echoes
+    uint32_t ghost_us;   // spacing at which calibration saw ghost echoes, 0 if none down to the model's limit
+    uint32_t spacing_us; // spacing before the next ping
+} distance_spacing_t;
+
+/*
+ * Pings are spaced from one trigger to the next by the longest of: the round trip to the maximum range, the measured
+ * echo repeated for the residual bounces between the sensor and the water, plus the transducer ringdown. Until
+ * calibrated the datasheet's 60ms is used as a lower limit. Calibration takes bursts of pings closer and closer
+ * together down to that limit, and keeps the fastest spacing whose pings all agree with a burst taken at 60ms.
+ */
+esp_err_t distance_calibrate_spacing(const distance_sensor_t *dev);
+void distance_get_spacing(distance_spacing_t *out);
+
+#if CONFIG_DISTANCE_SENSOR_TRACE
+typedef esp_err_t (*distance_trace_sink_t)(void *ctx, const char *data, size_t len);
+
+// Writes the raw ping trace, a distance_trace_header_t followed by the records, oldest first
+esp_err_t distance_trace_dump(distance_trace_sink_t sink, void *ctx);
+#endif
+
+#if CONFIG_DISTANCE_SENSOR_BENCHMARK
+// Logs CPU cycles per sample for the integer conversion and averaging path against the old soft-float path
+void distance_benchmark(void);
+#endif
+
+#endif // __DISTANCE_SENSOR_H__
@@ -0,0 +1,47 @@
+#ifndef __DISTANCE_TRACE_H__
+#define __DISTANCE_TRACE_H__
+
+/*
+ * Format of the raw ping trace served on /trace and read by tools/trace_replay.c. Every ping, including retries,
+ * is recorded with what the sensor actually returned, before any filtering. All fields are little endian.
+ */
+
+#include <stdint.h>
+
+#define DISTANCE_TRACE_MAGIC "ETRC"
+#define DISTANCE_TRACE_VERSION 1
+
+typedef enum {
+    DISTANCE_TRACE_OK,
+    DISTANCE_TRACE_PING_TIMEOUT, // the echo pulse never started
+    DISTANCE_TRACE_ECHO_TIMEOUT, // the echo pulse did not end within the maximum range
+} distance_trace_result_t;
+
+#define DISTANCE_TRACE_FLAG_READING_START 0x01 // first ping of a filtered reading
+#define DISTANCE_TRACE_FLAG_RETRY 0x02
+
+typedef struct __attribute__((packed)) {
+    uint32_t time_ms; // time since boot
+    uint16_t echo_us;
+    uint8_t result;   // distance_trace_result_t
+    uint8_t flags;
+} distance_trace_record_t;
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t num_records; // records following the header, oldest first
+    uint32_t dropped;     // records overwritten before they could be dumped
+    int64_t uptime_us;    // when the dump was taken, to line record times up with the wall clock
+    int64_t epoch_us;
+    // The reading parameters the device was running with, used as the replay defaults
+    uint8_t num_pings;
+    uint8_t max_retries;
+    uint8_t filter; // distance_filter_t
+    uint8_t reserved;
+    int32_t min_echo_us;
+    int32_t max_echo_us;
+} distance_trace_header_t;
+
+#endif // __DISTANCE_TRACE_H__
@@ -0,0 +1,37 @@
+#include "boot_timing.h"
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t phase_us[BOOT_PHASE_COUNT];
+
+static const char *phase_names[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_HARDWARE] = "hardware",
+    [BOOT_PHASE_STORAGE] = "storage",
+    [BOOT_PHASE_CONTROL] = "control",
+    [BOOT_PHASE_FIRST_SAMPLE] = "first_sample",
+    [BOOT_PHASE_TIME] = "time",
+    [BOOT_PHASE_WIFI] = "wifi",
+    [BOOT_PHASE_HTTP] = "http",
+};
+
+void boot_mark(boot_phase_t phase) {
+    int64_t now = esp_timer_get_time(); // esp_timer starts counting during early startup, close enough to reset
+    portENTER_CRITICAL(&lock);
+    if (!phase_us[phase]) {
+        phase_us[phase] = now;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+int64_t boot_phase_us(boot_phase_t phase) {
+    portENTER_CRITICAL(&lock);
+    int64_t us = phase_us[phase];
+    portEXIT_CRITICAL(&lock);
+    return us ? us : -1;
+}
+
+const char *boot_phase_name(boot_phase_t phase) {
+    return phase_names[phase];
+}
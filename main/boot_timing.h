@@ -0,0 +1,25 @@
+#ifndef __BOOT_TIMING_H__
+#define __BOOT_TIMING_H__
+
+#include <stdint.h>
+
+// Boot is split over several tasks, so phases can complete in any order
+typedef enum {
+    BOOT_PHASE_HARDWARE,     // pump forced off and sensor pins set up
+    BOOT_PHASE_STORAGE,      // NVS open and config loaded
+    BOOT_PHASE_CONTROL,      // sampler and control tasks running
+    BOOT_PHASE_FIRST_SAMPLE, // first level reading of this boot
+    BOOT_PHASE_TIME,         // clock usable, from RTC memory or NTP
+    BOOT_PHASE_WIFI,         // connected with an IP address
+    BOOT_PHASE_HTTP,         // web server accepting requests
+    BOOT_PHASE_COUNT,
+} boot_phase_t;
+
+// Records the time since reset at which phase completed. Later calls for the same phase are ignored.
+void boot_mark(boot_phase_t phase);
+
+// Microseconds from reset to the end of phase, or -1 if it has not completed yet
+int64_t boot_phase_us(boot_phase_t phase);
+const char *boot_phase_name(boot_phase_t phase);
+
+#endif // __BOOT_TIMING_H__
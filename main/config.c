@@ -0,0 +1,317 @@
+#include "config.h"
+#include "log_events.h"
+
+#include <distance_sensor.h>
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NVS_KEY_CONFIG "config"
+#define CONFIG_SCHEMA 2
+#define CONFIG_SCHEMA_FLOAT_LEVEL 1 // first schema, stored the trigger level as a float in cm
+#define DEFAULT_TRIGGER_LEVEL_UM (3 * DISTANCE_UM_PER_CM)
+#define DEFAULT_TRIGGER_HOUR 14
+#define DEFAULT_TRIGGER_MINUTE 30
+#define DEFAULT_TRIGGER_DAYS 9          // Monday and Thursday
+#define DEFAULT_NUM_BELOW_TRIGGER 3     // the number of sensor readings that must be below the trigger value for it to count
+#define DEFAULT_MAX_TOPUP_TIME_MS 15000 // prevents a sensor issue from causing the topup to never end
+#define DEFAULT_WINDOW_START_HOUR 8
+#define DEFAULT_WINDOW_END_HOUR 20
+#define DEFAULT_FILL_LEVEL_UM (2 * DISTANCE_UM_PER_CM)
+#define DEFAULT_START_SAMPLES 3
+#define DEFAULT_MIN_FILL_INTERVAL_S 1800
+#define DEFAULT_DAILY_PUMP_BUDGET_MS 120000
+#define DEFAULT_PUMP_MAX_DUTY 100
+#define DEFAULT_PUMP_MIN_DUTY 40
+#define DEFAULT_PUMP_SOFT_START_MS 500
+#define DEFAULT_PUMP_TAPER_UM (DISTANCE_UM_PER_CM / 2)
+
+// Legacy keys written by firmware that stored each setting separately. Only read once to migrate.
+#define NVS_KEY_TRIGGER_LEVEL "trigger_level"
+#define NVS_KEY_TRIGGER_HOUR "trigger_hour"
+#define NVS_KEY_TRIGGER_MINUTE "trigger_minute"
+#define NVS_KEY_TRIGGER_DAYS "trigger_days"
+
+typedef enum {
+    FIELD_UM_AS_CM, // int32_t micrometres, exchanged as cm in JSON
+    FIELD_U8,
+    FIELD_U32,
+} field_type_t;
+
+typedef struct {
+    const char *key;
+    field_type_t type;
+    size_t offset;
+    double min;
+    double max;
+} config_field_t;
+
+#define FIELD(name, type, min, max) {#name, type, offsetof(app_config_t, name), min, max}
+#define FIELD_CM(key, name, min, max) {key, FIELD_UM_AS_CM, offsetof(app_config_t, name), min, max}
+
+// JSON key, storage type and allowed range of every tunable. GET and PATCH /config are driven entirely by this table.
+static const config_field_t fields[] = {
+    FIELD_CM("trigger_level", trigger_level_um, 0.5, 400),
+    FIELD(trigger_hour, FIELD_U8, 0, 23),
+    FIELD(trigger_minute, FIELD_U8, 0, 59),
+    FIELD(trigger_days, FIELD_U8, 0, 0x7f),
+    FIELD(num_below_trigger, FIELD_U8, 1, 50),
+    FIELD(max_topup_time_ms, FIELD_U32, 1000, 600000),
+    FIELD(schedule_mode, FIELD_U8, SCHEDULE_FIXED, SCHEDULE_CONTINUOUS),
+    FIELD(window_start_hour, FIELD_U8, 0, 23),
+    FIELD(window_end_hour, FIELD_U8, 0, 24),
+    FIELD_CM("fill_level", fill_level_um, 0.5, 400),
+    FIELD(start_samples, FIELD_U8, 1, 50),
+    FIELD(min_fill_interval_s, FIELD_U32, 60, 86400),
+    FIELD(daily_pump_budget_ms, FIELD_U32, 1000, 3600000),
+    FIELD(pump_max_duty, FIELD_U8, 10, 100),
+    FIELD(pump_min_duty, FIELD_U8, 10, 100),
+    FIELD(pump_soft_start_ms, FIELD_U32, 0, 10000),
+    FIELD_CM("pump_taper", pump_taper_um, 0, 50),
+};
+
+// On-flash layout. The blob length tells how much of cfg was written, so older blobs are loaded as a prefix.
+typedef struct {
+    uint32_t schema;
+    uint32_t version;
+    app_config_t cfg;
+} config_blob_t;
+
+static const char *TAG = "config";
+static nvs_handle_t nvs;
+static SemaphoreHandle_t lock;
+static StaticSemaphore_t lock_buf; // static so every caller of config_get() has a lock, even if config_init() fails
+static config_blob_t current = {
+    .schema = CONFIG_SCHEMA,
+    .version = 1,
+    .cfg = {
+        .trigger_level_um = DEFAULT_TRIGGER_LEVEL_UM,
+        .trigger_hour = DEFAULT_TRIGGER_HOUR,
+        .trigger_minute = DEFAULT_TRIGGER_MINUTE,
+        .trigger_days = DEFAULT_TRIGGER_DAYS,
+        .num_below_trigger = DEFAULT_NUM_BELOW_TRIGGER,
+        .max_topup_time_ms = DEFAULT_MAX_TOPUP_TIME_MS,
+        .schedule_mode = SCHEDULE_FIXED,
+        .window_start_hour = DEFAULT_WINDOW_START_HOUR,
+        .window_end_hour = DEFAULT_WINDOW_END_HOUR,
+        .fill_level_um = DEFAULT_FILL_LEVEL_UM,
+        .start_samples = DEFAULT_START_SAMPLES,
+        .min_fill_interval_s = DEFAULT_MIN_FILL_INTERVAL_S,
+        .daily_pump_budget_ms = DEFAULT_DAILY_PUMP_BUDGET_MS,
+        .pump_max_duty = DEFAULT_PUMP_MAX_DUTY,
+        .pump_min_duty = DEFAULT_PUMP_MIN_DUTY,
+        .pump_soft_start_ms = DEFAULT_PUMP_SOFT_START_MS,
+        .pump_taper_um = DEFAULT_PUMP_TAPER_UM,
+    },
+};
+
+static double field_get(const app_config_t *cfg, const config_field_t *field) {
+    const uint8_t *p = (const uint8_t *)cfg + field->offset;
+    switch (field->type) {
+    case FIELD_UM_AS_CM:
+        return *(const int32_t *)p / (double)DISTANCE_UM_PER_CM;
+    case FIELD_U8:
+        return *p;
+    case FIELD_U32:
+        return *(const uint32_t *)p;
+    }
+    return 0;
+}
+
+static void field_set(app_config_t *cfg, const config_field_t *field, double value) {
+    uint8_t *p = (uint8_t *)cfg + field->offset;
+    switch (field->type) {
+    case FIELD_UM_AS_CM:
+        *(int32_t *)p = lround(value * DISTANCE_UM_PER_CM);
+        break;
+    case FIELD_U8:
+        *p = value;
+        break;
+    case FIELD_U32:
+        *(uint32_t *)p = value;
+        break;
+    }
+}
+
+static esp_err_t persist(const config_blob_t *blob) {
+    esp_err_t err = nvs_set_blob(nvs, NVS_KEY_CONFIG, blob, sizeof(*blob));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    return err;
+}
+
+// Reads the settings stored by older firmware so an upgrade keeps the user's configuration.
+static void migrate_legacy(app_config_t *cfg) {
+    int32_t level; // stored as cm * 1000
+    if (nvs_get_i32(nvs, NVS_KEY_TRIGGER_LEVEL, &level) == ESP_OK) {
+        cfg->trigger_level_um = level * (DISTANCE_UM_PER_CM / 1000);
+    }
+    nvs_get_u8(nvs, NVS_KEY_TRIGGER_HOUR, &cfg->trigger_hour);
+    nvs_get_u8(nvs, NVS_KEY_TRIGGER_MINUTE, &cfg->trigger_minute);
+    nvs_get_u8(nvs, NVS_KEY_TRIGGER_DAYS, &cfg->trigger_days);
+}
+
+esp_err_t config_init(nvs_handle_t handle) {
+    nvs = handle;
+    lock = xSemaphoreCreateMutexStatic(&lock_buf);
+
+    // The stored blob may be smaller (older firmware) or larger (newer firmware) than this build's struct
+    size_t length = 0;
+    esp_err_t err = nvs_get_blob(nvs, NVS_KEY_CONFIG, NULL, &length);
+    if (err == ESP_OK && length >= offsetof(config_blob_t, cfg)) {
+        config_blob_t *stored = malloc(length);
+        if (!stored) {
+            return ESP_ERR_NO_MEM;
+        }
+        err = nvs_get_blob(nvs, NVS_KEY_CONFIG, stored, &length);
+        bool usable = err == ESP_OK && (stored->schema == CONFIG_SCHEMA || stored->schema == CONFIG_SCHEMA_FLOAT_LEVEL);
+        if (usable) {
+            size_t cfg_size = length - offsetof(config_blob_t, cfg);
+            memcpy(&current.cfg, &stored->cfg, cfg_size < sizeof(app_config_t) ? cfg_size : sizeof(app_config_t));
+            current.version = stored->version;
+            if (stored->schema == CONFIG_SCHEMA_FLOAT_LEVEL) {
+                // Same layout apart from the trigger level, which held the bits of a float in cm
+                float level_cm;
+                memcpy(&level_cm, &current.cfg.trigger_level_um, sizeof(level_cm));
+                current.cfg.trigger_level_um = lroundf(level_cm * DISTANCE_UM_PER_CM);
+            }
+            ESP_LOGI(TAG, "Loaded config version %lu", (unsigned long)current.version);
+        }
+        free(stored);
+        if (usable) {
+            return ESP_OK;
+        }
+    }
+
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "No usable saved config, migrating legacy settings");
+        migrate_legacy(&current.cfg);
+        return persist(&current);
+    }
+    ESP_LOGE(TAG, "Error reading NVS (%s), using defaults", esp_err_to_name(err));
+    return err;
+}
+
+void config_get(app_config_t *cfg) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *cfg = current.cfg;
+    xSemaphoreGive(lock);
+}
+
+uint32_t config_version(void) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t version = current.version;
+    xSemaphoreGive(lock);
+    return version;
+}
+
+cJSON *config_to_json(const app_config_t *cfg, uint32_t version) {
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        cJSON_AddNumberToObject(json, fields[i].key, field_get(cfg, &fields[i]));
+    }
+    cJSON_AddNumberToObject(json, "version", version);
+    return json;
+}
+
+// Checks that only make sense across fields, on the patched copy
+static bool check_consistent(const app_config_t *cfg, char *err, size_t err_len) {
+#if CONFIG_APP_TRIGGER_WHEN_FARTHER
+    bool fill_past_trigger = cfg->fill_level_um >= cfg->trigger_level_um;
+#else
+    bool fill_past_trigger = cfg->fill_level_um <= cfg->trigger_level_um;
+#endif
+    if (cfg->schedule_mode != SCHEDULE_FIXED && fill_past_trigger) {
+        snprintf(err, err_len, "'fill_level' must be on the full side of 'trigger_level'");
+        return false;
+    }
+    if (cfg->pump_min_duty > cfg->pump_max_duty) {
+        snprintf(err, err_len, "'pump_min_duty' must not be above 'pump_max_duty'");
+        return false;
+    }
+    return true;
+}
+
+static const config_field_t *find_field(const char *key) {
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (strcmp(fields[i].key, key) == 0) {
+            return &fields[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t config_patch(const cJSON *patch, uint32_t expected_version, char *err, size_t err_len) {
+    if (!cJSON_IsObject(patch)) {
+        snprintf(err, err_len, "body must be a JSON object");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // A client that PATCHes back a whole GET body carries the version it read, which acts like If-Match
+    const cJSON *body_version = cJSON_GetObjectItem(patch, "version");
+    if (body_version && !cJSON_IsNumber(body_version)) {
+        snprintf(err, err_len, "'version' must be a number");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (expected_version == 0 && body_version) {
+        expected_version = body_version->valuedouble;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (expected_version != 0 && expected_version != current.version) {
+        snprintf(err, err_len, "config changed, current version is %lu", (unsigned long)current.version);
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    // Validate everything against a copy first so a rejected patch leaves no partial update behind
+    config_blob_t next = current;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, patch) {
+        if (item == body_version) {
+            continue;
+        }
+        const config_field_t *field = find_field(item->string);
+        if (!field) {
+            snprintf(err, err_len, "unknown field '%s'", item->string);
+            xSemaphoreGive(lock);
+            return ESP_ERR_INVALID_ARG;
+        }
+        double value = item->valuedouble;
+        if (!cJSON_IsNumber(item) || value < field->min || value > field->max ||
+            (field->type != FIELD_UM_AS_CM && value != floor(value))) {
+            snprintf(err, err_len, "'%s' must be a number from %g to %g", field->key, field->min, field->max);
+            xSemaphoreGive(lock);
+            return ESP_ERR_INVALID_ARG;
+        }
+        field_set(&next.cfg, field, value);
+    }
+    if (!check_consistent(&next.cfg, err, err_len)) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    next.version++;
+    if (next.version == 0) {
+        next.version = 1; // 0 is reserved for "no precondition"
+    }
+    esp_err_t res = persist(&next);
+    if (res == ESP_OK) {
+        current = next;
+        BINLOG(EV_CONFIG_UPDATED, current.version);
+    } else {
+        snprintf(err, err_len, "failed to save config (%s)", esp_err_to_name(res));
+    }
+    xSemaphoreGive(lock);
+    return res;
+}
@@ -0,0 +1,49 @@
+#ifndef __APP_CONFIG_H__
+#define __APP_CONFIG_H__
+
+#include <cJSON.h>
+#include <esp_err.h>
+#include <nvs.h>
+
+typedef enum {
+    SCHEDULE_FIXED,      // check the level at trigger_hour:trigger_minute on each of trigger_days
+    SCHEDULE_DEMAND,     // fill before the level is predicted to reach the trigger, within the allowed windows
+    SCHEDULE_CONTINUOUS, // fill as soon as the live readings cross the trigger, at any time of day
+} schedule_mode_t;
+
+// Every user tunable lives in this struct. It is persisted as a single NVS blob, so new fields must only ever be
+// appended to the end - an older blob is then loaded as a prefix and the new fields keep their defaults.
+// Distances are integer micrometres, the JSON API converts them to and from cm.
+typedef struct {
+    int32_t trigger_level_um;      // distance from the sensor to the water past which a topup is needed
+    uint8_t trigger_hour;          // hour of the scheduled topup check
+    uint8_t trigger_minute;        // minute of the scheduled topup check
+    uint8_t trigger_days;          // one bit per day, bit 0 is Monday and bit 6 is Sunday
+    uint8_t num_below_trigger;     // consecutive readings back within the trigger level needed to end a topup
+    uint32_t max_topup_time_ms;    // the pump is always turned off after this long, protecting against sensor faults
+    uint8_t schedule_mode;         // schedule_mode_t. In demand mode trigger_days only says which days fills may run on.
+    uint8_t window_start_hour;     // demand mode fills only run from this hour...
+    uint8_t window_end_hour;       // ...until this one, local time. Equal hours allow the whole day.
+    int32_t fill_level_um;         // demand and continuous fills top up to this level, on the full side of the trigger
+    uint8_t start_samples;         // continuous mode: consecutive readings past the trigger level that start a fill
+    uint32_t min_fill_interval_s;  // continuous mode: shortest time from one fill to the next
+    uint32_t daily_pump_budget_ms; // continuous mode: pump time per day after which no more fills are started
+    uint8_t pump_max_duty;         // PWM duty in %, the pump's flow away from the target
+    uint8_t pump_min_duty;         // PWM duty in % at the start of the soft start and at the end of the taper
+    uint32_t pump_soft_start_ms;   // ramp from pump_min_duty to pump_max_duty after the pump switches on
+    int32_t pump_taper_um;         // the flow falls to pump_min_duty over this last distance before the target
+} app_config_t;
+
+esp_err_t config_init(nvs_handle_t handle);
+void config_get(app_config_t *cfg);
+uint32_t config_version(void);
+cJSON *config_to_json(const app_config_t *cfg, uint32_t version);
+
+/*
+ * Validates every member of patch and applies them as one atomic update with a single NVS commit.
+ * If expected_version is non-zero and does not match the current version, nothing is changed and
+ * ESP_ERR_INVALID_VERSION is returned. Validation failures return ESP_ERR_INVALID_ARG with a reason in err.
+ */
+esp_err_t config_patch(const cJSON *patch, uint32_t expected_version, char *err, size_t err_len);
+
+#endif // __APP_CONFIG_H__
@@ -0,0 +1,111 @@
+#include "http_async.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+
+#define WORKER_PRIORITY 5
+
+_Static_assert(CONFIG_APP_HTTPD_MAX_SOCKETS > CONFIG_APP_HTTPD_ASYNC_WORKERS,
+               "every worker holds a socket open, leave at least one for new connections");
+
+typedef struct {
+    httpd_req_t *req;
+    http_async_handler_t handler;
+    int64_t queued_at;
+} http_async_job_t;
+
+static const char *TAG = "http_async";
+static QueueHandle_t jobs;
+static TaskHandle_t workers[CONFIG_APP_HTTPD_ASYNC_WORKERS];
+static portMUX_TYPE metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+static http_async_metrics_t metrics;
+
+static void record(int64_t queued_us, int64_t process_us) {
+    portENTER_CRITICAL(&metrics_lock);
+    metrics.completed++;
+    metrics.queue_total_us += queued_us;
+    metrics.process_total_us += process_us;
+    if (queued_us > metrics.queue_max_us) {
+        metrics.queue_max_us = queued_us;
+    }
+    if (process_us > metrics.process_max_us) {
+        metrics.process_max_us = process_us;
+    }
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+static void worker_task(void *arg) {
+    http_async_job_t job;
+    while (true) {
+        if (xQueueReceive(jobs, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        int64_t started = esp_timer_get_time();
+        job.handler(job.req);
+        int64_t finished = esp_timer_get_time();
+
+        if (httpd_req_async_handler_complete(job.req) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to complete async request");
+        }
+        record(started - job.queued_at, finished - started);
+    }
+}
+
+esp_err_t http_async_init(void) {
+    jobs = xQueueCreate(CONFIG_APP_HTTPD_ASYNC_QUEUE_LEN, sizeof(http_async_job_t));
+    if (!jobs) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < CONFIG_APP_HTTPD_ASYNC_WORKERS; i++) {
+        if (xTaskCreate(worker_task, "http_worker", CONFIG_APP_HTTPD_WORKER_STACK_SIZE, NULL, WORKER_PRIORITY, &workers[i]) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start worker %d", i);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+bool http_async_is_worker(void) {
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < CONFIG_APP_HTTPD_ASYNC_WORKERS; i++) {
+        if (workers[i] == current) {
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t http_async_submit(httpd_req_t *req, http_async_handler_t handler) {
+    http_async_job_t job = {
+        .handler = handler,
+        .queued_at = esp_timer_get_time(),
+    };
+    // The copy keeps the socket open after the server task returns from the original handler
+    esp_err_t err = httpd_req_async_handler_begin(req, &job.req);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start async request (%s)", esp_err_to_name(err));
+        return httpd_resp_send_500(req);
+    }
+
+    if (xQueueSend(jobs, &job, 0) != pdTRUE) {
+        httpd_req_async_handler_complete(job.req);
+        portENTER_CRITICAL(&metrics_lock);
+        metrics.rejected++;
+        portEXIT_CRITICAL(&metrics_lock);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        return httpd_resp_sendstr(req, "Server busy, try again");
+    }
+    return ESP_OK;
+}
+
+void http_async_get_metrics(http_async_metrics_t *out) {
+    portENTER_CRITICAL(&metrics_lock);
+    *out = metrics;
+    portEXIT_CRITICAL(&metrics_lock);
+    out->queue_depth = uxQueueMessagesWaiting(jobs);
+}
@@ -0,0 +1,34 @@
+#ifndef __HTTP_ASYNC_H__
+#define __HTTP_ASYNC_H__
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include <stdbool.h>
+
+typedef esp_err_t (*http_async_handler_t)(httpd_req_t *req);
+
+typedef struct {
+    uint32_t completed;     // requests run to completion on a worker
+    uint32_t rejected;      // requests answered with 503 because the queue was full
+    uint32_t queue_depth;   // requests currently waiting for a worker
+    int64_t queue_total_us; // time spent waiting for a worker, summed over completed requests
+    int64_t queue_max_us;
+    int64_t process_total_us; // time spent in the handler, summed over completed requests
+    int64_t process_max_us;
+} http_async_metrics_t;
+
+// Starts the worker tasks. Sizes come from the "HTTP server" Kconfig menu.
+esp_err_t http_async_init(void);
+
+// True when called from one of the worker tasks
+bool http_async_is_worker(void);
+
+/*
+ * Hands req over to a worker which calls handler with it, freeing the server task for other clients.
+ * Slow handlers call this first thing when http_async_is_worker() is false and return its result.
+ */
+esp_err_t http_async_submit(httpd_req_t *req, http_async_handler_t handler);
+
+void http_async_get_metrics(http_async_metrics_t *metrics);
+
+#endif // __HTTP_ASYNC_H__
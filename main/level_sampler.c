@@ -0,0 +1,185 @@
+#include "level_sampler.h"
+#include "boot_timing.h"
+#include "log_events.h"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_rtc_time.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+
+#define SAMPLER_PRIORITY 6 // above the HTTP workers, the echo timing is busy waited
+#define SAMPLER_STACK_SIZE 3072
+#define WAIT_POLL_MS 20
+#define WARM_STATE_MAGIC 0x4c564c31
+#define CALIBRATION_ATTEMPTS 5 // one after each of the first good readings, the water has to be still
+
+/*
+ * State kept in RTC memory, which survives software and watchdog resets but not power loss. Guarded by lock.
+ * Only ever append fields - a reset does not reinitialise RTC_NOINIT_ATTR variables.
+ */
+typedef struct {
+    uint32_t magic;
+    int32_t level_um; // last good filtered reading
+    uint64_t rtc_us;  // RTC slow clock when it was taken, the RTC timer keeps counting through a reset
+} warm_state_t;
+
+static const char *TAG = "sampler";
+RTC_NOINIT_ATTR static warm_state_t warm_state;
+
+static const distance_sensor_t *sensor;
+static level_sampler_cb_t sample_callback;
+static TaskHandle_t sampler_task_handle;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static bool sampling;           // a reading is in progress
+static uint32_t sample_seq;     // bumped after every reading, good or bad
+static esp_err_t sample_err;    // result of the last reading
+static int32_t sample_level_um; // last good reading
+static int64_t sample_at_us;    // esp_timer time of the last good reading, 0 before the first one
+static uint32_t reading_ms;     // how long the last reading took
+static level_sample_t recent[LEVEL_SAMPLER_RECENT];
+static uint32_t recent_count;   // good readings since boot, recent[] holds the last LEVEL_SAMPLER_RECENT of them
+
+// Finds how closely pings can follow each other, once the sensor has given a good reading
+static void calibrate_spacing(void) {
+    static int attempts;
+    if (attempts == CALIBRATION_ATTEMPTS) {
+        return;
+    }
+    attempts++;
+    esp_err_t err = distance_calibrate_spacing(sensor);
+    if (err == ESP_OK) {
+        distance_spacing_t spacing;
+        distance_get_spacing(&spacing);
+        BINLOG(EV_SENSOR_SPACING, spacing.floor_us, spacing.ghost_us, spacing.spacing_us);
+        attempts = CALIBRATION_ATTEMPTS;
+    } else if (err == ESP_ERR_NOT_SUPPORTED) {
+        attempts = CALIBRATION_ATTEMPTS;
+    } else {
+        BINLOG(EV_SENSOR_SPACING_FAIL, err, attempts);
+    }
+}
+
+static void sampler_task(void *arg) {
+    while (true) {
+        portENTER_CRITICAL(&lock);
+        sampling = true;
+        portEXIT_CRITICAL(&lock);
+
+        int32_t level_um;
+        int32_t pings_um[DISTANCE_MAX_PINGS];
+        int num_pings;
+        int64_t started = esp_timer_get_time();
+        esp_err_t err = get_distance_pings_um(sensor, &level_um, pings_um, &num_pings);
+        int64_t at = esp_timer_get_time();
+        uint64_t rtc_us = esp_rtc_get_time_us();
+
+        portENTER_CRITICAL(&lock);
+        reading_ms = (at - started) / 1000;
+        sample_err = err;
+        if (err == ESP_OK) {
+            sample_level_um = level_um;
+            sample_at_us = at;
+            recent[recent_count++ % LEVEL_SAMPLER_RECENT] = (level_sample_t){.at_us = at, .level_um = level_um};
+            warm_state = (warm_state_t){.magic = WARM_STATE_MAGIC, .level_um = level_um, .rtc_us = rtc_us};
+        }
+        sample_seq++;
+        sampling = false;
+        portEXIT_CRITICAL(&lock);
+
+        if (err == ESP_OK) {
+            boot_mark(BOOT_PHASE_FIRST_SAMPLE);
+            if (sample_callback) {
+                sample_callback(level_um, pings_um, num_pings);
+            }
+            calibrate_spacing();
+        }
+        // A waiter in level_sampler_next() cuts the interval short
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_APP_SAMPLE_INTERVAL_MS));
+    }
+}
+
+esp_err_t level_sampler_start(const distance_sensor_t *dev, level_sampler_cb_t on_sample) {
+    sensor = dev;
+    sample_callback = on_sample;
+    portENTER_CRITICAL(&lock);
+    bool cold = warm_state.magic != WARM_STATE_MAGIC;
+    portEXIT_CRITICAL(&lock);
+    if (cold) {
+        ESP_LOGI(TAG, "Cold start, no level from before the reset");
+    }
+    if (xTaskCreate(sampler_task, "sampler", SAMPLER_STACK_SIZE, NULL, SAMPLER_PRIORITY, &sampler_task_handle) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t level_sampler_latest(int32_t *level_um, int64_t *age_us, bool *warm) {
+    portENTER_CRITICAL(&lock);
+    int32_t level = sample_level_um;
+    int64_t at = sample_at_us;
+    warm_state_t warm_copy = warm_state;
+    portEXIT_CRITICAL(&lock);
+
+    if (at) {
+        *level_um = level;
+        *age_us = esp_timer_get_time() - at;
+        *warm = false;
+        return ESP_OK;
+    }
+    if (warm_copy.magic == WARM_STATE_MAGIC) {
+        *level_um = warm_copy.level_um;
+        *age_us = esp_rtc_get_time_us() - warm_copy.rtc_us;
+        *warm = true;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t level_sampler_next(int32_t *level_um, TickType_t timeout) {
+    // A reading already in progress started before the call, so wait for the one after it. The notification
+    // stays pending until the sampler finishes, then starts that next reading straight away.
+    portENTER_CRITICAL(&lock);
+    uint32_t wanted = sample_seq + (sampling ? 2 : 1);
+    portEXIT_CRITICAL(&lock);
+    xTaskNotifyGive(sampler_task_handle);
+
+    TickType_t start = xTaskGetTickCount();
+    while (true) {
+        portENTER_CRITICAL(&lock);
+        bool done = (int32_t)(sample_seq - wanted) >= 0;
+        esp_err_t err = sample_err;
+        int32_t level = sample_level_um;
+        portEXIT_CRITICAL(&lock);
+
+        if (done) {
+            if (err == ESP_OK) {
+                *level_um = level;
+            }
+            return err == ESP_OK ? ESP_OK : ESP_FAIL;
+        }
+        if (xTaskGetTickCount() - start >= timeout) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(pdMS_TO_TICKS(WAIT_POLL_MS));
+    }
+}
+
+uint32_t level_sampler_reading_ms(void) {
+    portENTER_CRITICAL(&lock);
+    uint32_t ms = reading_ms;
+    portEXIT_CRITICAL(&lock);
+    return ms;
+}
+
+int level_sampler_recent(level_sample_t *samples, int max) {
+    portENTER_CRITICAL(&lock);
+    int n = recent_count < LEVEL_SAMPLER_RECENT ? recent_count : LEVEL_SAMPLER_RECENT;
+    n = n < max ? n : max;
+    for (int i = 0; i < n; i++) {
+        samples[i] = recent[(recent_count - n + i) % LEVEL_SAMPLER_RECENT];
+    }
+    portEXIT_CRITICAL(&lock);
+    return n;
+}
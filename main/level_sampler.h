@@ -0,0 +1,40 @@
+#ifndef __LEVEL_SAMPLER_H__
+#define __LEVEL_SAMPLER_H__
+
+#include <distance_sensor.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <stdbool.h>
+
+/*
+ * The sampler task is the only user of the distance sensor. It takes a filtered reading every
+ * CONFIG_APP_SAMPLE_INTERVAL_MS, or straight away when someone is waiting in level_sampler_next().
+ */
+#define LEVEL_SAMPLER_RECENT 16 // good readings kept for level_sampler_recent()
+
+typedef struct {
+    int64_t at_us; // esp_timer time the reading was taken
+    int32_t level_um;
+} level_sample_t;
+
+typedef void (*level_sampler_cb_t)(int32_t level_um, const int32_t *pings_um, int num_pings); // pings unfiltered
+
+// on_sample is called from the sampler task after every good reading, it must not block for long
+esp_err_t level_sampler_start(const distance_sensor_t *sensor, level_sampler_cb_t on_sample);
+
+/*
+ * The most recent good reading without waiting for the sensor. Straight after a reset this is the reading kept
+ * in RTC memory from before it, flagged with warm. Returns ESP_ERR_NOT_FOUND if there is no reading at all.
+ */
+esp_err_t level_sampler_latest(int32_t *level_um, int64_t *age_us, bool *warm);
+
+// Waits for a reading started after the call. Returns ESP_FAIL if that reading failed.
+esp_err_t level_sampler_next(int32_t *level_um, TickType_t timeout);
+
+// Copies up to max of the most recent good readings, oldest first. Returns how many were copied.
+int level_sampler_recent(level_sample_t *samples, int max);
+
+// Time the last reading took, including retries and the spacing between pings
+uint32_t level_sampler_reading_ms(void);
+
+#endif // __LEVEL_SAMPLER_H__
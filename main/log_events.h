@@ -0,0 +1,74 @@
+#ifndef __LOG_EVENTS_H__
+#define __LOG_EVENTS_H__
+
+#include <binlog.h>
+
+/*
+ * Every binary log event the application records: X(id, level, tag, format).
+ * Arguments are 32 bit integers, so distances are logged in micrometres and times in milliseconds.
+ * Only append to this list - host tools decode old dumps using the table embedded in each dump,
+ * but keeping IDs stable makes dumps from different firmware versions easy to compare.
+ */
+#define LOG_EVENTS(X)                                                                                    \
+    X(EV_BOOT, ESP_LOG_INFO, "example", "Boot count: %d")                                                \
+    X(EV_PUMP_ON, ESP_LOG_DEBUG, "pump", "Turning pump on at %d%% duty")                                 \
+    X(EV_PUMP_OFF, ESP_LOG_DEBUG, "pump", "Turning pump off")                                            \
+    X(EV_TOPUP_START, ESP_LOG_INFO, "example", "Performing topup")                                       \
+    X(EV_TOPUP_NO_LEVEL, ESP_LOG_ERROR, "example", "Failed to get water level - not topping up water")   \
+    X(EV_TOPUP_PUMPING, ESP_LOG_INFO, "example", "Level %d um is past trigger %d um, pumping")           \
+    X(EV_TOPUP_SAMPLE, ESP_LOG_DEBUG, "example", "Topup sample %d um, %d below trigger")                 \
+    X(EV_TOPUP_SENSOR_FAIL, ESP_LOG_ERROR, "example", "Sensor not ok, abandoning topup after %d ms")     \
+    X(EV_TOPUP_TIMEOUT, ESP_LOG_WARN, "time", "%d ms topup limit reached... stopping pump")              \
+    X(EV_TOPUP_NOT_NEEDED, ESP_LOG_INFO, "example", "Topup not needed, level %d um, trigger %d um")      \
+    X(EV_TOPUP_DONE, ESP_LOG_INFO, "example", "Topup done, level %d um after %d ms")                     \
+    X(EV_TIMER_FIRED, ESP_LOG_DEBUG, "time", "The timer triggered at %02d:%02d on weekday %d")           \
+    X(EV_TIMER_TOPUP, ESP_LOG_INFO, "time", "Timer has triggered topup function")                        \
+    X(EV_HTTP_STATS, ESP_LOG_INFO, "server", "Handling get statistics request")                          \
+    X(EV_HTTP_STATS_NO_LEVEL, ESP_LOG_WARN, "server", "Error getting water level for statistics")        \
+    X(EV_HTTP_PUMP, ESP_LOG_INFO, "server", "Handling set pump request, state %d")                       \
+    X(EV_HTTP_TRIGGER, ESP_LOG_INFO, "server", "Handling set trigger request")                           \
+    X(EV_HTTP_SCHEDULE, ESP_LOG_INFO, "example", "Schedule set: hours=%d, minutes=%d, days=%d")          \
+    X(EV_HTTP_CONFIG_REJECTED, ESP_LOG_WARN, "server", "Config update rejected with HTTP status %d")     \
+    X(EV_CONFIG_UPDATED, ESP_LOG_INFO, "config", "Config updated to version %u")                         \
+    X(EV_TIME_SYNCED, ESP_LOG_INFO, "time", "NTP sync, offset %d ms, drift %d ppb")                      \
+    X(EV_TIME_RESTORED, ESP_LOG_WARN, "time", "Clock restored from RTC memory, last sync %d s ago")      \
+    X(EV_RUNTIME_HEAP, ESP_LOG_DEBUG, "runtime", "Heap free %d, min %d, largest block %d, %d blocks")    \
+    X(EV_RUNTIME_STACK_LOW, ESP_LOG_INFO, "runtime", "Task %d has %d bytes of stack left, %d permille CPU") \
+    X(EV_PLANNER_RATE, ESP_LOG_DEBUG, "planner", "Level drop rate now %d um/h")                          \
+    X(EV_PLANNER_FILL, ESP_LOG_INFO, "planner", "Demand fill at %d um, trigger predicted in %d min")     \
+    X(EV_RULE_UPDATED, ESP_LOG_INFO, "rules", "Rule %d updated, %d bytes of code")                       \
+    X(EV_RULE_TRIGGER, ESP_LOG_INFO, "rules", "Trigger rule became true at %d um")                       \
+    X(EV_RULE_INTERLOCK, ESP_LOG_WARN, "rules", "Interlock rule blocked the pump at %d um")              \
+    X(EV_WIFI_DISCONNECTED, ESP_LOG_WARN, "wifi_mgr", "Disconnected, reason %d, reconnecting")           \
+    X(EV_WIFI_RETRY, ESP_LOG_INFO, "wifi_mgr", "Connect failed, reason %d, attempt %d, retry in %d ms")  \
+    X(EV_WIFI_CONNECTED, ESP_LOG_INFO, "wifi_mgr", "Connected after %d ms outage, %d attempts")          \
+    X(EV_PEER_WAIT, ESP_LOG_INFO, "peers", "Got the fill slot after %d ms, %d peers")                    \
+    X(EV_PEER_TIMEOUT, ESP_LOG_WARN, "peers", "No fill slot after %d ms, %d peers, filling anyway")      \
+    X(EV_SHADOW_DECISION, ESP_LOG_DEBUG, "shadow", "Topup needed: active %d, shadow %d at %d um")        \
+    X(EV_SHADOW_STOP, ESP_LOG_INFO, "shadow", "Shadow would stop the pump after %d ms at %d um")         \
+    X(EV_SHADOW_FILL, ESP_LOG_INFO, "shadow", "Pump ran %d ms, shadow %d ms, %d um past its trigger (predicted %d)") \
+    X(EV_CONTINUOUS_START, ESP_LOG_INFO, "example", "Level %d um past trigger for %d readings")          \
+    X(EV_CONTINUOUS_BUDGET, ESP_LOG_WARN, "example", "Daily pump budget of %d ms used up")               \
+    X(EV_SENSOR_SPACING, ESP_LOG_INFO, "sampler", "Ping spacing %d us, ghosts at %d us, now %d us")      \
+    X(EV_SENSOR_SPACING_FAIL, ESP_LOG_WARN, "sampler", "Spacing calibration failed: 0x%x, attempt %d")   \
+    X(EV_PUMP_TAPER, ESP_LOG_INFO, "pump", "Tapering the flow %d um from the target, duty %d%%")         \
+    X(EV_OTA_START, ESP_LOG_INFO, "ota", "Receiving a %d byte image into the partition at 0x%x")         \
+    X(EV_OTA_DONE, ESP_LOG_INFO, "ota", "Image of %d bytes written and verified in %d ms")               \
+    X(EV_OTA_FAIL, ESP_LOG_WARN, "ota", "Update failed (0x%x) after %d bytes")                           \
+    X(EV_OTA_REBOOT, ESP_LOG_WARN, "ota", "Rebooting into the new firmware")                             \
+    X(EV_OTA_VALID, ESP_LOG_INFO, "ota", "New firmware healthy %d ms after boot, kept (0x%x)")           \
+    X(EV_OTA_ROLLBACK, ESP_LOG_ERROR, "ota", "Health checks 0x%x not passed within %d s, rolling back")  \
+    X(EV_PUMP_FAILSAFE, ESP_LOG_ERROR, "pump", "Failsafe turned the pump off after %d ms, trip %d")      \
+    X(EV_OTA_FILL_CUT, ESP_LOG_WARN, "ota", "Fill still running after %d ms, pump forced off for the reboot")\
+    X(EV_TOPUP_STOPPED, ESP_LOG_WARN, "example", "Pump switched off during the topup after %d ms")
+
+#define LOG_EVENT_ENUM(id, level, tag, fmt) id,
+typedef enum {
+    LOG_EVENTS(LOG_EVENT_ENUM)
+    EV_COUNT,
+} log_event_id_t;
+#undef LOG_EVENT_ENUM
+
+extern const binlog_event_t log_events[EV_COUNT];
+
+#endif // __LOG_EVENTS_H__
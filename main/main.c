@@ -1,181 +1,409 @@
 #include <cJSON.h>
 #include <distance_sensor.h>
+#include "boot_timing.h"
+#include "config.h"
+#include "http_async.h"
+#include "level_sampler.h"
+#include "log_events.h"
+#include "ota_update.h"
+#include "peer_coord.h"
+#include "planner.h"
+#include "pump_failsafe.h"
+#include "pump_profile.h"
+#include "rollup.h"
+#include "rule_store.h"
+#include "runtime_stats.h"
+#include "shadow.h"
+#include "stats_bin.h"
+#include "time_service.h"
+#include "topup_journal.h"
+#include "topup_logic.h"
+#include "wifi_manager.h"
+#include <driver/ledc.h>
 #include <esp_check.h>
 #include <esp_event.h>
 #include <esp_http_server.h>
 #include <esp_netif.h>
-#include <esp_netif_sntp.h>
-#include <esp_sntp.h>
+#include <esp_ota_ops.h>
+#include <esp_rtc_time.h>
+#include <esp_system.h>
 #include <esp_timer.h>
-#include <esp_wifi.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <nvs_flash.h>
-#include <protocol_examples_common.h>
 #include <protocol_examples_utils.h>
+#include <sys/time.h>
 
 // TODO: The turn pump on/off buttons should be reduced to just one button that's the opposite action of what the current state is
 
 #define EXAMPLE_HTTP_QUERY_KEY_MAX_LEN (64)
-#define TRIGGER_GPIO GPIO_NUM_0
-#define ECHO_GPIO GPIO_NUM_1
-#define PUMP_PIN GPIO_NUM_4
-#define NUM_BELOW_TRIGGER 3     // the number of sensor readings that must be below the trigger value for it to count
-#define MAX_TOPUP_TIME 15000000 // the maximum topup time is 15s. This is to prevent a case where a sensor issue may cause the topup to never end. TODO: configurable?
+#define PUMP_PIN CONFIG_APP_PUMP_GPIO
+#define PUMP_LEDC_MODE LEDC_LOW_SPEED_MODE
+#define PUMP_LEDC_TIMER LEDC_TIMER_0
+#define PUMP_LEDC_CHANNEL LEDC_CHANNEL_0
+#define PUMP_DUTY_RESOLUTION LEDC_TIMER_10_BIT
+#define PUMP_DUTY_FULL (1 << PUMP_DUTY_RESOLUTION) // LEDC holds the output high at a duty of 2^resolution
+#define PUMP_FAILSAFE_MARGIN_MS 1000 // past the pump time limit, the topup loop normally stops the pump first
 #define TRIGGER_REACHED "Trigger level reached"
 #define PUMP_TIMEOUT "The pump on time limit was reached"
 #define SENSOR_ERROR "Sensor error"
 #define TOPUP_NOT_NEEDED "Topup not needed"
-#define NVS_KEY_TRIGGER_LEVEL "trigger_level"
-#define NVS_KEY_TRIGGER_HOUR "trigger_hour"
-#define NVS_KEY_TRIGGER_MINUTE "trigger_minute"
-#define NVS_KEY_TRIGGER_DAYS "trigger_days"
+#define INTERLOCKED "Blocked by the interlock rule"
+#define BUDGET_USED "Daily pump time budget used up"
+#define PUMP_STOPPED "Pump switched off by hand"
+#define CONFIG_BODY_MAX_LEN 512
+#define ROLLUP_DEFAULT_BUCKETS 60
+#define TOPUPS_DEFAULT_LIMIT 20
+#define TOPUPS_MAX_LIMIT 50
+#define LEVEL_READING_TIMEOUT_MS 40000 // a reading with every ping retried takes about 35s
+#define CONTROL_TASK_PRIORITY 5
+#define FAULT_HISTORY_LEN 8 // most faults a rule variable can count
+#define FAULT_WINDOW_US (24LL * 3600 * 1000000)
+#define RULE_STATE_MAGIC 0x52554c45
+#define BUDGET_STATE_MAGIC 0x42554447
+#define PEER_LEASE_MARGIN_MS 5000 // covers the last reading of a fill that hit the time limit
+#define OTA_CHUNK_LEN 4096
+#define OTA_REBOOT_DELAY_MS 500 // lets the response go out before the reset
+
+#if CONFIG_APP_TRIGGER_WHEN_FARTHER
+#define TRIGGER_WHEN_FARTHER true
+#else
+#define TRIGGER_WHEN_FARTHER false
+#endif
+#define LOG_CHUNK_LEN 512
 #define NVS_KEY_TRIGGER_LAST "last_trigger"
 #define NVS_KEY_TRIGGER_REASON "trigger_reason"
 
-static distance_sensor_t sensor = {
-    .trigger_pin = TRIGGER_GPIO,
-    .echo_pin = ECHO_GPIO};
+#define LOG_EVENT_ENTRY(id, level, tag, fmt) {level, tag, fmt},
+const binlog_event_t log_events[EV_COUNT] = {LOG_EVENTS(LOG_EVENT_ENTRY)};
+
+_Static_assert(GPIO_IS_VALID_OUTPUT_GPIO(PUMP_PIN), "pump GPIO cannot be used as an output on this target");
+_Static_assert(PUMP_PIN != CONFIG_DISTANCE_SENSOR_TRIGGER_GPIO && PUMP_PIN != CONFIG_DISTANCE_SENSOR_ECHO_GPIO, "pump GPIO is used by the distance sensor");
+
+static distance_sensor_t sensor = DISTANCE_SENSOR_DEFAULT_CONFIG();
 
 static nvs_handle_t my_handle;
 static const char *TAG = "example";
 static const char *TAG_STORAGE = "storage";
-static const char *TAG_TIME = "time";
 static const char *TAG_SERVER = "server";
 static const char *TAG_PUMP = "pump";
 static bool pump_state = false;
-static bool doTopup = false;
-static uint8_t daysOfTheWeek = 9; // stores which days of the week the system must trigger on with one bit per day. Bit 7 is not used. Bit 6 is Sunday and so on. Default is Monday and Thursday
-static uint8_t triggerHour = 14;
-static uint8_t triggerMinute = 30;
-static float trigger_level = 3.0f;
+static uint8_t pump_duty_pct; // 0 while the pump is off
+static TaskHandle_t control_task_handle;
+static SemaphoreHandle_t topup_lock; // held while a fill runs the pump, so an OTA reboot waits for it to end
 static char last_trigger[30] = {0};
 static char last_trigger_reason[40] = {0};
 RTC_DATA_ATTR static int boot_count = 0;
-
-static void obtain_time(void);
-void topup_task();
+static portMUX_TYPE pump_time_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t pump_on_since_us; // 0 while the pump is off
+static uint32_t pump_total_ms;   // completed pump runs since boot
+
+// Recent topup faults and the end of the last topup, read by the rules. Kept in RTC memory and timed by the RTC
+// slow clock, which keeps counting through a reset, so a crash loop does not clear timeouts_24h. Only ever append
+// fields.
+typedef struct {
+    int64_t at_us[FAULT_HISTORY_LEN]; // RTC time of each fault, 0 if unused
+    uint8_t next;
+} fault_history_t;
+
+typedef struct {
+    uint32_t magic;
+    fault_history_t timeouts;
+    fault_history_t sensor_fails;
+    int64_t last_topup_end_us; // RTC time, 0 if there has not been one
+} rule_state_t;
+
+static portMUX_TYPE rule_state_lock = portMUX_INITIALIZER_UNLOCKED;
+RTC_NOINIT_ATTR static rule_state_t rule_state;
+
+// Pump time per day for the continuous mode budget. Kept in RTC memory like rule_state, so a reset neither hands out
+// a fresh budget nor lets a fill start early. Only ever append fields.
+typedef struct {
+    uint32_t magic;
+    int32_t day;     // the day used_ms belongs to
+    uint32_t used_ms;
+    int64_t last_continuous_us; // RTC time continuous mode last asked for a topup, 0 if never. Sampler task only.
+} budget_state_t;
+
+static portMUX_TYPE budget_lock = portMUX_INITIALIZER_UNLOCKED;
+RTC_NOINIT_ATTR static budget_state_t budget;
+
+void topup_task(topup_source_t source);
 void start_timer();
 
+static void track_pump_time(bool on, int64_t now) {
+    portENTER_CRITICAL(&pump_time_lock);
+    if (on && !pump_on_since_us) {
+        pump_on_since_us = now;
+    } else if (!on && pump_on_since_us) {
+        pump_total_ms += (now - pump_on_since_us) / 1000;
+        pump_on_since_us = 0;
+    }
+    portEXIT_CRITICAL(&pump_time_lock);
+}
+
+// Total pump on time since boot, including the current run
+static uint32_t get_pump_total_ms(void) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&pump_time_lock);
+    uint32_t total = pump_total_ms + (pump_on_since_us ? (now - pump_on_since_us) / 1000 : 0);
+    portEXIT_CRITICAL(&pump_time_lock);
+    return total;
+}
+
+// Routes the PWM channel to the pump pin, at a duty of 0
+static esp_err_t pump_pwm_attach(void) {
+    ledc_channel_config_t channel = {
+        .gpio_num = PUMP_PIN,
+        .speed_mode = PUMP_LEDC_MODE,
+        .channel = PUMP_LEDC_CHANNEL,
+        .timer_sel = PUMP_LEDC_TIMER,
+        .duty = 0,
+    };
+    return ledc_channel_config(&channel);
+}
+
+// Takes the pump pin over from the GPIO driver, with the output still low
+static void pump_pwm_init(void) {
+    ledc_timer_config_t timer = {
+        .speed_mode = PUMP_LEDC_MODE,
+        .duty_resolution = PUMP_DUTY_RESOLUTION,
+        .timer_num = PUMP_LEDC_TIMER,
+        .freq_hz = CONFIG_APP_PUMP_PWM_FREQ_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    ESP_ERROR_CHECK(ledc_timer_config(&timer));
+    ESP_ERROR_CHECK(pump_pwm_attach());
+    // Makes ledc_set_duty_and_update() available, which is safe to call from both the topup task and HTTP handlers
+    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+    ESP_ERROR_CHECK(pump_failsafe_init(PUMP_PIN));
+}
+
+static void pump_set_duty(uint8_t duty_pct) {
+    ledc_set_duty_and_update(PUMP_LEDC_MODE, PUMP_LEDC_CHANNEL, PUMP_DUTY_FULL * duty_pct / 100, 0);
+    pump_duty_pct = duty_pct;
+}
+
 void pump_off() {
-    ESP_LOGD(TAG_PUMP, "Turning pump off");
-    gpio_set_level(PUMP_PIN, 0);
+    BINLOG(EV_PUMP_OFF);
+    pump_set_duty(0);
+    pump_failsafe_disarm();
     pump_state = false;
+    track_pump_time(false, esp_timer_get_time());
 }
 
-void pump_on() {
-    ESP_LOGD(TAG_PUMP, "Turning pump on");
-    gpio_set_level(PUMP_PIN, 1);
+// The failsafe turns the pump off by itself limit_ms from now unless pump_off() comes first
+void pump_on(uint8_t duty_pct, uint32_t limit_ms) {
+    BINLOG(EV_PUMP_ON, duty_pct);
+    if (pump_failsafe_arm(limit_ms)) {
+        ESP_ERROR_CHECK_WITHOUT_ABORT(pump_pwm_attach());
+    }
+    pump_set_duty(duty_pct);
     pump_state = true;
+    track_pump_time(true, esp_timer_get_time());
 }
 
-static float get_current_water_level(float *distance) {
-    return get_distance_average(&sensor, distance);
+// Catches up with a pump the failsafe timer has turned off underneath the tasks
+static void check_failsafe(void) {
+    if (!pump_state || !pump_failsafe_tripped()) {
+        return;
+    }
+    pump_failsafe_status_t failsafe;
+    pump_failsafe_get_status(&failsafe);
+    pump_state = false;
+    pump_duty_pct = 0;
+    track_pump_time(false, failsafe.last_trip_us);
+    BINLOG(EV_PUMP_FAILSAFE, failsafe.last_limit_ms, failsafe.trips);
 }
 
-static float get_trigger_level() {
-    static bool executed = false;
+// Keeps the rule and budget state from before a software or watchdog reset, clears it after power loss
+static void rtc_state_init(void) {
+    portENTER_CRITICAL(&rule_state_lock);
+    if (rule_state.magic != RULE_STATE_MAGIC) {
+        memset(&rule_state, 0, sizeof(rule_state));
+        rule_state.magic = RULE_STATE_MAGIC;
+    }
+    portEXIT_CRITICAL(&rule_state_lock);
+    portENTER_CRITICAL(&budget_lock);
+    if (budget.magic != BUDGET_STATE_MAGIC) {
+        budget = (budget_state_t){.magic = BUDGET_STATE_MAGIC, .day = INT32_MIN};
+    }
+    portEXIT_CRITICAL(&budget_lock);
+}
 
-    if (executed) {
-        return trigger_level;
-    } else {
-        int32_t trigger_level_mm;
-        esp_err_t err = nvs_get_i32(my_handle, NVS_KEY_TRIGGER_LEVEL, &trigger_level_mm);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            ESP_LOGE(TAG_STORAGE, "No saved trigger level found, using safe value of %.2fcm.", trigger_level);
-        } else if (err == ESP_OK) { // stored value found, using it
-            trigger_level = trigger_level_mm / 1000.0f;
-            ESP_LOGI(TAG_STORAGE, "Found saved trigger level: %f cm", trigger_level);
-            executed = true;
-        } else {
-            ESP_LOGE(TAG_STORAGE, "Error reading NVS (%s)", esp_err_to_name(err));
-        }
-        return trigger_level;
+static void record_fault(fault_history_t *history) {
+    int64_t now = esp_rtc_get_time_us();
+    portENTER_CRITICAL(&rule_state_lock);
+    history->at_us[history->next] = now;
+    history->next = (history->next + 1) % FAULT_HISTORY_LEN;
+    portEXIT_CRITICAL(&rule_state_lock);
+}
+
+// Called with rule_state_lock held
+static int32_t count_recent_faults(const fault_history_t *history, int64_t now) {
+    int32_t count = 0;
+    for (int i = 0; i < FAULT_HISTORY_LEN; i++) {
+        count += history->at_us[i] && now - history->at_us[i] < FAULT_WINDOW_US;
     }
+    return count;
 }
 
-static void set_trigger_level(float i) {
-    int32_t trigger_level_mm = i * 1000;
-    ESP_ERROR_CHECK(nvs_set_i32(my_handle, NVS_KEY_TRIGGER_LEVEL, trigger_level_mm));
-    ESP_ERROR_CHECK(nvs_commit(my_handle));
-    ESP_LOGI(TAG_STORAGE, "Trigger level saved.");
-    trigger_level = i;
+static void get_rule_vars(int32_t level_um, int32_t vars[RULE_VAR_COUNT]) {
+    app_config_t cfg;
+    config_get(&cfg);
+    vars[RULE_VAR_LEVEL] = level_um / 1000;
+    vars[RULE_VAR_TRIGGER] = cfg.trigger_level_um / 1000;
+    vars[RULE_VAR_HOUR] = vars[RULE_VAR_MINUTE] = vars[RULE_VAR_WEEKDAY] = -1;
+    if (time_service_is_valid()) {
+        time_t now = time(NULL);
+        struct tm timeinfo;
+        localtime_r(&now, &timeinfo);
+        vars[RULE_VAR_HOUR] = timeinfo.tm_hour;
+        vars[RULE_VAR_MINUTE] = timeinfo.tm_min;
+        vars[RULE_VAR_WEEKDAY] = timeinfo.tm_wday == 0 ? 6 : timeinfo.tm_wday - 1;
+    }
+    vars[RULE_VAR_PUMP] = pump_state;
+
+    int64_t now = esp_rtc_get_time_us();
+    portENTER_CRITICAL(&rule_state_lock);
+    vars[RULE_VAR_TIMEOUTS_24H] = count_recent_faults(&rule_state.timeouts, now);
+    vars[RULE_VAR_SENSOR_FAILS_24H] = count_recent_faults(&rule_state.sensor_fails, now);
+    int64_t last_end = rule_state.last_topup_end_us;
+    vars[RULE_VAR_SINCE_TOPUP_MIN] = last_end ? (now - last_end) / 60000000 : -1;
+    portEXIT_CRITICAL(&rule_state_lock);
 }
 
-static void set_trigger_hour(uint8_t value) {
-    ESP_ERROR_CHECK(nvs_set_u8(my_handle, NVS_KEY_TRIGGER_HOUR, value));
-    ESP_ERROR_CHECK(nvs_commit(my_handle));
-    triggerHour = value;
+static bool interlock_allows(int32_t level_um) {
+    int32_t vars[RULE_VAR_COUNT];
+    get_rule_vars(level_um, vars);
+    if (rule_store_eval(RULE_INTERLOCK, vars, 1)) {
+        return true;
+    }
+    BINLOG(EV_RULE_INTERLOCK, level_um);
+    return false;
 }
 
-static uint8_t get_trigger_hour() {
-    static bool executed = false;
+// Asks the control task for a topup. Requests that arrive while one is queued are merged.
+static void request_topup(topup_source_t source) {
+    if (control_task_handle) {
+        xTaskNotify(control_task_handle, 1 << source, eSetBits);
+    }
+}
 
-    // Store value in memory, don't need to fetch from flash each time
-    if (executed) {
-        return triggerHour;
-    } else {
-        esp_err_t err = nvs_get_u8(my_handle, NVS_KEY_TRIGGER_HOUR, &triggerHour);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            ESP_LOGW(TAG_STORAGE, "No saved trigger hour found, using default value of: %i.", triggerHour);
-        } else if (err == ESP_OK) {
-            ESP_LOGI(TAG_STORAGE, "Found saved trigger hour: %i", triggerHour);
-            executed = true; // Only set true on a successfull NVS read - will want to retry in other circumstances.
-        } else {
-            ESP_LOGE(TAG_STORAGE, "Error reading NVS (%s)for %s.\n Using default value of: %i.", esp_err_to_name(err), NVS_KEY_TRIGGER_HOUR, triggerHour);
-        }
+// Starts a topup check when the trigger rule becomes true
+static void check_trigger_rule(int32_t level_um) {
+    static bool was_true;
+    int32_t vars[RULE_VAR_COUNT];
+    get_rule_vars(level_um, vars);
+    bool is_true = rule_store_eval(RULE_TRIGGER, vars, 0);
+    if (is_true && !was_true) {
+        BINLOG(EV_RULE_TRIGGER, level_um);
+        request_topup(TOPUP_SOURCE_RULE);
     }
-    return triggerHour;
+    was_true = is_true;
 }
 
-static void set_trigger_minute(uint8_t value) {
-    ESP_ERROR_CHECK(nvs_set_u8(my_handle, NVS_KEY_TRIGGER_MINUTE, value));
-    ESP_ERROR_CHECK(nvs_commit(my_handle));
-    triggerMinute = value;
+// A local calendar day once the time is known, before that days count on the RTC clock, which runs through resets
+static int32_t current_day(void) {
+    if (time_service_is_valid()) {
+        time_t now = time(NULL);
+        struct tm timeinfo;
+        localtime_r(&now, &timeinfo);
+        return (timeinfo.tm_year + 1900) * 1000 + timeinfo.tm_yday;
+    }
+    return -1 - (int32_t)(esp_rtc_get_time_us() / (24ULL * 3600 * 1000000));
 }
 
-static uint8_t get_trigger_minute() {
-    static bool executed = false;
+// Called with budget_lock held
+static uint32_t budget_used_on(int32_t day) {
+    if (day != budget.day) {
+        budget.day = day;
+        budget.used_ms = 0;
+    }
+    return budget.used_ms;
+}
 
-    // Store value in memory, don't need to fetch from flash each time
-    if (executed) {
-        return triggerMinute;
-    } else {
-        esp_err_t err = nvs_get_u8(my_handle, NVS_KEY_TRIGGER_MINUTE, &triggerMinute);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            ESP_LOGW(TAG_STORAGE, "No saved trigger minute found, using default value of: %i.", triggerMinute);
-        } else if (err == ESP_OK) {
-            ESP_LOGI(TAG_STORAGE, "Found saved trigger minute: %i", triggerMinute);
-            executed = true; // Only set true on a successfull NVS read - will want to retry in other circumstances.
-        } else {
-            ESP_LOGE(TAG_STORAGE, "Error reading NVS (%s) for %s.\n Using default value of: %i.", esp_err_to_name(err), NVS_KEY_TRIGGER_MINUTE, triggerMinute);
+static void add_budget_time(uint32_t ms) {
+    int32_t day = current_day();
+    portENTER_CRITICAL(&budget_lock);
+    budget.used_ms = budget_used_on(day) + ms;
+    portEXIT_CRITICAL(&budget_lock);
+}
+
+static uint32_t budget_left_ms(const app_config_t *cfg) {
+    int32_t day = current_day();
+    portENTER_CRITICAL(&budget_lock);
+    uint32_t used = budget_used_on(day);
+    portEXIT_CRITICAL(&budget_lock);
+    return used < cfg->daily_pump_budget_ms ? cfg->daily_pump_budget_ms - used : 0;
+}
+
+// In continuous mode, starts a fill once start_samples readings in a row are past the trigger level. Fills are at
+// least min_fill_interval_s apart and stop being started once the day's pump time budget is used up.
+static void check_continuous(int32_t level_um) {
+    static uint8_t num_past;
+    static int32_t budget_logged_day = INT32_MIN;
+    app_config_t cfg;
+    config_get(&cfg);
+    if (cfg.schedule_mode != SCHEDULE_CONTINUOUS) {
+        num_past = 0;
+        return;
+    }
+    topup_params_t params = {.trigger_level_um = cfg.trigger_level_um};
+    if (!topup_crossed(&params, &num_past, cfg.start_samples, level_um) || pump_state) {
+        return;
+    }
+
+    int64_t now = esp_rtc_get_time_us();
+    int64_t interval_us = (int64_t)cfg.min_fill_interval_s * 1000000;
+    portENTER_CRITICAL(&rule_state_lock);
+    int64_t last_end = rule_state.last_topup_end_us;
+    portEXIT_CRITICAL(&rule_state_lock);
+    if ((last_end && now - last_end < interval_us) || (budget.last_continuous_us && now - budget.last_continuous_us < interval_us)) {
+        return;
+    }
+    if (budget_left_ms(&cfg) == 0) {
+        int32_t day = current_day();
+        if (day != budget_logged_day) {
+            budget_logged_day = day;
+            BINLOG(EV_CONTINUOUS_BUDGET, cfg.daily_pump_budget_ms);
         }
+        return;
     }
-    return triggerMinute;
+    BINLOG(EV_CONTINUOUS_START, level_um, num_past);
+    budget.last_continuous_us = now;
+    num_past = 0;
+    request_topup(TOPUP_SOURCE_CONTINUOUS);
 }
 
-static void set_trigger_days(uint8_t value) {
-    ESP_ERROR_CHECK(nvs_set_u8(my_handle, NVS_KEY_TRIGGER_DAYS, value));
-    ESP_ERROR_CHECK(nvs_commit(my_handle));
-    daysOfTheWeek = value;
+// Called by the sampler after every good reading
+static void on_level_sample(int32_t level_um, const int32_t *pings_um, int num_pings) {
+    ota_update_health(OTA_HEALTH_SAMPLES);
+    check_failsafe();
+    shadow_add_sample(level_um, pings_um, num_pings);
+    check_trigger_rule(level_um);
+    check_continuous(level_um);
+    if (time_service_is_valid()) {
+        time_t now = time(NULL);
+        uint32_t pump_total_ms = get_pump_total_ms();
+        rollup_add(now, level_um, pump_total_ms);
+        planner_add_sample(now, level_um, pump_total_ms);
+    }
 }
 
-static uint8_t get_trigger_days() {
-    static bool executed = false;
+// A fresh reading from the sampler task, which owns the sensor
+static esp_err_t get_current_water_level(int32_t *distance_um) {
+    return level_sampler_next(distance_um, pdMS_TO_TICKS(LEVEL_READING_TIMEOUT_MS));
+}
 
-    // Store value in memory, don't need to fetch from flash each time
-    if (executed) {
-        return daysOfTheWeek;
-    } else {
-        esp_err_t err = nvs_get_u8(my_handle, NVS_KEY_TRIGGER_DAYS, &daysOfTheWeek);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            ESP_LOGW(TAG_STORAGE, "No saved trigger days found, using default value of: %i (Mon, Thurs).", daysOfTheWeek);
-        } else if (err == ESP_OK) {
-            ESP_LOGI(TAG_STORAGE, "Found saved trigger days: %i", daysOfTheWeek);
-            executed = true; // Only set true on a successfull NVS read - will want to retry in other circumstances.
-        } else {
-            ESP_LOGE(TAG_STORAGE, "Error reading NVS (%s) for %s.\n Using default value of: %i (Mon, Thurs).", esp_err_to_name(err), NVS_KEY_TRIGGER_DAYS, daysOfTheWeek);
-        }
+// The reading a continuous mode fill was started on, rather than waiting for another one
+static esp_err_t get_latest_water_level(int32_t *distance_um) {
+    int64_t age_us;
+    bool warm;
+    if (level_sampler_latest(distance_um, &age_us, &warm) == ESP_OK && !warm && age_us < 2000LL * CONFIG_APP_SAMPLE_INTERVAL_MS) {
+        return ESP_OK;
     }
-    return daysOfTheWeek;
+    return get_current_water_level(distance_um);
 }
 
 static void set_last_trigger(const char *time_str) {
@@ -233,12 +461,40 @@ static void get_trigger_reason() {
 }
 
 static bool get_pump_state() {
+    check_failsafe();
     return pump_state;
 }
 
+// Switched by hand the pump runs at full flow, there is no target to taper towards. The pump time limit still applies.
 static void set_pump_state(bool state) {
-    pump_state = state;
-    ESP_ERROR_CHECK(gpio_set_level(PUMP_PIN, state));
+    app_config_t cfg;
+    config_get(&cfg);
+    if (state) {
+        pump_on(cfg.pump_max_duty, cfg.max_topup_time_ms);
+    } else {
+        pump_off();
+    }
+}
+
+// Reads the whole request body into buf as a null terminated string, replying with an error if it does not fit
+static esp_err_t read_body(httpd_req_t *req, char *buf, size_t buf_len) {
+    if (req->content_len >= buf_len) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Request body too large");
+        return ESP_FAIL;
+    }
+    size_t received = 0;
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, buf + received, req->content_len - received);
+        if (ret <= 0) {
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                httpd_resp_send_408(req);
+            }
+            return ESP_FAIL;
+        }
+        received += ret;
+    }
+    buf[received] = '\0';
+    return ESP_OK;
 }
 
 static esp_err_t root_get_handler(httpd_req_t *req) {
@@ -400,6 +656,28 @@ static const httpd_uri_t root = {
                 "            <button onclick=\"setSchedule()\">Set Schedule</button>"
                 "        </div>"
                 "      </section>"
+                "      <section class=\"history\">"
+                "        <canvas id=\"history-chart\" width=\"600\" height=\"200\"></canvas>"
+                "        <div class=\"toggle-buttons\">"
+                "          <button onclick=\"showHistory('hours')\">4 Hours</button>"
+                "          <button onclick=\"showHistory('week')\">Week</button>"
+                "          <button onclick=\"showHistory('months')\">90 Days</button>"
+                "        </div>"
+                "      </section>"
+                "      <section class=\"journal\">"
+                "        <table>"
+                "          <thead>"
+                "            <tr>"
+                "              <th>Topup</th>"
+                "              <th>Source</th>"
+                "              <th>Outcome</th>"
+                "              <th>Pumped (s)</th>"
+                "              <th>Level (cm)</th>"
+                "            </tr>"
+                "          </thead>"
+                "          <tbody id=\"topup-journal\"></tbody>"
+                "        </table>"
+                "      </section>"
                 "    </main>"
                 "</body>"
                 "</html>"};
@@ -541,6 +819,20 @@ esp_err_t css_get_handler(httpd_req_t *req) {
         ""
         ".day-button:hover {"
         "    background-color: #d0e8ff;"
+        "}"
+        ""
+        ".history {"
+        "    margin-top: 1rem;"
+        "}"
+        ""
+        ".journal {"
+        "    margin-top: 1rem;"
+        "}"
+        ""
+        ".history canvas {"
+        "    width: 100%;"
+        "    border: 1px solid #ddd;"
+        "    margin-bottom: 0.5rem;"
         "}";
     httpd_resp_set_type(req, "text/css");
     httpd_resp_send(req, css, strlen(css));
@@ -558,6 +850,7 @@ esp_err_t js_get_handler(httpd_req_t *req) {
         "let globalDays = 0;\n"
         "let globalHours = 0;\n"
         "let globalMinutes = 0;\n"
+        "let configEtag = null;\n"
         "\n"
         "  document.querySelectorAll(\".day-button\").forEach((button) => {\n"
         "    button.addEventListener(\"click\", () => {\n"
@@ -565,13 +858,16 @@ esp_err_t js_get_handler(httpd_req_t *req) {
         "    });\n"
         "  });\n"
         "\n"
-        "  updateStats().then(() => setDayButtons()).then(() => setTimePicker()).then(() => setTriggerInput());\n"
+        "  loadConfig().then(() => updateStats()).then(() => setDayButtons()).then(() => setTimePicker()).then(() => setTriggerInput());\n"
         "\n"
         "\n"
         "  setInterval(() => {\n"
         "    updateStats();\n"
         "  }, 10000);\n"
         "\n"
+        "  showHistory(\"week\");\n"
+        "  loadJournal();\n"
+        "\n"
         "const dayMapping = {\n"
         "  0: \"Mon\",\n"
         "  1: \"Tues\",\n"
@@ -629,16 +925,38 @@ esp_err_t js_get_handler(httpd_req_t *req) {
         "// Set the trigger level\n"
         "function setTriggerLevel() {\n"
         "  const level = document.getElementById(\"trigger-input\").value;\n"
-        "  fetch(`/set-trigger?level=${level}`, { method: \"POST\" })\n"
-        "    .then((response) => response.text())\n"
-        "    .catch((err) => console.error(\"Error setting trigger level:\", err))\n;"
-        "  updateStats();\n"
+        "  patchConfig({ trigger_level: Number(level) })\n"
+        "    .catch((err) => console.error(\"Error setting trigger level:\", err));\n"
+        "}\n"
+        "\n"
+        "// Read the settings and the ETag identifying their version\n"
+        "async function loadConfig() {\n"
+        "  const response = await fetch(\"/config\");\n"
+        "  configEtag = response.headers.get(\"ETag\");\n"
+        "  return response.json();\n"
+        "}\n"
+        "\n"
+        "// Apply changed settings as one update. A stale ETag means another client saved first and the device answers 412.\n"
+        "async function patchConfig(changes) {\n"
+        "  const response = await fetch(\"/config\", {\n"
+        "    method: \"PATCH\",\n"
+        "    headers: configEtag ? { \"If-Match\": configEtag } : {},\n"
+        "    body: JSON.stringify(changes),\n"
+        "  });\n"
+        "  if (response.status === 412) {\n"
+        "    alert(\"Settings were changed from another page, reloading them.\");\n"
+        "  } else if (!response.ok) {\n"
+        "    alert(await response.text());\n"
+        "  }\n"
+        "  await loadConfig();\n"
+        "  await updateStats();\n"
         "}\n"
         "\n"
         "// Test water topup feature\n"
         "function topUp() {\n"
-        "  fetch(`/topup`)\n"
+        "  fetch(`/topup?source=manual`)\n"
         "    .then((response) => response.text())\n"
+        "    .then(() => loadJournal())\n"
         "    .catch((err) => console.error(\"Error topping up water:\", errr));\n"
         "  updateStats();\n"
         "}\n"
@@ -665,19 +983,93 @@ esp_err_t js_get_handler(httpd_req_t *req) {
         "    days |= 1 << (dayValue - 1);\n"
         "  });\n"
         ""
-        "  let schedule = {\n"
-        "    time: {\n"
-        "      hours: hours,\n"
-        "      minutes, minutes\n"
-        "    },\n"
-        "    days: days,\n"
-        "  };\n"
-        "\n"
-        "  fetch('/topup/schedule', {\n"
-        "    method: \"POST\",\n"
-        "    body: JSON.stringify(schedule),\n"
-        "  })\n"
+        "  patchConfig({ trigger_hour: hours, trigger_minute: minutes, trigger_days: days })\n"
         "    .catch((err) => console.error(\"Error setting new schedule\", err));\n"
+        "}\n"
+        "\n"
+        "// Last few topups from the device's journal\n"
+        "function loadJournal() {\n"
+        "  fetch(\"/topups?limit=5\")\n"
+        "    .then((response) => response.json())\n"
+        "    .then((data) => {\n"
+        "      const rows = data.topups.map((t) => {\n"
+        "        const when = t.start ? new Date(t.start * 1000).toLocaleString() : \"-\";\n"
+        "        const level = t.start_level === null ? \"-\" : `${t.start_level.toFixed(1)} to ${t.end_level.toFixed(1)}`;\n"
+        "        return `<tr><td>${when}</td><td>${t.source}</td><td>${t.outcome}</td><td>${t.duration_s.toFixed(1)}</td><td>${level}</td></tr>`;\n"
+        "      });\n"
+        "      document.getElementById(\"topup-journal\").innerHTML = rows.join(\"\") || \"<tr><td colspan=\\\"5\\\">No topups yet</td></tr>\";\n"
+        "    })\n"
+        "    .catch((err) => console.error(\"Error fetching topups:\", err));\n"
+        "}\n"
+        "\n"
+        "// Level history chart, drawn from the device's minute, hour or day rollups\n"
+        "const historyViews = {\n"
+        "  hours: { res: \"minute\", n: 240 },\n"
+        "  week: { res: \"hour\", n: 168 },\n"
+        "  months: { res: \"day\", n: 90 },\n"
+        "};\n"
+        "\n"
+        "function showHistory(view) {\n"
+        "  const { res, n } = historyViews[view];\n"
+        "  fetch(`/rollup?res=${res}&n=${n}`)\n"
+        "    .then((response) => response.json())\n"
+        "    .then((data) => drawHistory(data))\n"
+        "    .catch((err) => console.error(\"Error fetching history:\", err));\n"
+        "}\n"
+        "\n"
+        "function drawHistory(data) {\n"
+        "  const canvas = document.getElementById(\"history-chart\");\n"
+        "  const ctx = canvas.getContext(\"2d\");\n"
+        "  const width = canvas.width;\n"
+        "  const height = canvas.height;\n"
+        "  ctx.clearRect(0, 0, width, height);\n"
+        "\n"
+        "  const levels = data.min.concat(data.max).filter((level) => level !== null);\n"
+        "  if (levels.length === 0) {\n"
+        "    ctx.fillText(\"No history yet\", 10, 20);\n"
+        "    return;\n"
+        "  }\n"
+        "  const low = Math.min(...levels);\n"
+        "  const high = Math.max(...levels);\n"
+        "  const span = high - low || 1;\n"
+        "  const step = width / data.avg.length;\n"
+        "  const x = (i) => (i + 0.5) * step;\n"
+        "  // Larger distances are drawn lower, so the line falls as the water level does\n"
+        "  const y = (level) => 20 + ((level - low) / span) * (height - 50);\n"
+        "\n"
+        "  // Pump run time as bars along the bottom\n"
+        "  const maxPump = Math.max(...data.pump_s, 1);\n"
+        "  ctx.fillStyle = \"rgba(0, 170, 85, 0.5)\";\n"
+        "  data.pump_s.forEach((seconds, i) => {\n"
+        "    const bar = (seconds / maxPump) * 20;\n"
+        "    ctx.fillRect(i * step, height - bar, Math.max(step - 1, 1), bar);\n"
+        "  });\n"
+        "\n"
+        "  // Min to max band with the mean on top\n"
+        "  ctx.fillStyle = \"rgba(0, 119, 204, 0.25)\";\n"
+        "  data.min.forEach((min, i) => {\n"
+        "    if (min !== null) {\n"
+        "      ctx.fillRect(i * step, y(min), Math.max(step - 1, 1), Math.max(y(data.max[i]) - y(min), 1));\n"
+        "    }\n"
+        "  });\n"
+        "  ctx.strokeStyle = \"#0077cc\";\n"
+        "  ctx.beginPath();\n"
+        "  let drawing = false;\n"
+        "  data.avg.forEach((avg, i) => {\n"
+        "    if (avg === null) {\n"
+        "      drawing = false;\n"
+        "    } else if (drawing) {\n"
+        "      ctx.lineTo(x(i), y(avg));\n"
+        "    } else {\n"
+        "      ctx.moveTo(x(i), y(avg));\n"
+        "      drawing = true;\n"
+        "    }\n"
+        "  });\n"
+        "  ctx.stroke();\n"
+        "\n"
+        "  ctx.fillStyle = \"#333\";\n"
+        "  ctx.fillText(`${(low / 10).toFixed(1)} cm`, 4, 12);\n"
+        "  ctx.fillText(`${(high / 10).toFixed(1)} cm`, 4, height - 24);\n"
         "}\n";
     httpd_resp_set_type(req, "text/javascript");
     httpd_resp_send(req, js_file, strlen(js_file));
@@ -690,33 +1082,154 @@ httpd_uri_t js_uri = {
     .handler = js_get_handler,
     .user_ctx = NULL};
 
-esp_err_t stats_get_handler(httpd_req_t *req) {
-    ESP_LOGI(TAG_SERVER, "Handling get statistics request");
-    char response[350];
-    float water_level;
-    esp_err_t res = get_current_water_level(&water_level);
-    if (res != ESP_OK) {
-        ESP_LOGI("water fail", "error getting water level");
-        water_level = -1;
+// Everything /stats reports, read once so the JSON and binary forms agree
+typedef struct {
+    esp_err_t level_res;
+    int32_t level_um;
+    int64_t level_age_us;
+    bool level_warm;
+    bool pump_state;
+    uint8_t pump_duty_pct;
+    uint32_t pump_total_ms;
+    app_config_t cfg;
+    uint32_t config_version;
+    int64_t uptime_us;
+    struct timeval now;
+} stats_snapshot_t;
+
+static void get_stats_snapshot(stats_snapshot_t *snap) {
+    snap->level_res = level_sampler_latest(&snap->level_um, &snap->level_age_us, &snap->level_warm);
+    if (snap->level_res != ESP_OK) {
+        BINLOG(EV_HTTP_STATS_NO_LEVEL);
     }
-    float trigger_level = get_trigger_level();
-    bool pump_state = get_pump_state();
+    snap->pump_state = get_pump_state();
+    snap->pump_duty_pct = pump_duty_pct;
+    snap->pump_total_ms = get_pump_total_ms();
+    config_get(&snap->cfg);
+    snap->config_version = config_version();
+    snap->uptime_us = esp_timer_get_time();
+    gettimeofday(&snap->now, NULL);
+}
+
+// Epoch ms of an esp_timer time, 0 while the clock is not set
+static int64_t snapshot_epoch_ms(const stats_snapshot_t *snap, int64_t at_us) {
+    if (!time_service_is_valid()) {
+        return 0;
+    }
+    return (int64_t)snap->now.tv_sec * 1000 + snap->now.tv_usec / 1000 - (snap->uptime_us - at_us) / 1000;
+}
+
+static void send_stats_json(httpd_req_t *req, const stats_snapshot_t *snap) {
+    char response[400];
+    int32_t water_level = snap->level_res == ESP_OK ? snap->level_um : -DISTANCE_UM_PER_CM;
     get_last_trigger();
     get_trigger_reason();
 
-    time_t now;
+    time_t now = snap->now.tv_sec;
     struct tm timeinfo;
-    time(&now);
-    localtime_r(&now, &timeinfo);
-
     char strftime_buf[64];
     localtime_r(&now, &timeinfo);
     strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
 
-    snprintf(response, sizeof(response), "{\"level\":%.2f,\"trigger_level\":%.2f,\"pump_state\":%s,\"current_system_time\":\"%s\", \"topup_dates\": %i, \"topup_hour\": %i, \"topup_minute\": %i, \"last_trigger\": \"%s\", \"last_reason\": \"%s\"}",
-             water_level, trigger_level, pump_state ? "\"true\"" : "\"false\"", strftime_buf, get_trigger_days(), get_trigger_hour(), get_trigger_minute(), last_trigger, last_trigger_reason);
+    snprintf(response, sizeof(response), "{\"level\":%.2f,\"trigger_level\":%.2f,\"pump_state\":%s,\"current_system_time\":\"%s\", \"topup_dates\": %i, \"topup_hour\": %i, \"topup_minute\": %i, \"last_trigger\": \"%s\", \"last_reason\": \"%s\", \"level_age_s\": %lld, \"level_warm\": %s}",
+             water_level / (float)DISTANCE_UM_PER_CM, snap->cfg.trigger_level_um / (float)DISTANCE_UM_PER_CM, snap->pump_state ? "\"true\"" : "\"false\"", strftime_buf, snap->cfg.trigger_days, snap->cfg.trigger_hour, snap->cfg.trigger_minute, last_trigger, last_trigger_reason,
+             snap->level_res == ESP_OK ? snap->level_age_us / 1000000 : -1LL, snap->level_res == ESP_OK && snap->level_warm ? "true" : "false");
     httpd_resp_set_type(req, "application/json");
     httpd_resp_send(req, response, strlen(response));
+}
+
+static esp_err_t send_stats_bin(httpd_req_t *req, const stats_snapshot_t *snap) {
+    size_t max_len = sizeof(stats_bin_t) + LEVEL_SAMPLER_RECENT * sizeof(stats_bin_sample_t);
+    uint8_t *buf = calloc(1, max_len);
+    level_sample_t *samples = malloc(LEVEL_SAMPLER_RECENT * sizeof(level_sample_t));
+    if (!buf || !samples) {
+        free(buf);
+        free(samples);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_ERR_NO_MEM;
+    }
+    int num_samples = level_sampler_recent(samples, LEVEL_SAMPLER_RECENT);
+
+    stats_bin_t *stats = (stats_bin_t *)buf;
+    memcpy(stats->magic, STATS_BIN_MAGIC, sizeof(stats->magic));
+    stats->version = STATS_BIN_VERSION;
+    stats->header_size = sizeof(stats_bin_t);
+    stats->sample_size = sizeof(stats_bin_sample_t);
+    stats->num_samples = num_samples;
+    stats->now_ms = snapshot_epoch_ms(snap, snap->uptime_us);
+    stats->uptime_ms = snap->uptime_us / 1000;
+    stats->boot_count = boot_count;
+    if (snap->level_res == ESP_OK) {
+        stats->flags |= STATS_BIN_FLAG_LEVEL | (snap->level_warm ? STATS_BIN_FLAG_LEVEL_WARM : 0);
+        stats->level_um = snap->level_um;
+        stats->level_ms = snapshot_epoch_ms(snap, snap->uptime_us - snap->level_age_us);
+    }
+    stats->flags |= (snap->pump_state ? STATS_BIN_FLAG_PUMP : 0) | (time_service_is_valid() ? STATS_BIN_FLAG_TIME : 0);
+    stats->pump_duty_pct = snap->pump_duty_pct;
+    stats->pump_total_ms = snap->pump_total_ms;
+
+    topup_record_t record;
+    int num_read;
+    if (topup_journal_read(0, &record, 1, &num_read) == ESP_OK && num_read == 1) {
+        stats->flags |= STATS_BIN_FLAG_TOPUP;
+        stats->last_topup_ms = (int64_t)record.start_time * 1000;
+        stats->last_topup_duration_ms = record.duration_ms;
+        stats->last_topup_end_um = record.end_level_um;
+        stats->last_topup_outcome = record.outcome;
+        stats->last_topup_source = record.source;
+    }
+
+    stats->config_version = snap->config_version;
+    stats->trigger_level_um = snap->cfg.trigger_level_um;
+    stats->fill_level_um = snap->cfg.fill_level_um;
+    stats->max_topup_time_ms = snap->cfg.max_topup_time_ms;
+    stats->schedule_mode = snap->cfg.schedule_mode;
+    stats->trigger_days = snap->cfg.trigger_days;
+    stats->trigger_hour = snap->cfg.trigger_hour;
+    stats->trigger_minute = snap->cfg.trigger_minute;
+    stats->num_below_trigger = snap->cfg.num_below_trigger;
+
+    stats_bin_sample_t *out = (stats_bin_sample_t *)(buf + sizeof(stats_bin_t));
+    for (int i = 0; i < num_samples; i++) {
+        out[i].at_ms = snapshot_epoch_ms(snap, samples[i].at_us);
+        out[i].level_um = samples[i].level_um;
+    }
+    free(samples);
+
+    httpd_resp_set_type(req, STATS_BIN_TYPE);
+    esp_err_t err = httpd_resp_send(req, (const char *)buf, sizeof(stats_bin_t) + num_samples * sizeof(stats_bin_sample_t));
+    free(buf);
+    return err;
+}
+
+// Machine clients ask for the binary form with an Accept of STATS_BIN_TYPE or application/octet-stream
+static bool accepts_stats_bin(httpd_req_t *req) {
+    size_t len = httpd_req_get_hdr_value_len(req, "Accept");
+    if (len == 0) {
+        return false;
+    }
+    char *accept = malloc(len + 1);
+    if (!accept || httpd_req_get_hdr_value_str(req, "Accept", accept, len + 1) != ESP_OK) {
+        free(accept);
+        return false;
+    }
+    bool binary = strstr(accept, STATS_BIN_TYPE) || strstr(accept, "application/octet-stream");
+    free(accept);
+    return binary;
+}
+
+esp_err_t stats_get_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, stats_get_handler);
+    }
+    BINLOG(EV_HTTP_STATS);
+    stats_snapshot_t snap;
+    get_stats_snapshot(&snap);
+    httpd_resp_set_hdr(req, "Vary", "Accept");
+    if (accepts_stats_bin(req)) {
+        return send_stats_bin(req, &snap);
+    }
+    send_stats_json(req, &snap);
     return ESP_OK;
 }
 
@@ -726,8 +1239,24 @@ httpd_uri_t stats_uri = {
     .handler = stats_get_handler,
     .user_ctx = NULL};
 
+// The binary form of /stats whatever the Accept header says, for clients that cannot set one
+esp_err_t stats_bin_get_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, stats_bin_get_handler);
+    }
+    BINLOG(EV_HTTP_STATS);
+    stats_snapshot_t snap;
+    get_stats_snapshot(&snap);
+    return send_stats_bin(req, &snap);
+}
+
+httpd_uri_t stats_bin_uri = {
+    .uri = "/stats.bin",
+    .method = HTTP_GET,
+    .handler = stats_bin_get_handler,
+    .user_ctx = NULL};
+
 esp_err_t pump_post_handler(httpd_req_t *req) {
-    ESP_LOGI(TAG_SERVER, "Handling set pump request");
     char *buf;
     size_t buf_len = httpd_req_get_url_query_len(req) + 1;
     if (buf_len > 1) {
@@ -743,11 +1272,9 @@ esp_err_t pump_post_handler(httpd_req_t *req) {
                 ESP_LOGD(TAG_SERVER, "Decoded query parameter => %s", dec_param);
                 // TODO: handle empty parameter
 
-                if (strcmp(dec_param, "on") == 0 || strcmp(dec_param, "ON") == 0) {
-                    set_pump_state(true);
-                } else {
-                    set_pump_state(false);
-                }
+                bool state = strcmp(dec_param, "on") == 0 || strcmp(dec_param, "ON") == 0;
+                BINLOG(EV_HTTP_PUMP, state);
+                set_pump_state(state);
             }
         }
         free(buf);
@@ -765,7 +1292,10 @@ httpd_uri_t pump_uri = {
     .user_ctx = NULL};
 
 esp_err_t set_trigger_post_handler(httpd_req_t *req) {
-    ESP_LOGI(TAG_SERVER, "Handling set trigger request");
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, set_trigger_post_handler);
+    }
+    BINLOG(EV_HTTP_TRIGGER);
     char *buf;
     size_t buf_len = httpd_req_get_url_query_len(req) + 1;
     if (buf_len > 1) {
@@ -780,8 +1310,17 @@ esp_err_t set_trigger_post_handler(httpd_req_t *req) {
                 example_uri_decode(dec_param, param, strnlen(param, EXAMPLE_HTTP_QUERY_KEY_MAX_LEN));
                 ESP_LOGD(TAG_SERVER, "Decoded query parameter => %s", dec_param);
                 // TODO: handle empty parameter
-                float level = atoff(dec_param);
-                set_trigger_level(level);
+                cJSON *patch = cJSON_CreateObject();
+                cJSON_AddNumberToObject(patch, "trigger_level", atoff(dec_param));
+                char err[64];
+                esp_err_t res = config_patch(patch, 0, err, sizeof(err));
+                cJSON_Delete(patch);
+                if (res != ESP_OK) {
+                    ESP_LOGE(TAG_SERVER, "Trigger level rejected: %s", err);
+                    free(buf);
+                    httpd_resp_send_err(req, res == ESP_ERR_INVALID_ARG ? HTTPD_400_BAD_REQUEST : HTTPD_500_INTERNAL_SERVER_ERROR, err);
+                    return ESP_FAIL;
+                }
             }
         }
         free(buf);
@@ -800,8 +1339,18 @@ httpd_uri_t set_trigger_uri = {
     .user_ctx = NULL};
 
 esp_err_t topup_handler(httpd_req_t *req) {
-    topup_task();
-    httpd_resp_send(req, "Topup done", HTTPD_RESP_USE_STRLEN);
+    // The web page marks its button presses so the journal can tell them from API calls
+    topup_source_t source = TOPUP_SOURCE_API;
+    char query[32];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "source", value, sizeof(value)) == ESP_OK && strcmp(value, "manual") == 0) {
+        source = TOPUP_SOURCE_MANUAL;
+    }
+    // The control task runs it, the journal shows the outcome once it is done
+    request_topup(source);
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_send(req, "Topup requested", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
@@ -812,12 +1361,11 @@ httpd_uri_t set_topup_uri = {
     .user_ctx = NULL};
 
 esp_err_t topup_schedule_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, topup_schedule_handler);
+    }
     char content[100];
-    int ret = httpd_req_recv(req, content, sizeof(content));
-    if (ret <= 0) {
-        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-            httpd_resp_send_408(req);
-        }
+    if (read_body(req, content, sizeof(content)) != ESP_OK) {
         return ESP_FAIL;
     }
 
@@ -846,12 +1394,23 @@ esp_err_t topup_schedule_handler(httpd_req_t *req) {
         return ESP_FAIL;
     }
 
-    set_trigger_days(json_days->valueint);
-    set_trigger_hour(json_hour->valueint);
-    set_trigger_minute(json_minutes->valueint);
-    ESP_LOGI(TAG, "Schedule set: hours=%i, minutes=%i, days=%i", json_hour->valueint, json_minutes->valueint, json_days->valueint);
-
+    int hour = json_hour->valueint;
+    int minutes = json_minutes->valueint;
+    int days = json_days->valueint;
     cJSON_Delete(json);
+
+    cJSON *patch = cJSON_CreateObject();
+    cJSON_AddNumberToObject(patch, "trigger_days", days);
+    cJSON_AddNumberToObject(patch, "trigger_hour", hour);
+    cJSON_AddNumberToObject(patch, "trigger_minute", minutes);
+    char err[64];
+    esp_err_t res = config_patch(patch, 0, err, sizeof(err));
+    cJSON_Delete(patch);
+    if (res != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+    BINLOG(EV_HTTP_SCHEDULE, hour, minutes, days);
     httpd_resp_sendstr(req, "Schedule set successfully");
     return ESP_OK;
 }
@@ -862,6 +1421,676 @@ httpd_uri_t set_topup_schedule_uri = {
     .handler = topup_schedule_handler,
     .user_ctx = NULL};
 
+// Batches binlog output into HTTP chunks so the many small pieces of a dump don't each become a socket write
+typedef struct {
+    httpd_req_t *req;
+    size_t used;
+    char buf[LOG_CHUNK_LEN];
+} chunk_writer_t;
+
+static esp_err_t chunk_writer_flush(chunk_writer_t *writer) {
+    esp_err_t err = ESP_OK;
+    if (writer->used) {
+        err = httpd_resp_send_chunk(writer->req, writer->buf, writer->used);
+        writer->used = 0;
+    }
+    return err;
+}
+
+static esp_err_t chunk_writer_sink(void *ctx, const char *data, size_t len) {
+    chunk_writer_t *writer = ctx;
+    while (len) {
+        size_t n = sizeof(writer->buf) - writer->used;
+        n = len < n ? len : n;
+        memcpy(writer->buf + writer->used, data, n);
+        writer->used += n;
+        data += n;
+        len -= n;
+        if (writer->used == sizeof(writer->buf)) {
+            ESP_RETURN_ON_ERROR(chunk_writer_flush(writer), TAG_SERVER, "failed to send log chunk");
+        }
+    }
+    return ESP_OK;
+}
+
+// Formats the binary log as text, or with ?format=bin sends the raw ring for tools/binlog_decode.py
+esp_err_t logs_get_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, logs_get_handler);
+    }
+    bool binary = false;
+    char query[32];
+    char format[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "format", format, sizeof(format)) == ESP_OK) {
+        binary = strcmp(format, "bin") == 0;
+    }
+
+    chunk_writer_t *writer = malloc(sizeof(chunk_writer_t));
+    ESP_RETURN_ON_FALSE(writer, ESP_ERR_NO_MEM, TAG_SERVER, "buffer alloc failed");
+    writer->req = req;
+    writer->used = 0;
+
+    httpd_resp_set_type(req, binary ? "application/octet-stream" : "text/plain");
+    esp_err_t err = binary ? binlog_dump_binary(chunk_writer_sink, writer) : binlog_dump_text(chunk_writer_sink, writer);
+    if (err == ESP_OK) {
+        err = chunk_writer_flush(writer);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    free(writer);
+    return err;
+}
+
+httpd_uri_t logs_uri = {
+    .uri = "/logs",
+    .method = HTTP_GET,
+    .handler = logs_get_handler,
+    .user_ctx = NULL};
+
+// Level history, e.g. /rollup?res=hour&n=48 for the last two days
+esp_err_t rollup_get_handler(httpd_req_t *req) {
+    rollup_res_t res = ROLLUP_HOUR;
+    int n = ROLLUP_DEFAULT_BUCKETS;
+    char query[32];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "res", value, sizeof(value)) == ESP_OK && rollup_res_from_name(value, &res) != ESP_OK) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "res must be minute, hour or day");
+            return ESP_FAIL;
+        }
+        if (httpd_query_key_value(query, "n", value, sizeof(value)) == ESP_OK) {
+            n = atoi(value);
+        }
+    }
+
+    chunk_writer_t *writer = malloc(sizeof(chunk_writer_t));
+    ESP_RETURN_ON_FALSE(writer, ESP_ERR_NO_MEM, TAG_SERVER, "buffer alloc failed");
+    writer->req = req;
+    writer->used = 0;
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = rollup_dump_json(res, n, chunk_writer_sink, writer);
+    if (err == ESP_OK) {
+        err = chunk_writer_flush(writer);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    free(writer);
+    return err;
+}
+
+httpd_uri_t rollup_uri = {
+    .uri = "/rollup",
+    .method = HTTP_GET,
+    .handler = rollup_get_handler,
+    .user_ctx = NULL};
+
+esp_err_t runtime_get_handler(httpd_req_t *req) {
+    cJSON *json = runtime_stats_to_json();
+    char *body = json ? cJSON_PrintUnformatted(json) : NULL;
+    cJSON_Delete(json);
+    ESP_RETURN_ON_FALSE(body, ESP_ERR_NO_MEM, TAG_SERVER, "runtime stats alloc failed");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_sendstr(req, body);
+    cJSON_free(body);
+    return err;
+}
+
+httpd_uri_t runtime_uri = {
+    .uri = "/debug/runtime",
+    .method = HTTP_GET,
+    .handler = runtime_get_handler,
+    .user_ctx = NULL};
+
+#if CONFIG_DISTANCE_SENSOR_TRACE
+// Sends the raw ping trace for tools/trace_replay.c
+esp_err_t trace_get_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, trace_get_handler);
+    }
+    chunk_writer_t *writer = malloc(sizeof(chunk_writer_t));
+    ESP_RETURN_ON_FALSE(writer, ESP_ERR_NO_MEM, TAG_SERVER, "buffer alloc failed");
+    writer->req = req;
+    writer->used = 0;
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"trace.bin\"");
+    esp_err_t err = distance_trace_dump(chunk_writer_sink, writer);
+    if (err == ESP_OK) {
+        err = chunk_writer_flush(writer);
+    }
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    free(writer);
+    return err;
+}
+
+httpd_uri_t trace_uri = {
+    .uri = "/trace",
+    .method = HTTP_GET,
+    .handler = trace_get_handler,
+    .user_ctx = NULL};
+#endif
+
+#if CONFIG_APP_OTA_HTTP
+// Parses the X-OTA-SHA256 header, the image's SHA-256 as 64 hex digits
+static bool get_ota_sha256(httpd_req_t *req, uint8_t sha256[OTA_SHA256_LEN]) {
+    char hex[2 * OTA_SHA256_LEN + 1];
+    if (httpd_req_get_hdr_value_str(req, "X-OTA-SHA256", hex, sizeof(hex)) != ESP_OK || strlen(hex) != 2 * OTA_SHA256_LEN) {
+        return false;
+    }
+    for (int i = 0; i < OTA_SHA256_LEN; i++) {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        char *end;
+        sha256[i] = strtoul(byte, &end, 16);
+        if (*end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Streams a firmware image into the inactive app partition and reboots into it, see ota_update.h
+esp_err_t ota_post_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, ota_post_handler);
+    }
+    uint8_t sha256[OTA_SHA256_LEN];
+    if (!get_ota_sha256(req, sha256)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "X-OTA-SHA256 must hold the image's SHA-256 in hex");
+        return ESP_FAIL;
+    }
+    if (req->content_len == 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty image");
+        return ESP_FAIL;
+    }
+    char *buf = malloc(OTA_CHUNK_LEN);
+    ESP_RETURN_ON_FALSE(buf, ESP_ERR_NO_MEM, TAG_SERVER, "buffer alloc failed");
+    esp_err_t err = ota_update_begin(req->content_len, sha256);
+    if (err == ESP_ERR_INVALID_STATE || err == ESP_ERR_OTA_ROLLBACK_INVALID_STATE) {
+        free(buf);
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, err == ESP_ERR_INVALID_STATE ? "Another update is in progress"
+                                                             : "The running firmware has not passed its health checks yet");
+        return ESP_FAIL;
+    } else if (err != ESP_OK) {
+        free(buf);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+        return ESP_FAIL;
+    }
+
+    // Each chunk is hashed and written as it arrives, the image is never held in RAM
+    size_t left = req->content_len;
+    while (left > 0) {
+        int ret = httpd_req_recv(req, buf, left < OTA_CHUNK_LEN ? left : OTA_CHUNK_LEN);
+        if (ret <= 0) {
+            err = ret == HTTPD_SOCK_ERR_TIMEOUT ? ESP_ERR_TIMEOUT : ESP_FAIL;
+            break;
+        }
+        err = ota_update_write(buf, ret);
+        if (err != ESP_OK) {
+            break;
+        }
+        left -= ret;
+    }
+    free(buf);
+    if (err != ESP_OK) {
+        ota_update_abort(err);
+        if (err == ESP_ERR_TIMEOUT) {
+            httpd_resp_send_408(req);
+        } else {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+        }
+        return ESP_FAIL;
+    }
+    err = ota_update_end();
+    if (err != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err == ESP_ERR_INVALID_CRC ? "SHA-256 mismatch" : "Invalid image");
+        return ESP_FAIL;
+    }
+    httpd_resp_sendstr(req, "Update written, rebooting");
+
+    // Waits for a fill in progress and keeps new ones from starting, so the reset normally never cuts one short. A
+    // fill ends within its time limit plus one reading, one that is stuck past that is cut off.
+    app_config_t cfg;
+    config_get(&cfg);
+    uint32_t wait_ms = cfg.max_topup_time_ms + LEVEL_READING_TIMEOUT_MS;
+    if (xSemaphoreTake(topup_lock, pdMS_TO_TICKS(wait_ms)) != pdTRUE) {
+        pump_off();
+        BINLOG(EV_OTA_FILL_CUT, wait_ms);
+    }
+    BINLOG(EV_OTA_REBOOT);
+    vTaskDelay(pdMS_TO_TICKS(OTA_REBOOT_DELAY_MS));
+    esp_restart();
+    return ESP_OK;
+}
+
+httpd_uri_t ota_uri = {
+    .uri = "/ota",
+    .method = HTTP_POST,
+    .handler = ota_post_handler,
+    .user_ctx = NULL};
+#endif
+
+static void send_config(httpd_req_t *req) {
+    app_config_t cfg;
+    uint32_t version = config_version();
+    config_get(&cfg);
+    char etag[16];
+    snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)version);
+
+    cJSON *json = config_to_json(&cfg, version);
+    char *body = json ? cJSON_PrintUnformatted(json) : NULL;
+    cJSON_Delete(json);
+    if (!body) {
+        httpd_resp_send_500(req);
+        return;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_sendstr(req, body);
+    cJSON_free(body);
+}
+
+esp_err_t config_get_handler(httpd_req_t *req) {
+    send_config(req);
+    return ESP_OK;
+}
+
+httpd_uri_t config_get_uri = {
+    .uri = "/config",
+    .method = HTTP_GET,
+    .handler = config_get_handler,
+    .user_ctx = NULL};
+
+// Parses an If-Match header holding an ETag from send_config. Returns 0 (no precondition) if absent or "*".
+static uint32_t get_if_match(httpd_req_t *req) {
+    char value[24] = {0};
+    if (httpd_req_get_hdr_value_str(req, "If-Match", value, sizeof(value)) != ESP_OK) {
+        return 0;
+    }
+    const char *p = value;
+    if (strncmp(p, "W/", 2) == 0) {
+        p += 2;
+    }
+    if (*p == '"') {
+        p++;
+    }
+    return strtoul(p, NULL, 10);
+}
+
+esp_err_t config_patch_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, config_patch_handler);
+    }
+    char content[CONFIG_BODY_MAX_LEN];
+    if (read_body(req, content, sizeof(content)) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    cJSON *patch = cJSON_Parse(content);
+    if (!patch) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+    char err[96];
+    esp_err_t res = config_patch(patch, get_if_match(req), err, sizeof(err));
+    cJSON_Delete(patch);
+
+    if (res != ESP_OK) {
+        BINLOG(EV_HTTP_CONFIG_REJECTED, res == ESP_ERR_INVALID_VERSION ? 412 : res == ESP_ERR_INVALID_ARG ? 400 : 500);
+    }
+    if (res == ESP_ERR_INVALID_VERSION) {
+        httpd_resp_set_status(req, "412 Precondition Failed");
+        httpd_resp_sendstr(req, err);
+        return ESP_OK;
+    } else if (res == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    } else if (res != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+    send_config(req);
+    return ESP_OK;
+}
+
+httpd_uri_t config_patch_uri = {
+    .uri = "/config",
+    .method = HTTP_PATCH,
+    .handler = config_patch_handler,
+    .user_ctx = NULL};
+
+// Topup journal, newest first. /topups?offset=20&limit=20 for the second page.
+esp_err_t topups_get_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, topups_get_handler);
+    }
+    uint32_t offset = 0;
+    int limit = TOPUPS_DEFAULT_LIMIT;
+    char query[48];
+    char value[12];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+            offset = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK) {
+            limit = atoi(value);
+        }
+    }
+    limit = limit < 1 ? 1 : limit > TOPUPS_MAX_LIMIT ? TOPUPS_MAX_LIMIT : limit;
+
+    topup_record_t *records = malloc(limit * sizeof(topup_record_t));
+    ESP_RETURN_ON_FALSE(records, ESP_ERR_NO_MEM, TAG_SERVER, "journal alloc failed");
+    int num_read;
+    uint32_t total = topup_journal_count();
+    esp_err_t err = topup_journal_read(offset, records, limit, &num_read);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        free(records);
+        httpd_resp_send_500(req);
+        return err;
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "total", total);
+    cJSON_AddNumberToObject(json, "offset", offset);
+    cJSON *list = cJSON_AddArrayToObject(json, "topups");
+    for (int i = 0; i < num_read; i++) {
+        const topup_record_t *r = &records[i];
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddItemToArray(list, item);
+        cJSON_AddNumberToObject(item, "seq", r->seq);
+        if (r->start_time) {
+            cJSON_AddNumberToObject(item, "start", r->start_time);
+        } else {
+            cJSON_AddNullToObject(item, "start");
+        }
+        cJSON_AddNumberToObject(item, "duration_s", r->duration_ms / 1000.0);
+        if (r->start_level_um >= 0) {
+            cJSON_AddNumberToObject(item, "start_level", r->start_level_um / (double)DISTANCE_UM_PER_CM);
+            cJSON_AddNumberToObject(item, "end_level", r->end_level_um / (double)DISTANCE_UM_PER_CM);
+        } else {
+            cJSON_AddNullToObject(item, "start_level");
+            cJSON_AddNullToObject(item, "end_level");
+        }
+        cJSON_AddNumberToObject(item, "samples", r->samples);
+        cJSON_AddNumberToObject(item, "sensor_errors", r->sensor_errors);
+        cJSON_AddStringToObject(item, "outcome", topup_outcome_name(r->outcome));
+        cJSON_AddStringToObject(item, "source", topup_source_name(r->source));
+    }
+    free(records);
+
+    char *body = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    ESP_RETURN_ON_FALSE(body, ESP_ERR_NO_MEM, TAG_SERVER, "journal alloc failed");
+    httpd_resp_set_type(req, "application/json");
+    err = httpd_resp_sendstr(req, body);
+    cJSON_free(body);
+    return err;
+}
+
+httpd_uri_t topups_uri = {
+    .uri = "/topups",
+    .method = HTTP_GET,
+    .handler = topups_get_handler,
+    .user_ctx = NULL};
+
+static void send_rules(httpd_req_t *req) {
+    cJSON *json = rule_store_to_json();
+    char *body = json ? cJSON_PrintUnformatted(json) : NULL;
+    cJSON_Delete(json);
+    if (!body) {
+        httpd_resp_send_500(req);
+        return;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, body);
+    cJSON_free(body);
+}
+
+esp_err_t rules_get_handler(httpd_req_t *req) {
+    send_rules(req);
+    return ESP_OK;
+}
+
+httpd_uri_t rules_get_uri = {
+    .uri = "/rules",
+    .method = HTTP_GET,
+    .handler = rules_get_handler,
+    .user_ctx = NULL};
+
+// PATCH /rules with {"trigger": "...", "interlock": "..."}, an empty string removes a rule
+esp_err_t rules_patch_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, rules_patch_handler);
+    }
+    char content[CONFIG_BODY_MAX_LEN];
+    if (read_body(req, content, sizeof(content)) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    cJSON *patch = cJSON_Parse(content);
+    if (!cJSON_IsObject(patch)) {
+        cJSON_Delete(patch);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+    char err[96];
+    esp_err_t res = rule_store_patch(patch, err, sizeof(err));
+    cJSON_Delete(patch);
+    if (res == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    } else if (res != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+    send_rules(req);
+    return ESP_OK;
+}
+
+httpd_uri_t rules_patch_uri = {
+    .uri = "/rules",
+    .method = HTTP_PATCH,
+    .handler = rules_patch_handler,
+    .user_ctx = NULL};
+
+static void send_shadow(httpd_req_t *req) {
+    cJSON *json = shadow_to_json();
+    char *body = json ? cJSON_PrintUnformatted(json) : NULL;
+    cJSON_Delete(json);
+    if (!body) {
+        httpd_resp_send_500(req);
+        return;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, body);
+    cJSON_free(body);
+}
+
+esp_err_t shadow_get_handler(httpd_req_t *req) {
+    send_shadow(req);
+    return ESP_OK;
+}
+
+httpd_uri_t shadow_get_uri = {
+    .uri = "/shadow",
+    .method = HTTP_GET,
+    .handler = shadow_get_handler,
+    .user_ctx = NULL};
+
+// PATCH /shadow with any of the members in the "params" object of GET /shadow. Clears the comparisons.
+esp_err_t shadow_patch_handler(httpd_req_t *req) {
+    if (!http_async_is_worker()) {
+        return http_async_submit(req, shadow_patch_handler);
+    }
+    char content[CONFIG_BODY_MAX_LEN];
+    if (read_body(req, content, sizeof(content)) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    cJSON *patch = cJSON_Parse(content);
+    if (!cJSON_IsObject(patch)) {
+        cJSON_Delete(patch);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid JSON");
+        return ESP_FAIL;
+    }
+    char err[96];
+    esp_err_t res = shadow_patch(patch, err, sizeof(err));
+    cJSON_Delete(patch);
+    if (res == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    } else if (res != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+    send_shadow(req);
+    return ESP_OK;
+}
+
+httpd_uri_t shadow_patch_uri = {
+    .uri = "/shadow",
+    .method = HTTP_PATCH,
+    .handler = shadow_patch_handler,
+    .user_ctx = NULL};
+
+esp_err_t metrics_get_handler(httpd_req_t *req) {
+    http_async_metrics_t http;
+    http_async_get_metrics(&http);
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON *http_json = cJSON_AddObjectToObject(json, "http");
+    cJSON_AddNumberToObject(http_json, "completed", http.completed);
+    cJSON_AddNumberToObject(http_json, "rejected", http.rejected);
+    cJSON_AddNumberToObject(http_json, "queue_depth", http.queue_depth);
+    cJSON_AddNumberToObject(http_json, "queue_avg_us", http.completed ? http.queue_total_us / http.completed : 0);
+    cJSON_AddNumberToObject(http_json, "queue_max_us", http.queue_max_us);
+    cJSON_AddNumberToObject(http_json, "process_avg_us", http.completed ? http.process_total_us / http.completed : 0);
+    cJSON_AddNumberToObject(http_json, "process_max_us", http.process_max_us);
+
+    time_service_status_t time_status;
+    time_service_get_status(&time_status);
+    cJSON *time_json = cJSON_AddObjectToObject(json, "time");
+    cJSON_AddStringToObject(time_json, "source", time_source_name(time_status.source));
+    cJSON_AddNumberToObject(time_json, "syncs", time_status.sync_count);
+    cJSON_AddNumberToObject(time_json, "last_sync_age_s", time_status.last_sync_age_s);
+    cJSON_AddNumberToObject(time_json, "last_offset_us", time_status.last_offset_us);
+    cJSON_AddNumberToObject(time_json, "drift_ppb", time_status.drift_ppb);
+    cJSON_AddBoolToObject(time_json, "adjusting", time_status.adjusting);
+
+    app_config_t cfg;
+    config_get(&cfg);
+    planner_status_t plan;
+    planner_get_status(time(NULL), &cfg, &plan);
+    cJSON *plan_json = cJSON_AddObjectToObject(json, "planner");
+    static const char *const mode_names[] = {"fixed", "demand", "continuous"};
+    cJSON_AddStringToObject(plan_json, "mode", mode_names[cfg.schedule_mode]);
+    cJSON_AddNumberToObject(plan_json, "pump_budget_left_ms", budget_left_ms(&cfg));
+    if (plan.rate_known) {
+        cJSON_AddNumberToObject(plan_json, "drop_mm_per_day", plan.drop_um_per_h * 24 / 1000.0);
+    } else {
+        cJSON_AddNullToObject(plan_json, "drop_mm_per_day");
+    }
+    cJSON_AddNumberToObject(plan_json, "hours_measured", plan.hours_measured);
+    cJSON_AddNumberToObject(plan_json, "predicted_trigger", plan.predicted_cross); // epoch seconds, -1 if none
+    cJSON_AddNumberToObject(plan_json, "next_fill", plan.next_fill);
+
+    wifi_manager_status_t wifi;
+    wifi_manager_get_status(&wifi);
+    cJSON *wifi_json = cJSON_AddObjectToObject(json, "wifi");
+    cJSON_AddBoolToObject(wifi_json, "connected", wifi.connected);
+    cJSON_AddNumberToObject(wifi_json, "rssi", wifi.rssi);
+    cJSON_AddNumberToObject(wifi_json, "outages", wifi.outages);
+    cJSON_AddNumberToObject(wifi_json, "last_reason", wifi.last_reason);
+    cJSON_AddNumberToObject(wifi_json, "attempts", wifi.attempts);
+    cJSON_AddNumberToObject(wifi_json, "first_connect_ms", wifi.first_connect_ms);
+    cJSON_AddNumberToObject(wifi_json, "current_outage_ms", wifi.current_outage_ms);
+    cJSON_AddNumberToObject(wifi_json, "last_outage_ms", wifi.last_outage_ms);
+    cJSON_AddNumberToObject(wifi_json, "max_outage_ms", wifi.max_outage_ms);
+    cJSON_AddNumberToObject(wifi_json, "total_outage_ms", wifi.total_outage_ms);
+
+    peer_coord_status_t peers;
+    peer_coord_get_status(&peers);
+    cJSON *peers_json = cJSON_AddObjectToObject(json, "peers");
+    cJSON_AddBoolToObject(peers_json, "enabled", peers.enabled);
+    cJSON_AddBoolToObject(peers_json, "joined", peers.socket_open);
+    cJSON_AddNumberToObject(peers_json, "unit_id", peers.unit_id);
+    cJSON_AddNumberToObject(peers_json, "live", peers.live_peers);
+    cJSON_AddNumberToObject(peers_json, "holder", peers.holder);
+    cJSON_AddNumberToObject(peers_json, "acquisitions", peers.acquisitions);
+    cJSON_AddNumberToObject(peers_json, "timeouts", peers.timeouts);
+    cJSON_AddNumberToObject(peers_json, "last_wait_ms", peers.last_wait_ms);
+    cJSON_AddNumberToObject(peers_json, "max_wait_ms", peers.max_wait_ms);
+    cJSON_AddNumberToObject(peers_json, "total_wait_ms", peers.total_wait_ms);
+
+    check_failsafe();
+    cJSON *pump_json = cJSON_AddObjectToObject(json, "pump");
+    cJSON_AddNumberToObject(pump_json, "duty_pct", pump_duty_pct);
+    cJSON_AddNumberToObject(pump_json, "pwm_hz", CONFIG_APP_PUMP_PWM_FREQ_HZ);
+    cJSON_AddNumberToObject(pump_json, "total_ms", get_pump_total_ms());
+    pump_failsafe_status_t failsafe;
+    pump_failsafe_get_status(&failsafe);
+    cJSON_AddBoolToObject(pump_json, "failsafe_armed", failsafe.armed);
+    cJSON_AddNumberToObject(pump_json, "failsafe_arms", failsafe.arms);
+    cJSON_AddNumberToObject(pump_json, "failsafe_trips", failsafe.trips);
+    cJSON_AddNumberToObject(pump_json, "failsafe_last_trip_s", // seconds ago, -1 if never
+                            failsafe.last_trip_us ? (esp_timer_get_time() - failsafe.last_trip_us) / 1000000 : -1);
+
+    distance_spacing_t spacing;
+    distance_get_spacing(&spacing);
+    cJSON *sensor_json = cJSON_AddObjectToObject(json, "sensor");
+    cJSON_AddBoolToObject(sensor_json, "calibrated", spacing.calibrated);
+    cJSON_AddNumberToObject(sensor_json, "spacing_us", spacing.spacing_us);
+    cJSON_AddNumberToObject(sensor_json, "floor_us", spacing.floor_us);
+    cJSON_AddNumberToObject(sensor_json, "ghost_us", spacing.ghost_us); // 0 if no ghost echoes were seen
+    cJSON_AddNumberToObject(sensor_json, "reading_ms", level_sampler_reading_ms());
+
+    ota_update_status_t ota;
+    ota_update_get_status(&ota);
+    cJSON *ota_json = cJSON_AddObjectToObject(json, "ota");
+    cJSON_AddStringToObject(ota_json, "running", ota.running);
+    cJSON_AddStringToObject(ota_json, "version", ota.version);
+    cJSON_AddBoolToObject(ota_json, "pending_verify", ota.pending_verify);
+    cJSON_AddNumberToObject(ota_json, "health", ota.health); // ota_health_t bits passed this boot
+    cJSON_AddBoolToObject(ota_json, "in_progress", ota.in_progress);
+    cJSON_AddNumberToObject(ota_json, "received", ota.received);
+    cJSON_AddNumberToObject(ota_json, "image_len", ota.image_len);
+    cJSON_AddNumberToObject(ota_json, "updates", ota.updates);
+    cJSON_AddNumberToObject(ota_json, "failures", ota.failures);
+    cJSON_AddNumberToObject(ota_json, "last_ms", ota.last_ms);
+    cJSON_AddStringToObject(ota_json, "last_error", esp_err_to_name(ota.last_err));
+
+    cJSON *boot_json = cJSON_AddObjectToObject(json, "boot");
+    cJSON_AddNumberToObject(boot_json, "count", boot_count);
+    cJSON_AddNumberToObject(boot_json, "reset_reason", esp_reset_reason());
+    cJSON *phases_json = cJSON_AddObjectToObject(boot_json, "phases_ms"); // time from reset until each phase completed
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        int64_t us = boot_phase_us(i);
+        if (us < 0) {
+            cJSON_AddNullToObject(phases_json, boot_phase_name(i));
+        } else {
+            cJSON_AddNumberToObject(phases_json, boot_phase_name(i), us / 1000);
+        }
+    }
+
+    char *body = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    ESP_RETURN_ON_FALSE(body, ESP_ERR_NO_MEM, TAG_SERVER, "metrics alloc failed");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_sendstr(req, body);
+    cJSON_free(body);
+    return err;
+}
+
+httpd_uri_t metrics_uri = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = metrics_get_handler,
+    .user_ctx = NULL};
+
 esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err) {
     httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Some 404 error message");
     return ESP_FAIL;
@@ -870,7 +2099,14 @@ esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err) {
 static httpd_handle_t start_webserver(void) {
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    // Slow handlers run on the http_async workers, so the server task itself only parses requests and
+    // hands them off. Keep-alive connections are only purged once all CONFIG_APP_HTTPD_MAX_SOCKETS are in use.
     config.lru_purge_enable = true;
+    // httpd takes 3 sockets from the LWIP pool for its own use
+    _Static_assert(CONFIG_APP_HTTPD_MAX_SOCKETS <= CONFIG_LWIP_MAX_SOCKETS - 3,
+                   "CONFIG_APP_HTTPD_MAX_SOCKETS must be at most CONFIG_LWIP_MAX_SOCKETS - 3");
+    config.max_open_sockets = CONFIG_APP_HTTPD_MAX_SOCKETS;
+    config.max_uri_handlers = 24;
 
     // Start the httpd server
     ESP_LOGI(TAG_SERVER, "Starting server on port: '%d'", config.server_port);
@@ -881,10 +2117,28 @@ static httpd_handle_t start_webserver(void) {
         httpd_register_uri_handler(server, &css_uri);
         httpd_register_uri_handler(server, &js_uri);
         httpd_register_uri_handler(server, &stats_uri);
+        httpd_register_uri_handler(server, &stats_bin_uri);
         httpd_register_uri_handler(server, &pump_uri);
         httpd_register_uri_handler(server, &set_trigger_uri);
         httpd_register_uri_handler(server, &set_topup_uri);
         httpd_register_uri_handler(server, &set_topup_schedule_uri);
+        httpd_register_uri_handler(server, &config_get_uri);
+        httpd_register_uri_handler(server, &config_patch_uri);
+        httpd_register_uri_handler(server, &logs_uri);
+        httpd_register_uri_handler(server, &metrics_uri);
+        httpd_register_uri_handler(server, &runtime_uri);
+        httpd_register_uri_handler(server, &rollup_uri);
+        httpd_register_uri_handler(server, &rules_get_uri);
+        httpd_register_uri_handler(server, &rules_patch_uri);
+        httpd_register_uri_handler(server, &topups_uri);
+        httpd_register_uri_handler(server, &shadow_get_uri);
+        httpd_register_uri_handler(server, &shadow_patch_uri);
+#if CONFIG_DISTANCE_SENSOR_TRACE
+        httpd_register_uri_handler(server, &trace_uri);
+#endif
+#if CONFIG_APP_OTA_HTTP
+        httpd_register_uri_handler(server, &ota_uri);
+#endif
         return server;
     }
 
@@ -892,49 +2146,50 @@ static httpd_handle_t start_webserver(void) {
     return NULL;
 }
 
-static esp_err_t stop_webserver(httpd_handle_t server) {
-    return httpd_stop(server);
+static void get_topup_params(const app_config_t *cfg, topup_params_t *params) {
+    // Demand and continuous fills have their own start condition, they fill to their own level
+    params->trigger_level_um = cfg->schedule_mode != SCHEDULE_FIXED ? cfg->fill_level_um : cfg->trigger_level_um;
+    params->num_below_trigger = cfg->num_below_trigger;
 }
 
-static void disconnect_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
-    httpd_handle_t *server = (httpd_handle_t *)arg;
-    if (*server) {
-        ESP_LOGI(TAG_SERVER, "Stopping webserver");
-        if (stop_webserver(*server) == ESP_OK) {
-            *server = NULL;
-        } else {
-            ESP_LOGE(TAG_SERVER, "Failed to stop http server");
-        }
+static void journal_topup(topup_record_t *record) {
+    esp_err_t err = topup_journal_append(record);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to record topup (%s)", esp_err_to_name(err));
     }
 }
 
-static void connect_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
-    httpd_handle_t *server = (httpd_handle_t *)arg;
-    if (*server == NULL) {
-        ESP_LOGI(TAG_SERVER, "Starting webserver");
-        *server = start_webserver();
+/*
+ * Waits for the other units on the reservoir. This happens before topup_lock is taken, so a long wait never holds
+ * up an OTA reboot, and the lease outlasts the pump time limit, so it never lapses mid fill. The wait can take
+ * minutes, so the level is read again once the slot is ours. Returns false, with the slot given back and the
+ * outcome recorded, if that reading fails or no longer calls for water.
+ */
+static bool wait_for_fill_slot(const app_config_t *cfg, const topup_params_t *params, int32_t *level_um,
+                               topup_record_t *record) {
+    peer_coord_acquire(cfg->max_topup_time_ms + PEER_LEASE_MARGIN_MS);
+#if CONFIG_APP_PEER_COORD
+    if (get_current_water_level(level_um) != ESP_OK) {
+        BINLOG(EV_TOPUP_NO_LEVEL);
+        record->outcome = TOPUP_OUTCOME_NO_LEVEL;
+        record->sensor_errors = 1;
+        peer_coord_release();
+        return false;
     }
-}
-
-static void obtain_time(void) {
-    ESP_LOGI(TAG_TIME, "Initializing and starting SNTP");
-    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
-    esp_netif_sntp_init(&config);
-
-    time_t now = 0;
-    struct tm timeinfo = {0};
-    int retry = 0;
-    const int retry_count = 15;
-    while (esp_netif_sntp_sync_wait(2000 / portTICK_PERIOD_MS) == ESP_ERR_TIMEOUT && ++retry < retry_count) {
-        ESP_LOGI(TAG_TIME, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
+    record->start_level_um = record->end_level_um = *level_um;
+    if (!topup_needed(params, *level_um)) {
+        BINLOG(EV_TOPUP_NOT_NEEDED, *level_um, params->trigger_level_um);
+        set_trigger_reason(TOPUP_NOT_NEEDED);
+        record->outcome = TOPUP_OUTCOME_NOT_NEEDED;
+        peer_coord_release();
+        return false;
     }
-    time(&now);
-    localtime_r(&now, &timeinfo);
-
-    esp_netif_sntp_deinit();
+#endif
+    return true;
 }
 
-void topup_task() {
+// Runs on the control task only, so topups never overlap
+void topup_task(topup_source_t source) {
     time_t now;
     struct tm timeinfo;
     time(&now);
@@ -942,72 +2197,178 @@ void topup_task() {
     localtime_r(&now, &timeinfo);
     strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
     set_last_trigger(strftime_buf);
-    doTopup = false;
-    ESP_LOGI(TAG, "Performing topup");
-    float water_level;
-    esp_err_t err = get_current_water_level(&water_level);
-    int num_below = 0;
+    BINLOG(EV_TOPUP_START);
+    topup_record_t record = {
+        .start_time = time_service_is_valid() ? now : 0,
+        .start_level_um = -1,
+        .end_level_um = -1,
+        .source = source,
+    };
+    int32_t water_level;
+    esp_err_t err = source == TOPUP_SOURCE_CONTINUOUS ? get_latest_water_level(&water_level) : get_current_water_level(&water_level);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "FAILED TO GET WATER LEVEL - NOT TOPPING UP WATER");
+        BINLOG(EV_TOPUP_NO_LEVEL);
+        record.outcome = TOPUP_OUTCOME_NO_LEVEL;
+        record.sensor_errors = 1;
+        journal_topup(&record);
         return;
     }
-    float trigger_level = get_trigger_level();
-    if (water_level >= trigger_level) {
-        bool earlyBreak = false;
-        pump_on();
+    record.start_level_um = record.end_level_um = water_level;
+    app_config_t cfg;
+    config_get(&cfg);
+    topup_params_t params;
+    get_topup_params(&cfg, &params);
+    bool needed = topup_needed(&params, water_level);
+    shadow_decide(needed);
+    if (needed && !interlock_allows(water_level)) {
+        set_trigger_reason(INTERLOCKED);
+        record.outcome = TOPUP_OUTCOME_INTERLOCKED;
+    } else if (needed && source == TOPUP_SOURCE_CONTINUOUS && budget_left_ms(&cfg) == 0) {
+        set_trigger_reason(BUDGET_USED);
+        record.outcome = TOPUP_OUTCOME_BUDGET;
+    } else if (needed && !wait_for_fill_slot(&cfg, &params, &water_level, &record)) {
+        // The outcome is already recorded
+    } else if (needed) {
+        xSemaphoreTake(topup_lock, portMAX_DELAY);
+        BINLOG(EV_TOPUP_PUMPING, water_level, params.trigger_level_um);
+        record.outcome = TOPUP_OUTCOME_REACHED;
+        // Continuous fills also stop when the day's budget runs out
+        uint32_t limit_ms = cfg.max_topup_time_ms;
+        bool budget_limited = false;
+        if (source == TOPUP_SOURCE_CONTINUOUS && budget_left_ms(&cfg) < limit_ms) {
+            limit_ms = budget_left_ms(&cfg);
+            budget_limited = true;
+        }
+        pump_profile_t profile = {
+            .max_duty_pct = cfg.pump_max_duty,
+            .min_duty_pct = cfg.pump_min_duty,
+            .soft_start_ms = cfg.pump_soft_start_ms,
+            .taper_um = cfg.pump_taper_um,
+        };
+        pump_on(pump_profile_duty(&profile, 0, topup_remaining_um(&params, water_level)),
+                cfg.max_topup_time_ms + PUMP_FAILSAFE_MARGIN_MS);
+        shadow_fill_start(&params, cfg.max_topup_time_ms);
         volatile int64_t start_time = esp_timer_get_time();
-        // Update water level BEFORE entering the loop
-        while (num_below < NUM_BELOW_TRIGGER) {
+        topup_fill_t fill;
+        topup_fill_begin(&fill, limit_ms, 0);
+        bool tapering = false;
+        while (true) {
             err = get_current_water_level(&water_level);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Sensor not ok, abandoning topup");
+            if (pump_failsafe_tripped()) {
+                check_failsafe();
+                set_trigger_reason(PUMP_TIMEOUT);
+                BINLOG(EV_TOPUP_TIMEOUT, cfg.max_topup_time_ms);
+                record_fault(&rule_state.timeouts);
+                record.outcome = TOPUP_OUTCOME_TIMEOUT;
+                break;
+            }
+            uint32_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+            if (!pump_state) {
+                // Switched off through /pump, which the fill must not undo
+                set_trigger_reason(PUMP_STOPPED);
+                BINLOG(EV_TOPUP_STOPPED, elapsed_ms);
+                record.outcome = TOPUP_OUTCOME_STOPPED;
+                break;
+            }
+            topup_fill_state_t state = topup_fill_step(&fill, &params, err == ESP_OK, water_level, elapsed_ms);
+            if (state == TOPUP_FILL_SENSOR_FAIL) {
+                BINLOG(EV_TOPUP_SENSOR_FAIL, elapsed_ms);
                 set_trigger_reason(SENSOR_ERROR);
-                earlyBreak = true;
+                record_fault(&rule_state.sensor_fails);
+                record.sensor_errors++;
+                record.outcome = TOPUP_OUTCOME_SENSOR_ERROR;
+                break;
+            }
+            record.samples++;
+            record.end_level_um = water_level;
+            BINLOG(EV_TOPUP_SAMPLE, water_level, fill.num_below);
+            if (state == TOPUP_FILL_REACHED) {
                 break;
             }
 
-            if (water_level < trigger_level) {
-                num_below++;
-            } else {
-                num_below = 0;
+            // Every reading moves the flow along the profile
+            int32_t remaining_um = topup_remaining_um(&params, water_level);
+            uint8_t duty_pct = pump_profile_duty(&profile, elapsed_ms, remaining_um);
+            if (pump_state && duty_pct != pump_duty_pct) {
+                pump_set_duty(duty_pct);
+            }
+            if (!tapering && profile.taper_um > 0 && remaining_um < profile.taper_um) {
+                tapering = true;
+                BINLOG(EV_PUMP_TAPER, remaining_um, duty_pct);
             }
-            if (timeout_expired(start_time, MAX_TOPUP_TIME)) {
+            if (!interlock_allows(water_level)) {
+                set_trigger_reason(INTERLOCKED);
+                record.outcome = TOPUP_OUTCOME_INTERLOCKED;
+                break;
+            }
+            // The fill's limit is the day's remaining budget when that is the shorter of the two
+            if (state == TOPUP_FILL_TIMEOUT && budget_limited) {
+                set_trigger_reason(BUDGET_USED);
+                BINLOG(EV_CONTINUOUS_BUDGET, cfg.daily_pump_budget_ms);
+                record.outcome = TOPUP_OUTCOME_BUDGET;
+                break;
+            }
+            if (state == TOPUP_FILL_TIMEOUT) {
                 set_trigger_reason(PUMP_TIMEOUT);
-                ESP_LOGW(TAG_TIME, "10s timer topup reached... stopping pump");
-                earlyBreak = true;
+                BINLOG(EV_TOPUP_TIMEOUT, cfg.max_topup_time_ms);
+                record_fault(&rule_state.timeouts);
+                record.outcome = TOPUP_OUTCOME_TIMEOUT;
                 break;
             }
         }
         pump_off();
-        if (!earlyBreak) {
+        shadow_fill_end();
+        peer_coord_release();
+        if (record.outcome == TOPUP_OUTCOME_REACHED) {
             set_trigger_reason(TRIGGER_REACHED);
         }
+        record.duration_ms = (esp_timer_get_time() - start_time) / 1000;
+        add_budget_time(record.duration_ms);
+        BINLOG(EV_TOPUP_DONE, water_level, record.duration_ms);
+        int64_t end_rtc_us = esp_rtc_get_time_us();
+        portENTER_CRITICAL(&rule_state_lock);
+        rule_state.last_topup_end_us = end_rtc_us;
+        portEXIT_CRITICAL(&rule_state_lock);
+        xSemaphoreGive(topup_lock);
     } else {
+        BINLOG(EV_TOPUP_NOT_NEEDED, water_level, params.trigger_level_um);
         set_trigger_reason(TOPUP_NOT_NEEDED);
+        record.outcome = TOPUP_OUTCOME_NOT_NEEDED;
     }
-    ESP_LOGI(TAG, "Topup done");
+    journal_topup(&record);
 }
 
 void timer_callback(void *arg) {
     static int prev_day_executed = -1; // possible for timer to occur multiple times during the trigger period, this ensures it only executes once per day
     time_t now;
     struct tm timeinfo;
+    if (!time_service_is_valid()) {
+        return; // no idea what the time is yet, the schedule starts with the first NTP sync
+    }
     time(&now);
-
-    char strftime_buf[64];
     localtime_r(&now, &timeinfo);
-    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-    ESP_LOGI(TAG_TIME, "The timer triggered at: %s", strftime_buf);
+    BINLOG(EV_TIMER_FIRED, timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_wday);
 
     // tm_wday stores Sunday as 0, when I need Monday as 0. Subtracting 1 and manually setting Sunday to 6 fixes this.
     int currentWeekday = timeinfo.tm_wday - 1;
     currentWeekday = currentWeekday < 0 ? 6 : currentWeekday;
 
-    if (((get_trigger_days() >> currentWeekday) & 1) && timeinfo.tm_hour == get_trigger_hour() && timeinfo.tm_min == get_trigger_minute() && prev_day_executed != timeinfo.tm_mday) {
-        ESP_LOGI(TAG_TIME, "Timer has triggered topup function");
-        obtain_time(); // resync with SNTP
+    app_config_t cfg;
+    config_get(&cfg);
+    if (cfg.schedule_mode == SCHEDULE_CONTINUOUS) {
+        return; // started by the sampler
+    }
+    if (cfg.schedule_mode == SCHEDULE_DEMAND) {
+        if (planner_should_fill(now, &cfg)) {
+            BINLOG(EV_TIMER_TOPUP);
+            request_topup(TOPUP_SOURCE_DEMAND);
+        }
+        return;
+    }
+    if (((cfg.trigger_days >> currentWeekday) & 1) && timeinfo.tm_hour == cfg.trigger_hour && timeinfo.tm_min == cfg.trigger_minute && prev_day_executed != timeinfo.tm_mday) {
+        BINLOG(EV_TIMER_TOPUP);
         prev_day_executed = timeinfo.tm_mday;
-        doTopup = true;
+        request_topup(TOPUP_SOURCE_SCHEDULE);
     }
 }
 
@@ -1023,57 +2384,69 @@ void start_timer() {
     esp_timer_start_periodic(timer, delay_us);
 }
 
+// Runs topups asked for by the schedule. Started before the network so the tank is looked after without Wi-Fi.
+static void control_task(void *arg) {
+    while (true) {
+        uint32_t requested;
+        ota_update_health(OTA_HEALTH_CONTROL);
+        xTaskNotifyWait(0, UINT32_MAX, &requested, portMAX_DELAY);
+        if (requested) {
+            topup_task(__builtin_ctz(requested)); // merged requests are recorded as the first source
+        }
+    }
+}
+
 void app_main(void) {
+    // Only warnings and errors go to the UART, the full event history is kept in the binary log and served on /logs
+    binlog_init(log_events, EV_COUNT);
     esp_log_level_set("*", ESP_LOG_WARN);
-    esp_log_level_set("example_common", ESP_LOG_INFO); // To print the IP address
+    esp_log_level_set("wifi_mgr", ESP_LOG_INFO); // To print the IP address
+    ++boot_count;
+    BINLOG(EV_BOOT, boot_count);
+    rtc_state_init();
 
-    // Set up HC-SR04 sensor
-    distance_init(&sensor);
+    // The pump pin goes low before anything else can fail
     ESP_ERROR_CHECK(gpio_reset_pin(PUMP_PIN));
     ESP_ERROR_CHECK(gpio_set_direction(PUMP_PIN, GPIO_MODE_OUTPUT));
     ESP_ERROR_CHECK(gpio_set_level(PUMP_PIN, 0));
-
-    static httpd_handle_t server = NULL;
+    pump_pwm_init();
+    distance_init(&sensor);
+#if CONFIG_DISTANCE_SENSOR_BENCHMARK
+    distance_benchmark();
+#endif
+    boot_mark(BOOT_PHASE_HARDWARE);
 
     ESP_ERROR_CHECK(nvs_flash_init());
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-
     ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &my_handle));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(config_init(my_handle));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(rule_store_init(my_handle));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(shadow_init(my_handle, TRIGGER_WHEN_FARTHER));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(topup_journal_init());
+    // Before the tasks whose health decides whether an updated firmware is kept
+    ESP_ERROR_CHECK_WITHOUT_ABORT(ota_update_init());
+    boot_mark(BOOT_PHASE_STORAGE);
+
+    topup_lock = xSemaphoreCreateMutex();
+    ESP_ERROR_CHECK(topup_lock ? ESP_OK : ESP_ERR_NO_MEM);
+    ESP_ERROR_CHECK(rollup_init());
+    ESP_ERROR_CHECK(planner_init(TRIGGER_WHEN_FARTHER));
+    ESP_ERROR_CHECK(level_sampler_start(&sensor, on_level_sample));
+    ESP_ERROR_CHECK(xTaskCreate(control_task, "control", 4096, NULL, CONTROL_TASK_PRIORITY, &control_task_handle) == pdPASS ? ESP_OK : ESP_ERR_NO_MEM);
+    boot_mark(BOOT_PHASE_CONTROL);
 
-    ESP_ERROR_CHECK(example_connect());
-
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, &server));
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnect_handler, &server));
-
-    server = start_webserver();
-
-    ++boot_count;
-    ESP_LOGI(TAG_TIME, "Boot count: %d", boot_count);
-
-    // Set system time using SNTP
-    time_t now;
-    struct tm timeinfo;
-    time(&now);
-    localtime_r(&now, &timeinfo);
-
-    if (timeinfo.tm_year < (2016 - 1900)) {
-        ESP_LOGI(TAG_TIME, "Time is not set yet. Connecting to WiFi and getting time over NTP.");
-        obtain_time();
-        time(&now);
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    ESP_ERROR_CHECK(http_async_init());
+    ESP_ERROR_CHECK_WITHOUT_ABORT(runtime_stats_init());
+    ESP_ERROR_CHECK_WITHOUT_ABORT(time_service_init());
+    // Neither waits for the network. The server listens on every address, so it stays up through Wi-Fi outages.
+    ESP_ERROR_CHECK_WITHOUT_ABORT(wifi_manager_start());
+    ESP_ERROR_CHECK_WITHOUT_ABORT(peer_coord_start());
+    if (start_webserver()) {
+        boot_mark(BOOT_PHASE_HTTP);
+        ota_update_health(OTA_HEALTH_HTTP);
     }
-    char strftime_buf[64];
-    setenv("TZ", "SAST-2", 1);
-    tzset();
-    localtime_r(&now, &timeinfo);
-    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-    ESP_LOGI(TAG_TIME, "The current date/time in Johannesburg is: %s", strftime_buf);
 
+    // The schedule runs straight away on the restored time if there is one, the time service keeps it correct
     start_timer();
-    while (server) {
-        if (doTopup) {
-            topup_task();
-        }
-        sleep(5);
-    }
 }
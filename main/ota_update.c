@@ -0,0 +1,193 @@
+#include "ota_update.h"
+#include "log_events.h"
+
+#include <esp_app_desc.h>
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <mbedtls/sha256.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "ota";
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static ota_update_status_t status;
+static uint32_t health_samples;
+static esp_timer_handle_t deadline_timer;
+
+// Session state, only touched by the task that called ota_update_begin()
+static const esp_partition_t *target;
+static esp_ota_handle_t handle;
+static mbedtls_sha256_context sha;
+static uint8_t expected_sha[OTA_SHA256_LEN];
+static int64_t started_us;
+
+static void deadline_expired(void *arg) {
+    portENTER_CRITICAL(&lock);
+    uint8_t health = status.health;
+    bool pending = status.pending_verify;
+    portEXIT_CRITICAL(&lock);
+    if (pending) {
+        BINLOG(EV_OTA_ROLLBACK, health, CONFIG_APP_OTA_HEALTH_DEADLINE_S);
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+}
+
+esp_err_t ota_update_init(void) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    bool pending = esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY;
+
+    portENTER_CRITICAL(&lock);
+    snprintf(status.running, sizeof(status.running), "%s", running->label);
+    snprintf(status.version, sizeof(status.version), "%s", esp_app_get_description()->version);
+    status.pending_verify = pending;
+    portEXIT_CRITICAL(&lock);
+    if (!pending) {
+        return ESP_OK;
+    }
+
+    ESP_LOGW(TAG, "Running new firmware %s from %s, waiting for health checks", status.version, status.running);
+    esp_timer_create_args_t args = {
+        .callback = deadline_expired,
+        .name = "ota_deadline",
+    };
+    esp_err_t err = esp_timer_create(&args, &deadline_timer);
+    if (err == ESP_OK) {
+        err = esp_timer_start_once(deadline_timer, CONFIG_APP_OTA_HEALTH_DEADLINE_S * 1000000LL);
+    }
+    return err;
+}
+
+void ota_update_health(ota_health_t check) {
+    portENTER_CRITICAL(&lock);
+    if (check == OTA_HEALTH_SAMPLES && ++health_samples < CONFIG_APP_OTA_HEALTH_SAMPLES) {
+        check = 0;
+    }
+    bool passed = status.pending_verify && (status.health | check) == OTA_HEALTH_ALL;
+    status.health |= check;
+    if (passed) {
+        status.pending_verify = false;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (passed) {
+        esp_timer_stop(deadline_timer);
+        esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
+        BINLOG(EV_OTA_VALID, esp_timer_get_time() / 1000, err);
+    }
+}
+
+esp_err_t ota_update_begin(size_t image_len, const uint8_t sha256[OTA_SHA256_LEN]) {
+    portENTER_CRITICAL(&lock);
+    // A new image on top of one still being verified would lose the way back to the last good one
+    esp_err_t err = ESP_OK;
+    if (status.in_progress) {
+        err = ESP_ERR_INVALID_STATE;
+    } else if (status.pending_verify) {
+        err = ESP_ERR_OTA_ROLLBACK_INVALID_STATE;
+    } else {
+        status.in_progress = true;
+        status.received = 0;
+        status.image_len = image_len;
+    }
+    portEXIT_CRITICAL(&lock);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    target = esp_ota_get_next_update_partition(NULL);
+    if (!target) {
+        err = ESP_ERR_NOT_FOUND;
+    } else if (image_len > target->size) {
+        err = ESP_ERR_INVALID_SIZE;
+    } else {
+        // Only erases the sectors the image needs, so a 1 MB image is not slowed down by a larger partition
+        err = esp_ota_begin(target, image_len, &handle);
+    }
+    if (err != ESP_OK) {
+        portENTER_CRITICAL(&lock);
+        status.in_progress = false;
+        status.failures++;
+        status.last_err = err;
+        portEXIT_CRITICAL(&lock);
+        BINLOG(EV_OTA_FAIL, err, 0);
+        return err;
+    }
+    memcpy(expected_sha, sha256, OTA_SHA256_LEN);
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    started_us = esp_timer_get_time();
+    BINLOG(EV_OTA_START, image_len, target->address);
+    return ESP_OK;
+}
+
+esp_err_t ota_update_write(const void *data, size_t len) {
+    if (status.received + len > status.image_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    mbedtls_sha256_update(&sha, data, len);
+    esp_err_t err = esp_ota_write(handle, data, len);
+    if (err == ESP_OK) {
+        portENTER_CRITICAL(&lock);
+        status.received += len;
+        portEXIT_CRITICAL(&lock);
+    }
+    return err;
+}
+
+void ota_update_abort(esp_err_t reason) {
+    esp_ota_abort(handle);
+    mbedtls_sha256_free(&sha);
+    portENTER_CRITICAL(&lock);
+    uint32_t received = status.received;
+    status.in_progress = false;
+    status.failures++;
+    status.last_err = reason;
+    portEXIT_CRITICAL(&lock);
+    BINLOG(EV_OTA_FAIL, reason, received);
+}
+
+esp_err_t ota_update_end(void) {
+    uint8_t actual[OTA_SHA256_LEN];
+    mbedtls_sha256_finish(&sha, actual);
+    if (status.received != status.image_len) {
+        ota_update_abort(ESP_ERR_INVALID_SIZE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (memcmp(actual, expected_sha, OTA_SHA256_LEN) != 0) {
+        ota_update_abort(ESP_ERR_INVALID_CRC);
+        return ESP_ERR_INVALID_CRC;
+    }
+    mbedtls_sha256_free(&sha);
+
+    // esp_ota_end() also checks the image header and the checksum the build appends
+    esp_err_t err = esp_ota_end(handle);
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(target);
+    }
+    uint32_t ms = (esp_timer_get_time() - started_us) / 1000;
+    portENTER_CRITICAL(&lock);
+    status.in_progress = false;
+    status.last_err = err;
+    if (err == ESP_OK) {
+        status.updates++;
+        status.last_ms = ms;
+    } else {
+        status.failures++;
+    }
+    portEXIT_CRITICAL(&lock);
+    if (err == ESP_OK) {
+        BINLOG(EV_OTA_DONE, status.image_len, ms);
+    } else {
+        BINLOG(EV_OTA_FAIL, err, status.received);
+    }
+    return err;
+}
+
+void ota_update_get_status(ota_update_status_t *out) {
+    portENTER_CRITICAL(&lock);
+    *out = status;
+    portEXIT_CRITICAL(&lock);
+}
@@ -0,0 +1,56 @@
+#ifndef __OTA_UPDATE_H__
+#define __OTA_UPDATE_H__
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTA_SHA256_LEN 32
+
+// What a freshly updated firmware has to show before it is kept
+typedef enum {
+    OTA_HEALTH_SAMPLES = 0x01, // CONFIG_APP_OTA_HEALTH_SAMPLES good level readings
+    OTA_HEALTH_CONTROL = 0x02, // the control task is waiting for topup requests
+    OTA_HEALTH_HTTP = 0x04,    // the web server is up, so a fixed image can be pushed
+    OTA_HEALTH_ALL = 0x07,
+} ota_health_t;
+
+typedef struct {
+    char running[17];        // label of the partition the firmware booted from
+    char version[32];        // of the running firmware
+    bool pending_verify;     // booted into a new image that has not passed the health checks yet
+    uint8_t health;          // ota_health_t checks passed this boot
+    bool in_progress;        // an image is being received
+    uint32_t received;       // bytes of the image being received, or of the last one
+    uint32_t image_len;
+    uint32_t updates;        // images written since boot
+    uint32_t failures;
+    uint32_t last_ms;        // time the last successful update took to receive and verify
+    esp_err_t last_err;
+} ota_update_status_t;
+
+/*
+ * A/B firmware updates. An image is streamed into the inactive app partition as it arrives and hashed on the way,
+ * only if the SHA-256 matches is the partition made the boot partition. After a reboot into it, the new firmware
+ * stays pending until every ota_health_t check has passed. If that does not happen within
+ * CONFIG_APP_OTA_HEALTH_DEADLINE_S the bootloader is told to go back to the previous image and the unit restarts.
+ * A firmware that crashes before then is rolled back by the bootloader itself.
+ */
+esp_err_t ota_update_init(void);
+
+// Reports a passed health check, a no-op unless the running image is pending
+void ota_update_health(ota_health_t check);
+
+// Starts receiving an image of image_len bytes. Only one image is received at a time, ESP_ERR_INVALID_STATE is
+// returned while another one is, and ESP_ERR_OTA_ROLLBACK_INVALID_STATE while the running image is still pending.
+esp_err_t ota_update_begin(size_t image_len, const uint8_t sha256[OTA_SHA256_LEN]);
+esp_err_t ota_update_write(const void *data, size_t len);
+
+// Checks the length, hash and image and switches the boot partition. Returns ESP_ERR_INVALID_CRC on a hash mismatch.
+esp_err_t ota_update_end(void);
+void ota_update_abort(esp_err_t reason);
+
+void ota_update_get_status(ota_update_status_t *out);
+
+#endif // __OTA_UPDATE_H__
@@ -0,0 +1,227 @@
+#include "peer_coord.h"
+#include "log_events.h"
+#include "peer_lease.h"
+#include "wifi_manager.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <netinet/in.h>
+#include <sdkconfig.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define COORD_PRIORITY 4 // below the HTTP workers, announcements have a whole lease of slack
+#define COORD_STACK_SIZE 3072
+#define POLL_MS 100
+
+static peer_coord_status_t status;
+
+#if CONFIG_APP_PEER_COORD
+static const char *TAG = "peers";
+static SemaphoreHandle_t lock; // guards lease and status
+static peer_lease_t lease;
+
+static int64_t now_ms(void) {
+    return esp_timer_get_time() / 1000;
+}
+
+static int open_socket(struct sockaddr_in *group) {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_APP_PEER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    struct ip_mreq mreq = {
+        .imr_multiaddr.s_addr = group->sin_addr.s_addr,
+        .imr_interface.s_addr = htonl(INADDR_ANY),
+    };
+    uint8_t ttl = 1; // the reservoir is shared by units on one LAN
+    uint8_t loop = 1; // lets several linux target instances on one host hear each other
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+        ESP_LOGW(TAG, "Failed to join " CONFIG_APP_PEER_GROUP_ADDR ":%d (errno %d)", CONFIG_APP_PEER_PORT, errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void coord_task(void *arg) {
+    struct sockaddr_in group = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_APP_PEER_PORT),
+        .sin_addr.s_addr = inet_addr(CONFIG_APP_PEER_GROUP_ADDR),
+    };
+    int sock = -1;
+    int64_t next_announce = 0;
+    uint8_t announced_state = PEER_IDLE;
+    while (true) {
+        // The group membership does not survive the interface going down, so the socket follows the connection
+        wifi_manager_status_t wifi;
+        wifi_manager_get_status(&wifi);
+        if (!wifi.connected && sock >= 0) {
+            close(sock);
+            sock = -1;
+        } else if (wifi.connected && sock < 0) {
+            sock = open_socket(&group);
+            next_announce = 0;
+        }
+
+        int64_t now = now_ms();
+        xSemaphoreTake(lock, portMAX_DELAY);
+        status.socket_open = sock >= 0;
+        bool announce = now >= next_announce || lease.state != announced_state;
+        uint8_t msg[PEER_MSG_LEN];
+        if (announce) {
+            peer_lease_announce(&lease, msg, now);
+            announced_state = lease.state;
+            next_announce = now + (lease.state == PEER_IDLE ? PEER_IDLE_ANNOUNCE_MS : PEER_ANNOUNCE_MS);
+        }
+        xSemaphoreGive(lock);
+
+        if (sock < 0) {
+            vTaskDelay(pdMS_TO_TICKS(POLL_MS));
+            continue;
+        }
+        if (announce && sendto(sock, msg, sizeof(msg), 0, (struct sockaddr *)&group, sizeof(group)) < 0) {
+            ESP_LOGD(TAG, "Announce failed (errno %d)", errno);
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        struct timeval timeout = {.tv_usec = POLL_MS * 1000};
+        if (select(sock + 1, &fds, NULL, NULL, &timeout) > 0) {
+            char buf[64];
+            int len = recv(sock, buf, sizeof(buf), 0);
+            if (len > 0) {
+                xSemaphoreTake(lock, portMAX_DELAY);
+                peer_lease_receive(&lease, buf, len, now_ms());
+                xSemaphoreGive(lock);
+            }
+        }
+    }
+}
+
+static uint32_t get_unit_id(void) {
+#if CONFIG_IDF_TARGET_LINUX
+    return getpid(); // tells apart instances running on one host
+#else
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    return (uint32_t)mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5];
+#endif
+}
+
+esp_err_t peer_coord_start(void) {
+    lock = xSemaphoreCreateMutex();
+    if (!lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    status.enabled = true;
+    status.unit_id = get_unit_id();
+    peer_lease_init(&lease, status.unit_id, CONFIG_APP_PEER_GAP_MS);
+    if (xTaskCreate(coord_task, "peers", COORD_STACK_SIZE, NULL, COORD_PRIORITY, NULL) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+bool peer_coord_acquire(uint32_t lease_ms) {
+    if (!lock) {
+        return true;
+    }
+    int64_t start = now_ms();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    peer_lease_request(&lease, start);
+    xSemaphoreGive(lock);
+
+    // Peers we stop hearing expire with their leases, so a vanished holder only blocks us until its lease runs out
+    bool granted = false;
+    int64_t now = start;
+    while (!granted && now - start < CONFIG_APP_PEER_MAX_WAIT_S * 1000LL) {
+        vTaskDelay(pdMS_TO_TICKS(POLL_MS));
+        now = now_ms();
+        xSemaphoreTake(lock, portMAX_DELAY);
+        granted = peer_lease_try_grant(&lease, now, lease_ms);
+        xSemaphoreGive(lock);
+    }
+
+    uint32_t waited_ms = now - start;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (granted) {
+        status.acquisitions++;
+    } else {
+        // Fill without the slot, a missed topup is worse than two pumps drawing from the reservoir at once
+        peer_lease_release(&lease, now);
+        status.timeouts++;
+    }
+    status.last_wait_ms = waited_ms;
+    status.total_wait_ms += waited_ms;
+    if (waited_ms > status.max_wait_ms) {
+        status.max_wait_ms = waited_ms;
+    }
+    int peers = peer_lease_live_peers(&lease, now);
+    xSemaphoreGive(lock);
+
+    if (granted) {
+        BINLOG(EV_PEER_WAIT, waited_ms, peers);
+    } else {
+        BINLOG(EV_PEER_TIMEOUT, waited_ms, peers);
+    }
+    return granted;
+}
+
+void peer_coord_release(void) {
+    if (!lock) {
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (lease.state == PEER_HOLDING) {
+        peer_lease_release(&lease, now_ms());
+    }
+    xSemaphoreGive(lock);
+}
+
+void peer_coord_get_status(peer_coord_status_t *out) {
+    if (!lock) {
+        *out = status;
+        return;
+    }
+    int64_t now = now_ms();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    status.live_peers = peer_lease_live_peers(&lease, now);
+    status.holder = peer_lease_holder(&lease, now);
+    *out = status;
+    xSemaphoreGive(lock);
+}
+#else
+esp_err_t peer_coord_start(void) {
+    return ESP_OK;
+}
+
+bool peer_coord_acquire(uint32_t lease_ms) {
+    return true;
+}
+
+void peer_coord_release(void) {
+}
+
+void peer_coord_get_status(peer_coord_status_t *out) {
+    *out = status;
+}
+#endif
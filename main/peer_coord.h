@@ -0,0 +1,36 @@
+#ifndef __PEER_COORD_H__
+#define __PEER_COORD_H__
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    bool enabled;
+    bool socket_open;     // joined the multicast group
+    uint32_t unit_id;
+    uint8_t live_peers;   // heard from within their lease
+    uint32_t holder;      // unit currently filling, 0 if none
+    uint32_t acquisitions;
+    uint32_t timeouts;    // gave up waiting and filled anyway
+    uint32_t last_wait_ms;
+    uint32_t max_wait_ms;
+    uint64_t total_wait_ms;
+} peer_coord_status_t;
+
+/*
+ * Shares one RO reservoir between units on the same LAN, so only one of them fills at a time with a pause in
+ * between. The arbitration itself is in peer_lease.c, this runs it over UDP multicast on the group and port from the
+ * "Peer coordination" Kconfig menu. The socket follows the Wi-Fi connection, a unit that cannot hear the group just
+ * forgets its peers once their leases run out and carries on alone.
+ */
+esp_err_t peer_coord_start(void);
+
+// Waits for the fill slot and holds it for at most lease_ms. Returns false if the wait timed out, the caller fills anyway.
+bool peer_coord_acquire(uint32_t lease_ms);
+
+void peer_coord_release(void);
+
+void peer_coord_get_status(peer_coord_status_t *out);
+
+#endif // __PEER_COORD_H__
@@ -0,0 +1,182 @@
+#include "peer_lease.h"
+
+#include <string.h>
+
+_Static_assert(sizeof(peer_msg_t) == PEER_MSG_LEN, "peer_msg_t no longer matches the wire format");
+
+static void put_le32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void encode(const peer_msg_t *msg, uint8_t *out) {
+    memcpy(&out[offsetof(peer_msg_t, magic)], msg->magic, sizeof(msg->magic));
+    out[offsetof(peer_msg_t, version)] = msg->version;
+    out[offsetof(peer_msg_t, state)] = msg->state;
+    out[offsetof(peer_msg_t, reserved)] = 0;
+    out[offsetof(peer_msg_t, reserved) + 1] = 0;
+    put_le32(&out[offsetof(peer_msg_t, unit_id)], msg->unit_id);
+    put_le32(&out[offsetof(peer_msg_t, waited_ms)], msg->waited_ms);
+    put_le32(&out[offsetof(peer_msg_t, lease_ms)], msg->lease_ms);
+}
+
+static void decode(const uint8_t *in, peer_msg_t *msg) {
+    memcpy(msg->magic, &in[offsetof(peer_msg_t, magic)], sizeof(msg->magic));
+    msg->version = in[offsetof(peer_msg_t, version)];
+    msg->state = in[offsetof(peer_msg_t, state)];
+    msg->reserved = 0;
+    msg->unit_id = get_le32(&in[offsetof(peer_msg_t, unit_id)]);
+    msg->waited_ms = get_le32(&in[offsetof(peer_msg_t, waited_ms)]);
+    msg->lease_ms = get_le32(&in[offsetof(peer_msg_t, lease_ms)]);
+}
+
+void peer_lease_init(peer_lease_t *lease, uint32_t unit_id, uint32_t gap_ms) {
+    memset(lease, 0, sizeof(*lease));
+    lease->unit_id = unit_id;
+    lease->gap_ms = gap_ms;
+    lease->last_release_ms = INT64_MIN / 2;
+}
+
+// Drops peers whose lease ran out. A holder that vanished frees the slot when its lease ends.
+static void prune(peer_lease_t *lease, int64_t now_ms) {
+    for (int i = 0; i < PEER_MAX; i++) {
+        peer_entry_t *peer = &lease->peers[i];
+        if (peer->unit_id && peer->expires_ms <= now_ms) {
+            if (peer->state == PEER_HOLDING && peer->expires_ms > lease->last_release_ms) {
+                lease->last_release_ms = peer->expires_ms;
+            }
+            peer->unit_id = 0;
+        }
+    }
+}
+
+void peer_lease_receive(peer_lease_t *lease, const void *data, size_t len, int64_t now_ms) {
+    peer_msg_t msg;
+    if (len != PEER_MSG_LEN) {
+        return;
+    }
+    decode(data, &msg);
+    if (memcmp(msg.magic, PEER_MSG_MAGIC, 4) != 0 || msg.version != PEER_MSG_VERSION || msg.unit_id == 0 ||
+        msg.unit_id == lease->unit_id || msg.state > PEER_HOLDING) {
+        return;
+    }
+    prune(lease, now_ms);
+
+    peer_entry_t *entry = NULL;
+    for (int i = 0; i < PEER_MAX && !entry; i++) {
+        if (lease->peers[i].unit_id == msg.unit_id) {
+            entry = &lease->peers[i];
+        }
+    }
+    for (int i = 0; i < PEER_MAX && !entry; i++) {
+        if (lease->peers[i].unit_id == 0) {
+            entry = &lease->peers[i];
+            entry->state = PEER_IDLE;
+        }
+    }
+    if (!entry) {
+        return; // more units than PEER_MAX, the extra ones are treated as absent
+    }
+    if (entry->state == PEER_HOLDING && msg.state != PEER_HOLDING) {
+        lease->last_release_ms = now_ms;
+    }
+    entry->unit_id = msg.unit_id;
+    entry->state = msg.state;
+    entry->waited_ms = msg.waited_ms;
+    entry->heard_ms = now_ms;
+    entry->expires_ms = now_ms + msg.lease_ms;
+}
+
+void peer_lease_announce(const peer_lease_t *lease, uint8_t out[PEER_MSG_LEN], int64_t now_ms) {
+    peer_msg_t msg = {
+        .magic = PEER_MSG_MAGIC,
+        .version = PEER_MSG_VERSION,
+        .state = lease->state,
+        .unit_id = lease->unit_id,
+    };
+    switch (lease->state) {
+    case PEER_WAITING:
+        msg.waited_ms = now_ms - lease->wait_start_ms;
+        msg.lease_ms = 3 * PEER_ANNOUNCE_MS;
+        break;
+    case PEER_HOLDING: {
+        int64_t left = lease->hold_start_ms + lease->lease_ms - now_ms;
+        msg.lease_ms = left > 0 ? left : 0;
+        break;
+    }
+    default:
+        msg.lease_ms = 3 * PEER_IDLE_ANNOUNCE_MS;
+        break;
+    }
+    encode(&msg, out);
+}
+
+void peer_lease_request(peer_lease_t *lease, int64_t now_ms) {
+    if (lease->state == PEER_IDLE) {
+        lease->state = PEER_WAITING;
+        lease->wait_start_ms = now_ms;
+    }
+}
+
+bool peer_lease_try_grant(peer_lease_t *lease, int64_t now_ms, uint32_t lease_ms) {
+    if (lease->state != PEER_WAITING || now_ms - lease->wait_start_ms < PEER_SETTLE_MS) {
+        return false;
+    }
+    prune(lease, now_ms);
+    if (now_ms - lease->last_release_ms < lease->gap_ms) {
+        return false;
+    }
+    int64_t waited = now_ms - lease->wait_start_ms;
+    for (int i = 0; i < PEER_MAX; i++) {
+        const peer_entry_t *peer = &lease->peers[i];
+        if (!peer->unit_id || peer->state == PEER_IDLE) {
+            continue;
+        }
+        if (peer->state == PEER_HOLDING) {
+            return false;
+        }
+        int64_t peer_waited = peer->waited_ms + (now_ms - peer->heard_ms);
+        if (peer_waited > waited + PEER_TIE_MS || (peer_waited >= waited - PEER_TIE_MS && peer->unit_id < lease->unit_id)) {
+            return false;
+        }
+    }
+    lease->state = PEER_HOLDING;
+    lease->hold_start_ms = now_ms;
+    lease->lease_ms = lease_ms;
+    return true;
+}
+
+void peer_lease_release(peer_lease_t *lease, int64_t now_ms) {
+    if (lease->state == PEER_HOLDING) {
+        lease->last_release_ms = now_ms;
+    }
+    lease->state = PEER_IDLE;
+}
+
+int peer_lease_live_peers(peer_lease_t *lease, int64_t now_ms) {
+    prune(lease, now_ms);
+    int count = 0;
+    for (int i = 0; i < PEER_MAX; i++) {
+        count += lease->peers[i].unit_id != 0;
+    }
+    return count;
+}
+
+uint32_t peer_lease_holder(peer_lease_t *lease, int64_t now_ms) {
+    prune(lease, now_ms);
+    if (lease->state == PEER_HOLDING) {
+        return lease->unit_id;
+    }
+    for (int i = 0; i < PEER_MAX; i++) {
+        if (lease->peers[i].unit_id && lease->peers[i].state == PEER_HOLDING) {
+            return lease->peers[i].unit_id;
+        }
+    }
+    return 0;
+}
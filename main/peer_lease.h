@@ -0,0 +1,83 @@
+#ifndef __PEER_LEASE_H__
+#define __PEER_LEASE_H__
+
+/*
+ * Fill slot arbitration between units sharing a reservoir. Every unit multicasts its state: idle, waiting for the
+ * slot or holding it. Each announcement is only valid for a lease, so a unit that vanishes simply stops counting.
+ * A waiting unit takes the slot once nobody holds it, the gap after the last fill has passed and no live peer has
+ * been waiting longer. Kept free of ESP-IDF and of any transport, so tools/peer_node.c can run it on a PC.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PEER_MAX 8
+#define PEER_MSG_MAGIC "ATOP"
+#define PEER_MSG_VERSION 1
+#define PEER_ANNOUNCE_MS 1000      // announcement period while waiting or holding
+#define PEER_IDLE_ANNOUNCE_MS 10000 // heartbeat period while idle
+#define PEER_SETTLE_MS 1500        // a new claim waits this long to hear competing claims
+#define PEER_TIE_MS 200            // waits this close are decided by unit ID
+
+typedef enum {
+    PEER_IDLE,
+    PEER_WAITING,
+    PEER_HOLDING,
+} peer_state_t;
+
+// Wire format, PEER_MSG_LEN bytes in this order with every field little endian. peer_lease.c writes and reads it
+// field by field, so units and tools on any CPU agree. Times are relative so the units' clocks need not agree.
+#define PEER_MSG_LEN 20
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint8_t version;
+    uint8_t state;     // peer_state_t
+    uint16_t reserved;
+    uint32_t unit_id;
+    uint32_t waited_ms; // how long the sender has been waiting
+    uint32_t lease_ms;  // how long this announcement stays valid
+} peer_msg_t;
+
+typedef struct {
+    uint32_t unit_id; // 0 for a free entry
+    uint8_t state;
+    uint32_t waited_ms;
+    int64_t heard_ms;
+    int64_t expires_ms;
+} peer_entry_t;
+
+typedef struct {
+    uint32_t unit_id;
+    uint32_t gap_ms;   // pause between one unit's fill and the next
+    uint8_t state;
+    uint32_t lease_ms; // while holding
+    int64_t wait_start_ms;
+    int64_t hold_start_ms;
+    int64_t last_release_ms; // the slot was last freed, by anyone
+    peer_entry_t peers[PEER_MAX];
+} peer_lease_t;
+
+void peer_lease_init(peer_lease_t *lease, uint32_t unit_id, uint32_t gap_ms);
+
+// Handles a received datagram. Our own and malformed ones are ignored.
+void peer_lease_receive(peer_lease_t *lease, const void *data, size_t len, int64_t now_ms);
+
+// Our current state as a datagram to be sent to the group
+void peer_lease_announce(const peer_lease_t *lease, uint8_t msg[PEER_MSG_LEN], int64_t now_ms);
+
+// Starts waiting for the slot
+void peer_lease_request(peer_lease_t *lease, int64_t now_ms);
+
+// While waiting, takes the slot for lease_ms if it is our turn
+bool peer_lease_try_grant(peer_lease_t *lease, int64_t now_ms, uint32_t lease_ms);
+
+// Gives up the slot, or stops waiting for it
+void peer_lease_release(peer_lease_t *lease, int64_t now_ms);
+
+int peer_lease_live_peers(peer_lease_t *lease, int64_t now_ms);
+
+// The peer holding the slot, 0 if none
+uint32_t peer_lease_holder(peer_lease_t *lease, int64_t now_ms);
+
+#endif // __PEER_LEASE_H__
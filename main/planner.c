@@ -0,0 +1,218 @@
+#include "planner.h"
+#include "log_events.h"
+
+#include <esp_attr.h>
+#include <freertos/FreeRTOS.h>
+#include <time.h>
+
+#define PLANNER_MAGIC 0x504c4e31
+#define RATE_EWMA_DIV 8           // each hourly drop moves the rate 1/8 of the way
+#define FILL_LEAD_S (30 * 60)     // planned fills finish this long before the predicted crossing
+#define MIN_FILL_GAP_S (60 * 60)  // a failed fill is not retried straight away
+#define PLAN_HORIZON_DAYS 8       // far enough to always find an allowed day when any day is allowed
+#define SECONDS_PER_HOUR 3600
+
+// Learned state kept in RTC memory. Only ever append fields.
+typedef struct {
+    uint32_t magic;
+    int32_t drop_um_per_h;
+    uint32_t hours_measured;
+} planner_learned_t;
+
+RTC_NOINIT_ATTR static planner_learned_t learned;
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static bool farther; // polarity, see CONFIG_APP_TRIGGER_WHEN_FARTHER
+static int64_t hour_num = -1; // hour the running average belongs to
+static int64_t hour_sum_um;
+static uint32_t hour_count;
+static bool hour_pumped;
+static int64_t prev_hour_num = -1; // last completed hour
+static int32_t prev_hour_avg_um;
+static bool prev_hour_pumped;
+static bool have_pump_total;
+static uint32_t last_pump_total_ms;
+static bool have_level;
+static int32_t last_level_um;
+static int64_t last_level_epoch;
+static int64_t last_fill_epoch = INT64_MIN / 2;
+
+esp_err_t planner_init(bool trigger_when_farther) {
+    farther = trigger_when_farther;
+    if (learned.magic != PLANNER_MAGIC) {
+        learned = (planner_learned_t){.magic = PLANNER_MAGIC};
+    }
+    return ESP_OK;
+}
+
+// Called with the lock held when a sample lands in a new hour
+static void finish_hour(void) {
+    int32_t avg_um = hour_sum_um / hour_count;
+    if (prev_hour_num == hour_num - 1 && !prev_hour_pumped && !hour_pumped) {
+        int32_t drop_um = farther ? avg_um - prev_hour_avg_um : prev_hour_avg_um - avg_um;
+        if (learned.hours_measured == 0) {
+            learned.drop_um_per_h = drop_um;
+        } else {
+            learned.drop_um_per_h += (drop_um - learned.drop_um_per_h) / RATE_EWMA_DIV;
+        }
+        learned.hours_measured++;
+    }
+    prev_hour_num = hour_num;
+    prev_hour_avg_um = avg_um;
+    prev_hour_pumped = hour_pumped;
+}
+
+void planner_add_sample(int64_t epoch_s, int32_t level_um, uint32_t pump_total_ms) {
+    int64_t hour = epoch_s / SECONDS_PER_HOUR;
+    bool logged = false;
+    int32_t rate = 0;
+    portENTER_CRITICAL(&lock);
+    bool pumped = have_pump_total && pump_total_ms != last_pump_total_ms;
+    have_pump_total = true;
+    last_pump_total_ms = pump_total_ms;
+    if (hour != hour_num) {
+        if (hour_count) {
+            uint32_t before = learned.hours_measured;
+            finish_hour();
+            logged = learned.hours_measured != before;
+            rate = learned.drop_um_per_h;
+        }
+        hour_num = hour;
+        hour_sum_um = 0;
+        hour_count = 0;
+        hour_pumped = false;
+    }
+    hour_sum_um += level_um;
+    hour_count++;
+    hour_pumped |= pumped;
+    have_level = true;
+    last_level_um = level_um;
+    last_level_epoch = epoch_s;
+    portEXIT_CRITICAL(&lock);
+    if (logged) {
+        BINLOG(EV_PLANNER_RATE, rate);
+    }
+}
+
+// Local midnight days after the one containing epoch_s, and whether fills are allowed on that day
+static bool day_start(int64_t epoch_s, int days, const app_config_t *cfg, int64_t *midnight) {
+    time_t t = epoch_s;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_mday += days;
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    *midnight = mktime(&tm);
+    int weekday = tm.tm_wday == 0 ? 6 : tm.tm_wday - 1; // bit 0 is Monday
+    return (cfg->trigger_days >> weekday) & 1;
+}
+
+// The allowed window on a day. A window that ends before it starts runs past midnight.
+static bool day_window(int64_t epoch_s, int days, const app_config_t *cfg, int64_t *start, int64_t *end) {
+    int64_t midnight;
+    if (!day_start(epoch_s, days, cfg, &midnight)) {
+        return false;
+    }
+    int end_hour = cfg->window_end_hour;
+    if (end_hour <= cfg->window_start_hour) {
+        end_hour += 24;
+    }
+    *start = midnight + cfg->window_start_hour * SECONDS_PER_HOUR;
+    *end = midnight + end_hour * SECONDS_PER_HOUR;
+    return true;
+}
+
+static bool in_window(int64_t epoch_s, const app_config_t *cfg) {
+    int64_t start, end;
+    for (int days = -1; days <= 0; days++) {
+        if (day_window(epoch_s, days, cfg, &start, &end) && epoch_s >= start && epoch_s < end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Level distance still to go before the trigger, negative once past it
+static int32_t remaining_um(int32_t level_um, const app_config_t *cfg) {
+    return farther ? cfg->trigger_level_um - level_um : level_um - cfg->trigger_level_um;
+}
+
+/*
+ * Picks the fill time for a predicted crossing: the last allowed window starting before the crossing, ending
+ * FILL_LEAD_S before the crossing or the window end. If no window starts in time the first one is used.
+ */
+static int64_t plan_fill(int64_t epoch_s, int64_t cross, const app_config_t *cfg) {
+    int64_t planned = -1;
+    int64_t start, end;
+    for (int days = -1; days < PLAN_HORIZON_DAYS; days++) {
+        if (!day_window(epoch_s, days, cfg, &start, &end) || end <= epoch_s) {
+            continue;
+        }
+        if (start >= cross) {
+            return planned >= 0 ? planned : start;
+        }
+        int64_t fill = (cross < end ? cross : end) - FILL_LEAD_S;
+        planned = fill > start ? fill : start;
+    }
+    return planned;
+}
+
+// Called with a copy of the shared state, so no lock is needed
+static void predict(int64_t epoch_s, int32_t level_um, int64_t level_epoch, int32_t rate, const app_config_t *cfg,
+                    int64_t *cross, int64_t *fill) {
+    *cross = -1;
+    *fill = -1;
+    int32_t remaining = remaining_um(level_um, cfg);
+    if (remaining <= 0) {
+        *cross = level_epoch;
+    } else if (rate > 0) {
+        *cross = level_epoch + (int64_t)remaining * SECONDS_PER_HOUR / rate;
+    }
+    if (*cross >= 0) {
+        *fill = plan_fill(epoch_s, *cross, cfg);
+    }
+}
+
+bool planner_should_fill(int64_t epoch_s, const app_config_t *cfg) {
+    portENTER_CRITICAL(&lock);
+    bool ok = have_level;
+    int32_t level_um = last_level_um;
+    int64_t level_epoch = last_level_epoch;
+    int32_t rate = learned.hours_measured ? learned.drop_um_per_h : 0;
+    int64_t last_fill = last_fill_epoch;
+    portEXIT_CRITICAL(&lock);
+
+    if (!ok || epoch_s - last_fill < MIN_FILL_GAP_S || !in_window(epoch_s, cfg)) {
+        return false;
+    }
+    int64_t cross, fill;
+    predict(epoch_s, level_um, level_epoch, rate, cfg, &cross, &fill);
+    if (fill < 0 || fill > epoch_s) {
+        return false;
+    }
+    portENTER_CRITICAL(&lock);
+    last_fill_epoch = epoch_s;
+    portEXIT_CRITICAL(&lock);
+    BINLOG(EV_PLANNER_FILL, level_um, (int32_t)((cross - epoch_s) / 60));
+    return true;
+}
+
+void planner_get_status(int64_t epoch_s, const app_config_t *cfg, planner_status_t *status) {
+    portENTER_CRITICAL(&lock);
+    bool ok = have_level;
+    int32_t level_um = last_level_um;
+    int64_t level_epoch = last_level_epoch;
+    status->rate_known = learned.hours_measured > 0;
+    status->drop_um_per_h = learned.drop_um_per_h;
+    status->hours_measured = learned.hours_measured;
+    portEXIT_CRITICAL(&lock);
+
+    status->predicted_cross = -1;
+    status->next_fill = -1;
+    if (ok) {
+        predict(epoch_s, level_um, level_epoch, status->rate_known ? status->drop_um_per_h : 0, cfg,
+                &status->predicted_cross, &status->next_fill);
+    }
+}
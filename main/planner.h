@@ -0,0 +1,34 @@
+#ifndef __PLANNER_H__
+#define __PLANNER_H__
+
+#include "config.h"
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    bool rate_known;         // at least one hour without pumping has been measured
+    int32_t drop_um_per_h;   // learned rate the level moves towards the trigger, negative if it is rising
+    uint32_t hours_measured; // hourly drops folded into the rate
+    int64_t predicted_cross; // epoch the level is predicted to reach the trigger, -1 if it is not heading there
+    int64_t next_fill;       // epoch of the planned fill, -1 if none is planned
+} planner_status_t;
+
+/*
+ * Demand driven topups. The evaporation rate is learned from hourly level averages, skipping any hour the pump
+ * ran in, and kept in RTC memory so it survives a reset. A fill is planned for the last allowed window that starts
+ * before the level is predicted to reach the trigger, so water is added as late as possible but never outside the
+ * window. Until a rate has been learned a fill is only started once the trigger level has been reached.
+ */
+esp_err_t planner_init(bool trigger_when_farther);
+
+// Feeds in a good level sample, pump_total_ms is the pump's cumulative on time
+void planner_add_sample(int64_t epoch_s, int32_t level_um, uint32_t pump_total_ms);
+
+// Called every minute in demand mode, returns true once when a fill should start now
+bool planner_should_fill(int64_t epoch_s, const app_config_t *cfg);
+
+void planner_get_status(int64_t epoch_s, const app_config_t *cfg, planner_status_t *status);
+
+#endif // __PLANNER_H__
@@ -0,0 +1,96 @@
+#include "pump_failsafe.h"
+
+#include <driver/gptimer.h>
+#include <esp_attr.h>
+#include <esp_rom_gpio.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <hal/gpio_ll.h>
+#include <soc/gpio_sig_map.h>
+
+#define FAILSAFE_RESOLUTION_HZ 1000000 // 1 us ticks
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t timer_lock; // serialises arming and disarming, which the topup task and HTTP workers both do
+static gptimer_handle_t timer;
+static int pump_pin;
+static bool running; // the gptimer has been started and not stopped since
+static pump_failsafe_state_t state;
+
+// Runs from IRAM so it is not held off while the flash cache is disabled
+static bool IRAM_ATTR failsafe_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *ctx) {
+    gpio_ll_set_level(&GPIO, pump_pin, 0);
+    esp_rom_gpio_connect_out_signal(pump_pin, SIG_GPIO_OUT_IDX, false, false);
+    portENTER_CRITICAL_ISR(&lock);
+    pump_failsafe_on_alarm(&state, esp_timer_get_time());
+    portEXIT_CRITICAL_ISR(&lock);
+    return false;
+}
+
+esp_err_t pump_failsafe_init(int pin) {
+    pump_pin = pin;
+    timer_lock = xSemaphoreCreateMutex();
+    if (!timer_lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    gptimer_config_t config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = FAILSAFE_RESOLUTION_HZ,
+    };
+    esp_err_t err = gptimer_new_timer(&config, &timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+    gptimer_event_callbacks_t callbacks = {.on_alarm = failsafe_alarm};
+    err = gptimer_register_event_callbacks(timer, &callbacks, NULL);
+    if (err == ESP_OK) {
+        err = gptimer_enable(timer);
+    }
+    return err;
+}
+
+bool pump_failsafe_arm(uint32_t limit_ms) {
+    gptimer_alarm_config_t alarm = {.alarm_count = (uint64_t)limit_ms * (FAILSAFE_RESOLUTION_HZ / 1000)};
+    xSemaphoreTake(timer_lock, portMAX_DELAY);
+    // Stopped first, so a countdown that runs out meanwhile still counts as a trip
+    if (running) {
+        gptimer_stop(timer);
+    }
+    gptimer_set_raw_count(timer, 0);
+    gptimer_set_alarm_action(timer, &alarm);
+
+    portENTER_CRITICAL(&lock);
+    bool was_detached = pump_failsafe_on_arm(&state, limit_ms);
+    portEXIT_CRITICAL(&lock);
+
+    running = gptimer_start(timer) == ESP_OK;
+    xSemaphoreGive(timer_lock);
+    return was_detached;
+}
+
+void pump_failsafe_disarm(void) {
+    xSemaphoreTake(timer_lock, portMAX_DELAY);
+    if (running) {
+        gptimer_stop(timer);
+        running = false;
+    }
+    portENTER_CRITICAL(&lock);
+    pump_failsafe_on_disarm(&state);
+    portEXIT_CRITICAL(&lock);
+    xSemaphoreGive(timer_lock);
+}
+
+bool pump_failsafe_tripped(void) {
+    portENTER_CRITICAL(&lock);
+    bool tripped = state.status.tripped;
+    portEXIT_CRITICAL(&lock);
+    return tripped;
+}
+
+void pump_failsafe_get_status(pump_failsafe_status_t *out) {
+    portENTER_CRITICAL(&lock);
+    *out = state.status;
+    portEXIT_CRITICAL(&lock);
+}
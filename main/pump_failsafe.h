@@ -0,0 +1,27 @@
+#ifndef __PUMP_FAILSAFE_H__
+#define __PUMP_FAILSAFE_H__
+
+#include "pump_failsafe_logic.h"
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Hard limit on how long the pump can stay on. Every on transition arms a one-shot hardware timer, and if it is not
+ * disarmed in time its interrupt routes the pump pin back to its plain GPIO output, held low. That cuts off the PWM
+ * signal whatever the tasks are doing, even during flash writes.
+ */
+esp_err_t pump_failsafe_init(int pin);
+
+// Starts or restarts the countdown. Returns true if the failsafe has tripped since the last arm, the pin then has to be
+// handed back to the PWM peripheral before the pump can run again.
+bool pump_failsafe_arm(uint32_t limit_ms);
+void pump_failsafe_disarm(void);
+
+// Whether the failsafe has turned off a pump that is still meant to be on
+bool pump_failsafe_tripped(void);
+
+void pump_failsafe_get_status(pump_failsafe_status_t *out);
+
+#endif // __PUMP_FAILSAFE_H__
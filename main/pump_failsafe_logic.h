@@ -0,0 +1,54 @@
+#ifndef __PUMP_FAILSAFE_LOGIC_H__
+#define __PUMP_FAILSAFE_LOGIC_H__
+
+/*
+ * The failsafe's arm, trip and disarm bookkeeping, kept free of ESP-IDF so tools/failsafe_stall.c can drive it from
+ * a timer of its own on a PC while stalling the caller. Callers serialise the calls, the firmware under its portMUX.
+ * Static inline, so the alarm handler's copy is in IRAM along with it.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    bool armed;           // the pump is on and the timer running
+    bool tripped;         // the timer forced the pump off and it has not been switched on or off since
+    uint32_t arms;        // on transitions since boot
+    uint32_t trips;
+    uint32_t last_limit_ms;
+    int64_t last_trip_us; // esp_timer time of the last trip, 0 if never
+} pump_failsafe_status_t;
+
+typedef struct {
+    pump_failsafe_status_t status;
+    bool detached; // the pin is on its GPIO output, not the PWM signal
+} pump_failsafe_state_t;
+
+// An on transition with a fresh countdown. Returns true if the pin has to be handed back to the PWM peripheral.
+static inline bool pump_failsafe_on_arm(pump_failsafe_state_t *state, uint32_t limit_ms) {
+    bool was_detached = state->detached;
+    state->detached = false;
+    state->status.armed = true;
+    state->status.tripped = false;
+    state->status.arms++;
+    state->status.last_limit_ms = limit_ms;
+    return was_detached;
+}
+
+// The countdown ran out and the pin has been cut off from the PWM signal. Only a trip if the pump was still armed.
+static inline void pump_failsafe_on_alarm(pump_failsafe_state_t *state, int64_t now_us) {
+    state->detached = true;
+    if (state->status.armed) {
+        state->status.armed = false;
+        state->status.tripped = true;
+        state->status.trips++;
+        state->status.last_trip_us = now_us;
+    }
+}
+
+static inline void pump_failsafe_on_disarm(pump_failsafe_state_t *state) {
+    state->status.armed = false;
+    state->status.tripped = false;
+}
+
+#endif // __PUMP_FAILSAFE_LOGIC_H__
@@ -0,0 +1,16 @@
+#include "pump_profile.h"
+
+uint8_t pump_profile_duty(const pump_profile_t *profile, uint32_t elapsed_ms, int32_t remaining_um) {
+    uint32_t span = profile->max_duty_pct > profile->min_duty_pct ? profile->max_duty_pct - profile->min_duty_pct : 0;
+    uint32_t duty = profile->max_duty_pct;
+    if (elapsed_ms < profile->soft_start_ms) {
+        duty = profile->min_duty_pct + span * elapsed_ms / profile->soft_start_ms;
+    }
+    if (profile->taper_um > 0 && remaining_um < profile->taper_um) {
+        // Past the target the pump only runs until the readings confirm it, as slowly as it can
+        uint32_t taper = remaining_um > 0 ? profile->min_duty_pct + span * remaining_um / profile->taper_um
+                                          : profile->min_duty_pct;
+        duty = taper < duty ? taper : duty;
+    }
+    return duty;
+}
@@ -0,0 +1,23 @@
+#ifndef __PUMP_PROFILE_H__
+#define __PUMP_PROFILE_H__
+
+/*
+ * The pump's flow over a fill, as a PWM duty. The pump ramps up from min_duty_pct to max_duty_pct after it is switched
+ * on, runs at max_duty_pct while the water is far from the target and slows back down to min_duty_pct over the last
+ * taper_um, so the readings that end the fill arrive while little water is still flowing in.
+ * Kept free of ESP-IDF like topup_logic.c.
+ */
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t max_duty_pct;
+    uint8_t min_duty_pct;   // the slowest the pump still runs reliably
+    uint32_t soft_start_ms; // ramp from min_duty_pct up to max_duty_pct, 0 starts at full flow
+    int32_t taper_um;       // flow falls to min_duty_pct over this last stretch before the target, 0 for none
+} pump_profile_t;
+
+// Duty for a pump that has run elapsed_ms with remaining_um still to go to the target
+uint8_t pump_profile_duty(const pump_profile_t *profile, uint32_t elapsed_ms, int32_t remaining_um);
+
+#endif // __PUMP_PROFILE_H__
@@ -0,0 +1,180 @@
+#include "rollup.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <inttypes.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DUMP_BATCH 16 // buckets copied per lock
+
+// One resolution, stored as columns. Bucket number b (epoch / period_s) lives at index b % len.
+typedef struct {
+    const char *name;
+    uint32_t period_s;
+    uint16_t len;
+    int64_t head; // newest bucket number, -1 before the first sample
+    int32_t *min_um;
+    int32_t *max_um;
+    int64_t *sum_um;
+    uint32_t *count;
+    uint32_t *pump_ms;
+} rollup_series_t;
+
+#define SERIES_STORAGE(prefix, n)       \
+    static int32_t prefix##_min_um[n];  \
+    static int32_t prefix##_max_um[n];  \
+    static int64_t prefix##_sum_um[n];  \
+    static uint32_t prefix##_count[n];  \
+    static uint32_t prefix##_pump_ms[n];
+
+#define SERIES(prefix, label, period, n)                                                            \
+    {.name = label, .period_s = period, .len = n, .head = -1, .min_um = prefix##_min_um,           \
+     .max_um = prefix##_max_um, .sum_um = prefix##_sum_um, .count = prefix##_count, .pump_ms = prefix##_pump_ms}
+
+SERIES_STORAGE(minute, CONFIG_APP_ROLLUP_MINUTES)
+SERIES_STORAGE(hour, CONFIG_APP_ROLLUP_HOURS)
+SERIES_STORAGE(day, CONFIG_APP_ROLLUP_DAYS)
+
+static rollup_series_t series[ROLLUP_RES_COUNT] = {
+    [ROLLUP_MINUTE] = SERIES(minute, "minute", 60, CONFIG_APP_ROLLUP_MINUTES),
+    [ROLLUP_HOUR] = SERIES(hour, "hour", 3600, CONFIG_APP_ROLLUP_HOURS),
+    [ROLLUP_DAY] = SERIES(day, "day", 86400, CONFIG_APP_ROLLUP_DAYS),
+};
+
+static SemaphoreHandle_t lock;
+static uint32_t last_pump_total_ms;
+static bool have_pump_total;
+
+esp_err_t rollup_init(void) {
+    lock = xSemaphoreCreateMutex();
+    return lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static void clear_bucket(rollup_series_t *s, int64_t bucket) {
+    size_t i = bucket % s->len;
+    s->min_um[i] = INT32_MAX;
+    s->max_um[i] = INT32_MIN;
+    s->sum_um[i] = 0;
+    s->count[i] = 0;
+    s->pump_ms[i] = 0;
+}
+
+// O(1) per sample. Only a jump forward clears more than one bucket, and never more than len.
+static void fold(rollup_series_t *s, int64_t epoch_s, int32_t level_um, uint32_t pump_ms) {
+    int64_t bucket = epoch_s / s->period_s;
+    if (s->head < 0 || bucket - s->head >= s->len) {
+        for (int64_t b = bucket - s->len + 1; b <= bucket; b++) {
+            clear_bucket(s, b);
+        }
+        s->head = bucket;
+    }
+    while (s->head < bucket) {
+        clear_bucket(s, ++s->head);
+    }
+    if (bucket < s->head) {
+        bucket = s->head; // the clock stepped back, keep adding to the newest bucket
+    }
+    size_t i = bucket % s->len;
+    s->min_um[i] = level_um < s->min_um[i] ? level_um : s->min_um[i];
+    s->max_um[i] = level_um > s->max_um[i] ? level_um : s->max_um[i];
+    s->sum_um[i] += level_um;
+    s->count[i]++;
+    s->pump_ms[i] += pump_ms;
+}
+
+void rollup_add(int64_t epoch_s, int32_t level_um, uint32_t pump_total_ms) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t pump_ms = have_pump_total ? pump_total_ms - last_pump_total_ms : 0;
+    last_pump_total_ms = pump_total_ms;
+    have_pump_total = true;
+    for (int r = 0; r < ROLLUP_RES_COUNT; r++) {
+        fold(&series[r], epoch_s, level_um, pump_ms);
+    }
+    xSemaphoreGive(lock);
+}
+
+esp_err_t rollup_res_from_name(const char *name, rollup_res_t *res) {
+    for (int r = 0; r < ROLLUP_RES_COUNT; r++) {
+        if (strcmp(name, series[r].name) == 0) {
+            *res = r;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+typedef enum {
+    COLUMN_MIN,
+    COLUMN_MAX,
+    COLUMN_AVG,
+    COLUMN_COUNT,
+    COLUMN_PUMP_S,
+    NUM_COLUMNS,
+} rollup_column_t;
+
+static const char *column_names[NUM_COLUMNS] = {"min", "max", "avg", "count", "pump_s"};
+
+// Formats one value of bucket at index i, with the lock held
+static int format_value(const rollup_series_t *s, rollup_column_t column, size_t i, char *buf, size_t len) {
+    if (s->count[i] == 0 && column != COLUMN_COUNT && column != COLUMN_PUMP_S) {
+        return snprintf(buf, len, "null");
+    }
+    switch (column) {
+    case COLUMN_MIN:
+        return snprintf(buf, len, "%.1f", s->min_um[i] / 1000.0f);
+    case COLUMN_MAX:
+        return snprintf(buf, len, "%.1f", s->max_um[i] / 1000.0f);
+    case COLUMN_AVG:
+        return snprintf(buf, len, "%.1f", (int32_t)(s->sum_um[i] / s->count[i]) / 1000.0f);
+    case COLUMN_COUNT:
+        return snprintf(buf, len, "%" PRIu32, s->count[i]);
+    default:
+        return snprintf(buf, len, "%" PRIu32, (s->pump_ms[i] + 500) / 1000);
+    }
+}
+
+esp_err_t rollup_dump_json(rollup_res_t res, int n, rollup_sink_t sink, void *ctx) {
+    rollup_series_t *s = &series[res];
+    n = n < 1 ? 1 : n > s->len ? s->len : n;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t head = s->head;
+    xSemaphoreGive(lock);
+
+    char buf[DUMP_BATCH * 12 + 64];
+    int64_t first = head - n + 1;
+    int len = snprintf(buf, sizeof(buf), "{\"res\":\"%s\",\"period_s\":%" PRIu32 ",\"start\":%" PRId64, s->name, s->period_s,
+                       head < 0 ? (int64_t)-1 : first * s->period_s);
+    esp_err_t err = sink(ctx, buf, len);
+    for (int c = 0; c < NUM_COLUMNS && err == ESP_OK; c++) {
+        len = snprintf(buf, sizeof(buf), ",\"%s\":[", column_names[c]);
+        err = sink(ctx, buf, len);
+        // The lock is only held while a small batch is formatted, so a slow client never holds up the sampler.
+        // Buckets that were recycled since the dump started are sent as null.
+        for (int64_t b = first; b <= head && err == ESP_OK;) {
+            len = 0;
+            xSemaphoreTake(lock, portMAX_DELAY);
+            for (int k = 0; k < DUMP_BATCH && b <= head; k++, b++) {
+                if (b != first) {
+                    buf[len++] = ',';
+                }
+                if (b < 0 || b <= s->head - s->len) {
+                    len += snprintf(buf + len, sizeof(buf) - len, "null");
+                } else {
+                    len += format_value(s, c, b % s->len, buf + len, sizeof(buf) - len);
+                }
+            }
+            xSemaphoreGive(lock);
+            err = sink(ctx, buf, len);
+        }
+        if (err == ESP_OK) {
+            err = sink(ctx, "]", 1);
+        }
+    }
+    if (err == ESP_OK) {
+        err = sink(ctx, "}", 1);
+    }
+    return err;
+}
@@ -0,0 +1,34 @@
+#ifndef __ROLLUP_H__
+#define __ROLLUP_H__
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    ROLLUP_DAY,
+    ROLLUP_RES_COUNT,
+} rollup_res_t;
+
+typedef esp_err_t (*rollup_sink_t)(void *ctx, const char *data, size_t len);
+
+/*
+ * Fixed size history of the water level. Every sample is folded into the current minute, hour and day bucket,
+ * which keep the min, max, sum and count of the level and how long the pump ran. Buckets are aligned to UTC.
+ * The number of buckets of each resolution is set in the "History" Kconfig menu.
+ */
+esp_err_t rollup_init(void);
+
+// Folds in a level sample. pump_total_ms is the pump's cumulative on time, the difference since the previous
+// sample is added to the bucket.
+void rollup_add(int64_t epoch_s, int32_t level_um, uint32_t pump_total_ms);
+
+// Looks up "minute", "hour" or "day"
+esp_err_t rollup_res_from_name(const char *name, rollup_res_t *res);
+
+// Writes the newest n buckets, oldest first, as JSON columns. Levels are in mm, empty buckets are null.
+esp_err_t rollup_dump_json(rollup_res_t res, int n, rollup_sink_t sink, void *ctx);
+
+#endif // __ROLLUP_H__
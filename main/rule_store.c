@@ -0,0 +1,129 @@
+#include "rule_store.h"
+#include "log_events.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    const char *name; // JSON member
+    const char *key;  // NVS key of the source
+} rule_slot_info_t;
+
+static const rule_slot_info_t slots[RULE_SLOT_COUNT] = {
+    [RULE_TRIGGER] = {"trigger", "rule_trigger"},
+    [RULE_INTERLOCK] = {"interlock", "rule_interlock"},
+};
+
+static const char *TAG = "rules";
+static nvs_handle_t nvs;
+static SemaphoreHandle_t set_lock;                      // serialises updates
+static portMUX_TYPE prog_lock = portMUX_INITIALIZER_UNLOCKED; // guards programs, evaluated from the sampler task
+static char sources[RULE_SLOT_COUNT][RULES_MAX_SOURCE];
+static rules_program_t programs[RULE_SLOT_COUNT];
+
+esp_err_t rule_store_init(nvs_handle_t handle) {
+    nvs = handle;
+    set_lock = xSemaphoreCreateMutex();
+    if (!set_lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < RULE_SLOT_COUNT; i++) {
+        size_t length = sizeof(sources[i]);
+        esp_err_t err = nvs_get_str(nvs, slots[i].key, sources[i], &length);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            continue;
+        }
+        char reason[64];
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Error reading NVS (%s) for %s", esp_err_to_name(err), slots[i].key);
+            sources[i][0] = '\0';
+        } else if (!rules_compile(sources[i], &programs[i], reason, sizeof(reason))) {
+            // Only possible if a firmware update dropped a variable, the rule is left off rather than guessed at
+            ESP_LOGE(TAG, "Saved %s rule no longer compiles (%s), ignoring it", slots[i].name, reason);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t rule_store_patch(const cJSON *patch, char *err, size_t err_len) {
+    const char *src[RULE_SLOT_COUNT] = {0};
+    rules_program_t compiled[RULE_SLOT_COUNT];
+    for (const cJSON *item = patch->child; item; item = item->next) {
+        int i = 0;
+        while (i < RULE_SLOT_COUNT && strcmp(item->string, slots[i].name) != 0) {
+            i++;
+        }
+        if (i == RULE_SLOT_COUNT) {
+            snprintf(err, err_len, "Unknown rule '%s'", item->string);
+            return ESP_ERR_INVALID_ARG;
+        }
+        if (!cJSON_IsString(item)) {
+            snprintf(err, err_len, "'%s' must be a string", item->string);
+            return ESP_ERR_INVALID_ARG;
+        }
+        char reason[64];
+        if (!rules_compile(item->valuestring, &compiled[i], reason, sizeof(reason))) {
+            snprintf(err, err_len, "%s: %s", slots[i].name, reason);
+            return ESP_ERR_INVALID_ARG;
+        }
+        src[i] = item->valuestring;
+    }
+
+    xSemaphoreTake(set_lock, portMAX_DELAY);
+    esp_err_t res = ESP_OK;
+    for (int i = 0; i < RULE_SLOT_COUNT && res == ESP_OK; i++) {
+        if (src[i]) {
+            res = src[i][0] ? nvs_set_str(nvs, slots[i].key, src[i]) : nvs_erase_key(nvs, slots[i].key);
+            res = res == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : res;
+        }
+    }
+    if (res == ESP_OK) {
+        res = nvs_commit(nvs);
+    }
+    if (res != ESP_OK) {
+        xSemaphoreGive(set_lock);
+        snprintf(err, err_len, "Saving failed (%s)", esp_err_to_name(res));
+        return res;
+    }
+    for (int i = 0; i < RULE_SLOT_COUNT; i++) {
+        if (src[i]) {
+            snprintf(sources[i], sizeof(sources[i]), "%s", src[i]);
+            portENTER_CRITICAL(&prog_lock);
+            programs[i] = compiled[i];
+            portEXIT_CRITICAL(&prog_lock);
+            BINLOG(EV_RULE_UPDATED, i, compiled[i].len);
+        }
+    }
+    xSemaphoreGive(set_lock);
+    return ESP_OK;
+}
+
+int32_t rule_store_eval(rule_slot_t slot, const int32_t vars[RULE_VAR_COUNT], int32_t empty_value) {
+    rules_program_t prog;
+    portENTER_CRITICAL(&prog_lock);
+    prog = programs[slot];
+    portEXIT_CRITICAL(&prog_lock);
+    return rules_eval(&prog, vars, empty_value);
+}
+
+cJSON *rule_store_to_json(void) {
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return NULL;
+    }
+    xSemaphoreTake(set_lock, portMAX_DELAY);
+    for (int i = 0; i < RULE_SLOT_COUNT; i++) {
+        cJSON *rule = cJSON_AddObjectToObject(json, slots[i].name);
+        cJSON_AddStringToObject(rule, "source", sources[i]);
+        cJSON_AddNumberToObject(rule, "code_bytes", programs[i].len);
+    }
+    xSemaphoreGive(set_lock);
+    cJSON *vars = cJSON_AddArrayToObject(json, "variables");
+    for (int i = 0; i < RULE_VAR_COUNT; i++) {
+        cJSON_AddItemToArray(vars, cJSON_CreateString(rules_var_name(i)));
+    }
+    return json;
+}
@@ -0,0 +1,31 @@
+#ifndef __RULE_STORE_H__
+#define __RULE_STORE_H__
+
+#include "rules.h"
+
+#include <cJSON.h>
+#include <esp_err.h>
+#include <nvs.h>
+
+typedef enum {
+    RULE_TRIGGER,   // checked on every reading, a topup check starts when it becomes true
+    RULE_INTERLOCK, // a topup only starts, and the pump only keeps running, while it is true
+    RULE_SLOT_COUNT,
+} rule_slot_t;
+
+/*
+ * The user's rules. The source of each is kept in NVS and compiled again at boot, so a firmware update can change
+ * the bytecode freely. An empty rule is never true for the trigger and always true for the interlock.
+ */
+esp_err_t rule_store_init(nvs_handle_t handle);
+
+// Compiles every member of patch ("trigger" and/or "interlock" strings) and only saves them if all compile.
+// A compile error returns ESP_ERR_INVALID_ARG with the rule name and reason in err.
+esp_err_t rule_store_patch(const cJSON *patch, char *err, size_t err_len);
+
+// Evaluates a rule, returning empty_value if it is not set
+int32_t rule_store_eval(rule_slot_t slot, const int32_t vars[RULE_VAR_COUNT], int32_t empty_value);
+
+cJSON *rule_store_to_json(void);
+
+#endif // __RULE_STORE_H__
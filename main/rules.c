@@ -0,0 +1,304 @@
+#include "rules.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_NESTING 8 // bounds the compiler's recursion
+
+// Every opcode is one byte. The pushes are followed by a little endian constant or a variable number.
+enum {
+    OP_PUSH8,
+    OP_PUSH16,
+    OP_PUSH32,
+    OP_LOAD,
+    OP_NEG,
+    OP_NOT,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_ADD,
+    OP_SUB,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+};
+
+#define RULE_VAR_NAME(id, name) name,
+static const char *const var_names[RULE_VAR_COUNT] = {RULE_VARS(RULE_VAR_NAME)};
+#undef RULE_VAR_NAME
+
+typedef struct {
+    const char *src;
+    const char *p;
+    rules_program_t *prog;
+    int depth;    // stack depth the code so far leaves behind
+    int nesting;
+    char *err;
+    size_t err_len;
+    bool failed;
+} compiler_t;
+
+static void fail(compiler_t *c, const char *msg) {
+    if (!c->failed) {
+        snprintf(c->err, c->err_len, "%s at %d", msg, (int)(c->p - c->src));
+        c->failed = true;
+    }
+}
+
+static void skip_space(compiler_t *c) {
+    while (isspace((unsigned char)*c->p)) {
+        c->p++;
+    }
+}
+
+static bool accept(compiler_t *c, const char *token) {
+    skip_space(c);
+    size_t n = strlen(token);
+    if (strncmp(c->p, token, n) != 0) {
+        return false;
+    }
+    // "<" must not match the start of "<="
+    if (n == 1 && strchr("<>!=", token[0]) && c->p[1] == '=') {
+        return false;
+    }
+    c->p += n;
+    return true;
+}
+
+// Appends an op with n bytes of little endian operand. pushed is its effect on the stack depth.
+static void emit(compiler_t *c, uint8_t op, uint32_t operand, int n, int pushed) {
+    if (c->failed) {
+        return;
+    }
+    if (c->prog->len + 1 + n > RULES_MAX_CODE) {
+        fail(c, "rule too long");
+        return;
+    }
+    c->prog->code[c->prog->len++] = op;
+    for (int i = 0; i < n; i++) {
+        c->prog->code[c->prog->len++] = operand >> (8 * i);
+    }
+    c->depth += pushed;
+    if (c->depth > RULES_MAX_STACK) {
+        fail(c, "rule too complex");
+    }
+}
+
+static void emit_const(compiler_t *c, int32_t value) {
+    if (value >= INT8_MIN && value <= INT8_MAX) {
+        emit(c, OP_PUSH8, (uint32_t)value, 1, 1);
+    } else if (value >= INT16_MIN && value <= INT16_MAX) {
+        emit(c, OP_PUSH16, (uint32_t)value, 2, 1);
+    } else {
+        emit(c, OP_PUSH32, (uint32_t)value, 4, 1);
+    }
+}
+
+static void parse_or(compiler_t *c);
+
+static void parse_primary(compiler_t *c) {
+    skip_space(c);
+    if (isdigit((unsigned char)*c->p)) {
+        int64_t value = 0;
+        while (isdigit((unsigned char)*c->p)) {
+            value = value * 10 + (*c->p++ - '0');
+            if (value > INT32_MAX) {
+                fail(c, "number too large");
+                return;
+            }
+        }
+        emit_const(c, (int32_t)value);
+    } else if (isalpha((unsigned char)*c->p) || *c->p == '_') {
+        const char *start = c->p;
+        while (isalnum((unsigned char)*c->p) || *c->p == '_') {
+            c->p++;
+        }
+        size_t n = c->p - start;
+        for (int i = 0; i < RULE_VAR_COUNT; i++) {
+            if (strlen(var_names[i]) == n && strncmp(var_names[i], start, n) == 0) {
+                emit(c, OP_LOAD, i, 1, 1);
+                return;
+            }
+        }
+        c->p = start;
+        fail(c, "unknown variable");
+    } else if (accept(c, "(")) {
+        if (++c->nesting > MAX_NESTING) {
+            fail(c, "too deeply nested");
+            return;
+        }
+        parse_or(c);
+        c->nesting--;
+        if (!accept(c, ")")) {
+            fail(c, "expected ')'");
+        }
+    } else {
+        fail(c, "expected a number, variable or '('");
+    }
+}
+
+static void parse_unary(compiler_t *c) {
+    if (accept(c, "!")) {
+        parse_unary(c);
+        emit(c, OP_NOT, 0, 0, 0);
+    } else if (accept(c, "-")) {
+        parse_unary(c);
+        emit(c, OP_NEG, 0, 0, 0);
+    } else {
+        parse_primary(c);
+    }
+}
+
+// One level of left associative binary operators, ops[i] compiles to codes[i]
+static void parse_binary(compiler_t *c, void (*operand)(compiler_t *), const char *const *ops, const uint8_t *codes,
+                         int num_ops) {
+    operand(c);
+    while (!c->failed) {
+        int i = 0;
+        while (i < num_ops && !accept(c, ops[i])) {
+            i++;
+        }
+        if (i == num_ops) {
+            return;
+        }
+        operand(c);
+        emit(c, codes[i], 0, 0, -1);
+    }
+}
+
+static void parse_mul(compiler_t *c) {
+    static const char *const ops[] = {"*", "/", "%"};
+    static const uint8_t codes[] = {OP_MUL, OP_DIV, OP_MOD};
+    parse_binary(c, parse_unary, ops, codes, 3);
+}
+
+static void parse_add(compiler_t *c) {
+    static const char *const ops[] = {"+", "-"};
+    static const uint8_t codes[] = {OP_ADD, OP_SUB};
+    parse_binary(c, parse_mul, ops, codes, 2);
+}
+
+static void parse_compare(compiler_t *c) {
+    static const char *const ops[] = {"<=", ">=", "==", "!=", "<", ">"};
+    static const uint8_t codes[] = {OP_LE, OP_GE, OP_EQ, OP_NE, OP_LT, OP_GT};
+    parse_binary(c, parse_add, ops, codes, 6);
+}
+
+static void parse_and(compiler_t *c) {
+    static const char *const ops[] = {"&&"};
+    static const uint8_t codes[] = {OP_AND};
+    parse_binary(c, parse_compare, ops, codes, 1);
+}
+
+static void parse_or(compiler_t *c) {
+    static const char *const ops[] = {"||"};
+    static const uint8_t codes[] = {OP_OR};
+    parse_binary(c, parse_and, ops, codes, 1);
+}
+
+bool rules_compile(const char *src, rules_program_t *prog, char *err, size_t err_len) {
+    compiler_t c = {.src = src, .p = src, .prog = prog, .err = err, .err_len = err_len};
+    prog->len = 0;
+    skip_space(&c);
+    if (*c.p == '\0') {
+        return true;
+    }
+    if (strlen(src) >= RULES_MAX_SOURCE) {
+        fail(&c, "rule too long");
+    }
+    parse_or(&c);
+    skip_space(&c);
+    if (*c.p != '\0') {
+        fail(&c, "unexpected text");
+    }
+    if (c.failed) {
+        prog->len = 0;
+    }
+    return !c.failed;
+}
+
+// Arithmetic wraps rather than overflowing
+static int32_t apply(uint8_t op, int32_t a, int32_t b) {
+    switch (op) {
+    case OP_MUL:
+        return (int32_t)((uint32_t)a * (uint32_t)b);
+    case OP_DIV:
+        return b == 0 || (a == INT32_MIN && b == -1) ? 0 : a / b;
+    case OP_MOD:
+        return b == 0 || (a == INT32_MIN && b == -1) ? 0 : a % b;
+    case OP_ADD:
+        return (int32_t)((uint32_t)a + (uint32_t)b);
+    case OP_SUB:
+        return (int32_t)((uint32_t)a - (uint32_t)b);
+    case OP_LT:
+        return a < b;
+    case OP_LE:
+        return a <= b;
+    case OP_GT:
+        return a > b;
+    case OP_GE:
+        return a >= b;
+    case OP_EQ:
+        return a == b;
+    case OP_NE:
+        return a != b;
+    case OP_AND:
+        return a && b;
+    default:
+        return a || b;
+    }
+}
+
+int32_t rules_eval(const rules_program_t *prog, const int32_t vars[RULE_VAR_COUNT], int32_t empty_value) {
+    if (prog->len == 0) {
+        return empty_value;
+    }
+    // The compiler checked the depth and operands, the bounds checks only guard against a corrupted program
+    int32_t stack[RULES_MAX_STACK];
+    int sp = 0;
+    const uint8_t *pc = prog->code;
+    const uint8_t *end = pc + prog->len;
+    while (pc < end) {
+        uint8_t op = *pc++;
+        if (op <= OP_LOAD) {
+            static const uint8_t operand_len[] = {[OP_PUSH8] = 1, [OP_PUSH16] = 2, [OP_PUSH32] = 4, [OP_LOAD] = 1};
+            if (sp == RULES_MAX_STACK || end - pc < operand_len[op]) {
+                return empty_value;
+            }
+            if (op == OP_PUSH8) {
+                stack[sp++] = (int8_t)pc[0];
+            } else if (op == OP_PUSH16) {
+                stack[sp++] = (int16_t)(pc[0] | pc[1] << 8);
+            } else if (op == OP_PUSH32) {
+                stack[sp++] = (int32_t)(pc[0] | pc[1] << 8 | pc[2] << 16 | (uint32_t)pc[3] << 24);
+            } else {
+                stack[sp++] = pc[0] < RULE_VAR_COUNT ? vars[pc[0]] : 0;
+            }
+            pc += operand_len[op];
+        } else if (op == OP_NEG || op == OP_NOT) {
+            if (sp < 1) {
+                return empty_value;
+            }
+            stack[sp - 1] = op == OP_NOT ? !stack[sp - 1] : (int32_t)(0u - (uint32_t)stack[sp - 1]);
+        } else if (op <= OP_OR) {
+            if (sp < 2) {
+                return empty_value;
+            }
+            sp--;
+            stack[sp - 1] = apply(op, stack[sp - 1], stack[sp]);
+        } else {
+            return empty_value;
+        }
+    }
+    return sp == 1 ? stack[0] : empty_value;
+}
+
+const char *rules_var_name(rule_var_t var) {
+    return var < RULE_VAR_COUNT ? var_names[var] : "?";
+}
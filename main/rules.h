@@ -0,0 +1,55 @@
+#ifndef __RULES_H__
+#define __RULES_H__
+
+/*
+ * A tiny expression language for site specific topup conditions, e.g.
+ *
+ *     (hour >= 6 && hour < 22) && timeouts_24h < 2
+ *
+ * Integers only, with + - * / %, comparisons, && || ! and parentheses. Variables are listed in RULE_VARS.
+ * A rule is compiled once into a few bytes of stack machine code. The code has no jumps, so rules_eval executes each
+ * instruction once, at most RULES_MAX_CODE of them, on a stack of at most RULES_MAX_STACK (8) values and without
+ * allocating. Kept free of ESP-IDF so it builds on the linux target and on a PC, see tools/rules_eval.c.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RULES_MAX_SOURCE 128 // including the terminator
+#define RULES_MAX_CODE 64
+#define RULES_MAX_STACK 8
+
+// Variables a rule can read: X(id, name)
+#define RULE_VARS(X)                                                                                       \
+    X(RULE_VAR_LEVEL, "level")                   /* last reading, mm from the sensor */                     \
+    X(RULE_VAR_TRIGGER, "trigger")               /* trigger level, mm */                                    \
+    X(RULE_VAR_HOUR, "hour")                     /* local time, -1 until the clock is set */                \
+    X(RULE_VAR_MINUTE, "minute")                                                                            \
+    X(RULE_VAR_WEEKDAY, "weekday")               /* 0 is Monday */                                          \
+    X(RULE_VAR_PUMP, "pump")                     /* 1 while the pump is on */                               \
+    X(RULE_VAR_TIMEOUTS_24H, "timeouts_24h")     /* topups that hit the pump time limit */                  \
+    X(RULE_VAR_SENSOR_FAILS_24H, "sensor_fails_24h")                                                        \
+    X(RULE_VAR_SINCE_TOPUP_MIN, "since_topup_min") /* minutes since the last topup ended, -1 if none */
+
+#define RULE_VAR_ENUM(id, name) id,
+typedef enum {
+    RULE_VARS(RULE_VAR_ENUM)
+    RULE_VAR_COUNT,
+} rule_var_t;
+#undef RULE_VAR_ENUM
+
+typedef struct {
+    uint8_t len; // 0 for an empty rule
+    uint8_t code[RULES_MAX_CODE];
+} rules_program_t;
+
+// Compiles src into prog. On failure returns false with a message and the offending offset in err.
+bool rules_compile(const char *src, rules_program_t *prog, char *err, size_t err_len);
+
+// Runs a compiled rule. Division by zero gives 0. An empty rule gives empty_value.
+int32_t rules_eval(const rules_program_t *prog, const int32_t vars[RULE_VAR_COUNT], int32_t empty_value);
+
+const char *rules_var_name(rule_var_t var);
+
+#endif // __RULES_H__
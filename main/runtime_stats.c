@@ -0,0 +1,193 @@
+#include "runtime_stats.h"
+#include "log_events.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !CONFIG_FREERTOS_USE_TRACE_FACILITY
+#error "runtime stats need CONFIG_FREERTOS_USE_TRACE_FACILITY, see sdkconfig.defaults"
+#endif
+
+#define SPARE_TASKS 4 // room for tasks created between counting them and taking the snapshot
+
+typedef struct {
+    TaskHandle_t handle;
+    configRUN_TIME_COUNTER_TYPE counter;
+} task_counter_t;
+
+static const char *TAG = "runtime";
+static SemaphoreHandle_t lock;
+// Grown to fit every task, all guarded by lock
+static TaskStatus_t *tasks;
+static task_counter_t *previous;
+static task_counter_t *current;
+static uint16_t *permille;
+static UBaseType_t capacity;
+static UBaseType_t num_previous;
+static configRUN_TIME_COUNTER_TYPE previous_total;
+static int64_t previous_at;
+
+static configRUN_TIME_COUNTER_TYPE previous_counter(TaskHandle_t handle) {
+    for (UBaseType_t i = 0; i < num_previous; i++) {
+        if (previous[i].handle == handle) {
+            return previous[i].counter;
+        }
+    }
+    return 0; // started since the last snapshot
+}
+
+static const char *state_name(eTaskState state) {
+    switch (state) {
+    case eRunning:
+        return "running";
+    case eReady:
+        return "ready";
+    case eBlocked:
+        return "blocked";
+    case eSuspended:
+        return "suspended";
+    default:
+        return "deleted";
+    }
+}
+
+static bool reserve(UBaseType_t needed) {
+    if (needed <= capacity) {
+        return true;
+    }
+    // Each array is kept on failure, previous still holds the last snapshot's counters
+    TaskStatus_t *new_tasks = realloc(tasks, needed * sizeof(TaskStatus_t));
+    tasks = new_tasks ? new_tasks : tasks;
+    task_counter_t *new_previous = realloc(previous, needed * sizeof(task_counter_t));
+    previous = new_previous ? new_previous : previous;
+    task_counter_t *new_current = realloc(current, needed * sizeof(task_counter_t));
+    current = new_current ? new_current : current;
+    uint16_t *new_permille = realloc(permille, needed * sizeof(uint16_t));
+    permille = new_permille ? new_permille : permille;
+    if (!new_tasks || !new_previous || !new_current || !new_permille) {
+        return false;
+    }
+    capacity = needed;
+    return true;
+}
+
+/*
+ * Fills tasks and writes the CPU share of each since the previous snapshot into permille. Returns 0 if the arrays
+ * could not be grown to fit every task. Counters are differenced in their own unsigned type, so they may wrap
+ * between snapshots.
+ */
+static UBaseType_t snapshot(int64_t *interval_us) {
+    if (!reserve(uxTaskGetNumberOfTasks() + SPARE_TASKS)) {
+        return 0;
+    }
+    configRUN_TIME_COUNTER_TYPE total;
+    UBaseType_t count = uxTaskGetSystemState(tasks, capacity, &total);
+    if (count == 0) {
+        return 0; // more tasks were started than there are spare slots, the next snapshot makes room
+    }
+    configRUN_TIME_COUNTER_TYPE elapsed = total - previous_total;
+    for (UBaseType_t i = 0; i < count; i++) {
+        configRUN_TIME_COUNTER_TYPE used = tasks[i].ulRunTimeCounter - previous_counter(tasks[i].xHandle);
+        permille[i] = elapsed ? (uint64_t)used * 1000 / elapsed : 0;
+        current[i].handle = tasks[i].xHandle;
+        current[i].counter = tasks[i].ulRunTimeCounter;
+    }
+    memcpy(previous, current, count * sizeof(task_counter_t));
+    num_previous = count;
+    previous_total = total;
+    int64_t now = esp_timer_get_time();
+    *interval_us = now - previous_at;
+    previous_at = now;
+    return count;
+}
+
+static void snapshot_callback(void *arg) {
+    int64_t interval_us;
+    // Runs on the esp_timer task, which must not wait for a /debug/runtime request. Skipping one snapshot only
+    // makes the next interval longer.
+    if (xSemaphoreTake(lock, 0) == pdTRUE) {
+        UBaseType_t count = snapshot(&interval_us);
+        for (UBaseType_t i = 0; i < count; i++) {
+            if (tasks[i].usStackHighWaterMark < CONFIG_APP_RUNTIME_STACK_WARN_BYTES) {
+                ESP_LOGW(TAG, "Task %s has %lu bytes of stack left", tasks[i].pcTaskName,
+                         (unsigned long)tasks[i].usStackHighWaterMark);
+                // The binary log only holds numbers, the task number matches "number" in /debug/runtime
+                BINLOG(EV_RUNTIME_STACK_LOW, tasks[i].xTaskNumber, tasks[i].usStackHighWaterMark, permille[i]);
+            }
+        }
+        xSemaphoreGive(lock);
+    }
+
+    multi_heap_info_t heap;
+    heap_caps_get_info(&heap, MALLOC_CAP_8BIT);
+    BINLOG(EV_RUNTIME_HEAP, heap.total_free_bytes, heap.minimum_free_bytes, heap.largest_free_block, heap.allocated_blocks);
+}
+
+esp_err_t runtime_stats_init(void) {
+    lock = xSemaphoreCreateMutex();
+    if (!lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (CONFIG_APP_RUNTIME_SNAPSHOT_INTERVAL_S == 0) {
+        return ESP_OK;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = &snapshot_callback,
+        .name = "runtime_stats"};
+    esp_timer_handle_t timer;
+    esp_err_t err = esp_timer_create(&timer_args, &timer);
+    if (err == ESP_OK) {
+        err = esp_timer_start_periodic(timer, (uint64_t)CONFIG_APP_RUNTIME_SNAPSHOT_INTERVAL_S * 1000000);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start snapshot timer (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+
+cJSON *runtime_stats_to_json(void) {
+    int64_t interval_us;
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return NULL;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    UBaseType_t count = snapshot(&interval_us);
+
+    cJSON_AddNumberToObject(json, "uptime_s", esp_timer_get_time() / 1000000);
+    cJSON_AddNumberToObject(json, "interval_ms", interval_us / 1000); // the CPU shares cover this period
+    cJSON *tasks_json = cJSON_AddArrayToObject(json, "tasks");
+    for (UBaseType_t i = 0; i < count; i++) {
+        cJSON *task = cJSON_CreateObject();
+        cJSON_AddStringToObject(task, "name", tasks[i].pcTaskName);
+        cJSON_AddNumberToObject(task, "number", tasks[i].xTaskNumber);
+        cJSON_AddNumberToObject(task, "priority", tasks[i].uxCurrentPriority);
+        cJSON_AddStringToObject(task, "state", state_name(tasks[i].eCurrentState));
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        cJSON_AddNumberToObject(task, "cpu_pct", permille[i] / 10.0);
+#endif
+        cJSON_AddNumberToObject(task, "stack_free", tasks[i].usStackHighWaterMark); // bytes, lowest since the task started
+        cJSON_AddItemToArray(tasks_json, task);
+    }
+    xSemaphoreGive(lock);
+
+    multi_heap_info_t heap;
+    heap_caps_get_info(&heap, MALLOC_CAP_8BIT);
+    cJSON *heap_json = cJSON_AddObjectToObject(json, "heap");
+    cJSON_AddNumberToObject(heap_json, "free", heap.total_free_bytes);
+    cJSON_AddNumberToObject(heap_json, "min_free", heap.minimum_free_bytes);
+    cJSON_AddNumberToObject(heap_json, "largest_free_block", heap.largest_free_block);
+    // How much of the free memory is unusable for one large allocation
+    cJSON_AddNumberToObject(heap_json, "fragmentation_pct",
+                            heap.total_free_bytes ? 100 - heap.largest_free_block * 100 / heap.total_free_bytes : 0);
+    cJSON_AddNumberToObject(heap_json, "allocated_blocks", heap.allocated_blocks);
+    cJSON_AddNumberToObject(heap_json, "free_blocks", heap.free_blocks);
+    return json;
+}
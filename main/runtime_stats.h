@@ -0,0 +1,16 @@
+#ifndef __RUNTIME_STATS_H__
+#define __RUNTIME_STATS_H__
+
+#include <cJSON.h>
+#include <esp_err.h>
+
+/*
+ * Starts the periodic snapshot, every CONFIG_APP_RUNTIME_SNAPSHOT_INTERVAL_S. Each snapshot records heap use and
+ * any task short of stack in the binary log, so slow leaks and stack growth are visible in /logs afterwards.
+ */
+esp_err_t runtime_stats_init(void);
+
+// Takes a snapshot now: CPU share of every task since the previous snapshot, stack headroom and heap state
+cJSON *runtime_stats_to_json(void);
+
+#endif // __RUNTIME_STATS_H__
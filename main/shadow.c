@@ -0,0 +1,350 @@
+#include "shadow.h"
+#include "log_events.h"
+#include "time_service.h"
+
+#include <distance_sensor.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define NVS_KEY_SHADOW "shadow"
+
+#if CONFIG_DISTANCE_SENSOR_FILTER_MEDIAN
+#define DEFAULT_FILTER DISTANCE_FILTER_MEDIAN
+#else
+#define DEFAULT_FILTER DISTANCE_FILTER_MEAN
+#endif
+
+// The pump run being watched
+typedef struct {
+    bool active;
+    bool shadow_running;  // the shadow started this fill and has not stopped it yet
+    topup_params_t params; // active parameters of the fill
+    uint32_t max_ms;
+    int64_t start_us;
+    int32_t start_level_um;
+    uint32_t samples;
+    uint8_t num_below;     // shadow readings in a row past its trigger level
+    shadow_fill_t result;
+} shadow_run_t;
+
+static const char *TAG = "shadow";
+static nvs_handle_t nvs;
+static bool farther;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED; // guards everything below, used from the sampler task
+static shadow_params_t params = {
+    .num_pings = CONFIG_DISTANCE_SENSOR_NUM_AVERAGE,
+    .filter = DEFAULT_FILTER,
+    .num_below_trigger = 3,
+    .trigger_level_um = 3 * DISTANCE_UM_PER_CM,
+};
+static shadow_status_t status;
+static int32_t active_level_um; // active reading of the last sample
+static bool have_level;         // status.level_um is valid
+static bool shadow_needed;      // the shadow's answer to the last topup check
+static shadow_run_t run;
+
+// How far level is past trigger towards full, negative while short of it
+static int32_t past_trigger(int32_t trigger_um, int32_t level_um) {
+    return farther ? trigger_um - level_um : level_um - trigger_um;
+}
+
+esp_err_t shadow_init(nvs_handle_t handle, bool trigger_when_farther) {
+    nvs = handle;
+    farther = trigger_when_farther;
+    shadow_params_t stored;
+    size_t length = sizeof(stored);
+    esp_err_t err = nvs_get_blob(nvs, NVS_KEY_SHADOW, &stored, &length);
+    if (err == ESP_OK && length == sizeof(stored)) {
+        params = stored;
+    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "Ignoring saved shadow parameters (%s)", esp_err_to_name(err));
+    }
+    return ESP_OK;
+}
+
+void shadow_add_sample(int32_t level_um, const int32_t *pings_um, int num_pings) {
+    int64_t started = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    shadow_params_t p = params;
+    portEXIT_CRITICAL(&lock);
+    if (!p.enabled) {
+        return;
+    }
+
+    int32_t samples[DISTANCE_MAX_PINGS];
+    int n = p.num_pings < num_pings ? p.num_pings : num_pings;
+    memcpy(samples, pings_um, n * sizeof(int32_t));
+    int32_t shadow_um = distance_filter_um(p.filter, samples, n);
+    topup_params_t shadow = {
+        .trigger_level_um = p.trigger_level_um,
+        .num_below_trigger = p.num_below_trigger,
+    };
+
+    portENTER_CRITICAL(&lock);
+    status.samples++;
+    status.level_um = shadow_um;
+    active_level_um = level_um;
+    have_level = true;
+    int32_t stop_ms = -1;
+    if (run.active) {
+        run.samples++;
+        uint32_t elapsed_ms = (started - run.start_us) / 1000;
+        if (run.shadow_running && topup_reached(&shadow, &run.num_below, shadow_um)) {
+            stop_ms = elapsed_ms;
+        } else if (run.shadow_running && elapsed_ms >= run.max_ms) {
+            stop_ms = elapsed_ms;
+            run.result.shadow_timeout = true;
+        }
+        if (stop_ms >= 0) {
+            // The active reading is the better estimate of the real level
+            run.shadow_running = false;
+            run.result.shadow_ms = stop_ms;
+            run.result.shadow_overshoot_um = past_trigger(p.trigger_level_um, level_um);
+        }
+    }
+    uint32_t eval_us = esp_timer_get_time() - started;
+    if (eval_us > status.eval_max_us) {
+        status.eval_max_us = eval_us;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (stop_ms >= 0) {
+        BINLOG(EV_SHADOW_STOP, stop_ms, shadow_um);
+    }
+}
+
+void shadow_decide(bool active_needed) {
+    portENTER_CRITICAL(&lock);
+    if (!params.enabled || !have_level) {
+        shadow_needed = false;
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    topup_params_t shadow = {
+        .trigger_level_um = params.trigger_level_um,
+        .num_below_trigger = params.num_below_trigger,
+    };
+    shadow_needed = topup_needed(&shadow, status.level_um);
+    status.decisions++;
+    if (shadow_needed == active_needed) {
+        status.agreed++;
+    } else if (shadow_needed) {
+        status.shadow_only++;
+    } else {
+        status.active_only++;
+    }
+    int32_t level_um = status.level_um;
+    bool needed = shadow_needed;
+    portEXIT_CRITICAL(&lock);
+    BINLOG(EV_SHADOW_DECISION, active_needed, needed, level_um);
+}
+
+void shadow_fill_start(const topup_params_t *active, uint32_t max_topup_time_ms) {
+    time_t now = time(NULL);
+    portENTER_CRITICAL(&lock);
+    if (!params.enabled || !have_level) {
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    run = (shadow_run_t){
+        .active = true,
+        .shadow_running = shadow_needed,
+        .params = *active,
+        .max_ms = max_topup_time_ms,
+        .start_us = esp_timer_get_time(),
+        .start_level_um = active_level_um,
+        .result = {
+            .start_time = time_service_is_valid() ? now : 0,
+            .shadow_needed = shadow_needed,
+        },
+    };
+    portEXIT_CRITICAL(&lock);
+}
+
+// The pump stopped before the shadow would have. Assumes the level keeps rising at the rate seen so far.
+static void predict_stop(shadow_fill_t *fill, uint32_t active_ms, int32_t end_level_um) {
+    int64_t progress_um = past_trigger(run.start_level_um, end_level_um);
+    int64_t interval_ms = run.samples ? active_ms / run.samples : active_ms;
+    int64_t short_um = -past_trigger(params.trigger_level_um, end_level_um);
+    int64_t extra_ms;
+    fill->predicted = true;
+    if (progress_um <= 0 || active_ms == 0) {
+        fill->shadow_timeout = true;
+        fill->shadow_ms = run.max_ms;
+        fill->shadow_overshoot_um = -short_um;
+        return;
+    }
+    if (short_um > 0) {
+        // Reaches the trigger level, then needs the rest of its readings in a row
+        extra_ms = short_um * active_ms / progress_um + (params.num_below_trigger - 1) * interval_ms;
+    } else {
+        extra_ms = (params.num_below_trigger - run.num_below) * interval_ms;
+    }
+    if (active_ms + extra_ms > run.max_ms) {
+        extra_ms = run.max_ms > active_ms ? run.max_ms - active_ms : 0;
+        fill->shadow_timeout = true;
+    }
+    fill->shadow_ms = active_ms + extra_ms;
+    fill->shadow_overshoot_um = -short_um + extra_ms * progress_um / active_ms;
+}
+
+void shadow_fill_end(void) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    if (!run.active) {
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    shadow_fill_t fill = run.result;
+    fill.active_ms = (now - run.start_us) / 1000;
+    fill.active_overshoot_um = past_trigger(run.params.trigger_level_um, active_level_um);
+    if (run.shadow_running) {
+        predict_stop(&fill, fill.active_ms, active_level_um);
+    }
+    status.history[status.fills % SHADOW_HISTORY_LEN] = fill;
+    status.fills++;
+    run.active = false;
+    portEXIT_CRITICAL(&lock);
+    BINLOG(EV_SHADOW_FILL, fill.active_ms, fill.shadow_ms, fill.shadow_overshoot_um, fill.predicted);
+}
+
+static bool read_u8(const cJSON *item, int min, int max, uint8_t *out, char *err, size_t err_len) {
+    if (!cJSON_IsNumber(item) || item->valuedouble != (int)item->valuedouble || item->valueint < min || item->valueint > max) {
+        snprintf(err, err_len, "'%s' must be a whole number from %d to %d", item->string, min, max);
+        return false;
+    }
+    *out = item->valueint;
+    return true;
+}
+
+esp_err_t shadow_patch(const cJSON *patch, char *err, size_t err_len) {
+    portENTER_CRITICAL(&lock);
+    shadow_params_t next = params;
+    portEXIT_CRITICAL(&lock);
+
+    for (const cJSON *item = patch->child; item; item = item->next) {
+        if (strcmp(item->string, "enabled") == 0) {
+            if (!cJSON_IsBool(item)) {
+                snprintf(err, err_len, "'enabled' must be true or false");
+                return ESP_ERR_INVALID_ARG;
+            }
+            next.enabled = cJSON_IsTrue(item);
+        } else if (strcmp(item->string, "trigger_level") == 0) {
+            if (!cJSON_IsNumber(item) || item->valuedouble < 0.5 || item->valuedouble > 400) {
+                snprintf(err, err_len, "'trigger_level' must be from 0.5 to 400 cm");
+                return ESP_ERR_INVALID_ARG;
+            }
+            next.trigger_level_um = (int32_t)(item->valuedouble * DISTANCE_UM_PER_CM + 0.5);
+        } else if (strcmp(item->string, "num_below_trigger") == 0) {
+            if (!read_u8(item, 1, 50, &next.num_below_trigger, err, err_len)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        } else if (strcmp(item->string, "num_pings") == 0) {
+            // Only pings the active reading took are available
+            if (!read_u8(item, 1, CONFIG_DISTANCE_SENSOR_NUM_AVERAGE, &next.num_pings, err, err_len)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        } else if (strcmp(item->string, "filter") == 0) {
+            if (!cJSON_IsString(item) || (strcmp(item->valuestring, "mean") != 0 && strcmp(item->valuestring, "median") != 0)) {
+                snprintf(err, err_len, "'filter' must be \"mean\" or \"median\"");
+                return ESP_ERR_INVALID_ARG;
+            }
+            next.filter = strcmp(item->valuestring, "median") == 0 ? DISTANCE_FILTER_MEDIAN : DISTANCE_FILTER_MEAN;
+        } else {
+            snprintf(err, err_len, "Unknown member '%s'", item->string);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    esp_err_t res = nvs_set_blob(nvs, NVS_KEY_SHADOW, &next, sizeof(next));
+    if (res == ESP_OK) {
+        res = nvs_commit(nvs);
+    }
+    if (res != ESP_OK) {
+        snprintf(err, err_len, "Saving failed (%s)", esp_err_to_name(res));
+        return res;
+    }
+    // Comparisons made with the old parameters would be misleading
+    portENTER_CRITICAL(&lock);
+    params = next;
+    memset(&status, 0, sizeof(status));
+    have_level = false;
+    run.active = false;
+    portEXIT_CRITICAL(&lock);
+    return ESP_OK;
+}
+
+void shadow_get_status(shadow_params_t *params_out, shadow_status_t *status_out) {
+    portENTER_CRITICAL(&lock);
+    *params_out = params;
+    *status_out = status;
+    portEXIT_CRITICAL(&lock);
+}
+
+cJSON *shadow_to_json(void) {
+    shadow_params_t p;
+    shadow_status_t s;
+    shadow_get_status(&p, &s);
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON *params_json = cJSON_AddObjectToObject(json, "params");
+    cJSON_AddBoolToObject(params_json, "enabled", p.enabled);
+    cJSON_AddNumberToObject(params_json, "trigger_level", (double)p.trigger_level_um / DISTANCE_UM_PER_CM);
+    cJSON_AddNumberToObject(params_json, "num_below_trigger", p.num_below_trigger);
+    cJSON_AddNumberToObject(params_json, "num_pings", p.num_pings);
+    cJSON_AddStringToObject(params_json, "filter", p.filter == DISTANCE_FILTER_MEDIAN ? "median" : "mean");
+
+    cJSON_AddNumberToObject(json, "samples", s.samples);
+    if (s.samples) {
+        cJSON_AddNumberToObject(json, "level", (double)s.level_um / DISTANCE_UM_PER_CM);
+    } else {
+        cJSON_AddNullToObject(json, "level");
+    }
+    cJSON_AddNumberToObject(json, "eval_max_us", s.eval_max_us);
+    cJSON *decisions_json = cJSON_AddObjectToObject(json, "decisions");
+    cJSON_AddNumberToObject(decisions_json, "total", s.decisions);
+    cJSON_AddNumberToObject(decisions_json, "agreed", s.agreed);
+    cJSON_AddNumberToObject(decisions_json, "shadow_only", s.shadow_only);
+    cJSON_AddNumberToObject(decisions_json, "active_only", s.active_only);
+
+    // Newest first, with averages over the fills both sets of parameters would have run
+    cJSON *fills_json = cJSON_AddArrayToObject(json, "fills");
+    uint32_t kept = s.fills < SHADOW_HISTORY_LEN ? s.fills : SHADOW_HISTORY_LEN;
+    int64_t active_ms = 0, shadow_ms = 0, active_over = 0, shadow_over = 0;
+    uint32_t both = 0;
+    for (uint32_t i = 0; i < kept; i++) {
+        const shadow_fill_t *fill = &s.history[(s.fills - 1 - i) % SHADOW_HISTORY_LEN];
+        cJSON *fill_json = cJSON_CreateObject();
+        cJSON_AddNumberToObject(fill_json, "start_time", fill->start_time);
+        cJSON_AddBoolToObject(fill_json, "shadow_needed", fill->shadow_needed);
+        cJSON_AddNumberToObject(fill_json, "active_ms", fill->active_ms);
+        cJSON_AddNumberToObject(fill_json, "active_overshoot", (double)fill->active_overshoot_um / DISTANCE_UM_PER_CM);
+        if (fill->shadow_needed) {
+            cJSON_AddNumberToObject(fill_json, "shadow_ms", fill->shadow_ms);
+            cJSON_AddNumberToObject(fill_json, "shadow_overshoot", (double)fill->shadow_overshoot_um / DISTANCE_UM_PER_CM);
+            cJSON_AddBoolToObject(fill_json, "predicted", fill->predicted);
+            cJSON_AddBoolToObject(fill_json, "shadow_timeout", fill->shadow_timeout);
+            active_ms += fill->active_ms;
+            shadow_ms += fill->shadow_ms;
+            active_over += fill->active_overshoot_um;
+            shadow_over += fill->shadow_overshoot_um;
+            both++;
+        }
+        cJSON_AddItemToArray(fills_json, fill_json);
+    }
+    cJSON *summary_json = cJSON_AddObjectToObject(json, "summary");
+    cJSON_AddNumberToObject(summary_json, "fills", both);
+    if (both) {
+        cJSON_AddNumberToObject(summary_json, "active_avg_ms", active_ms / both);
+        cJSON_AddNumberToObject(summary_json, "shadow_avg_ms", shadow_ms / both);
+        cJSON_AddNumberToObject(summary_json, "active_avg_overshoot", (double)active_over / both / DISTANCE_UM_PER_CM);
+        cJSON_AddNumberToObject(summary_json, "shadow_avg_overshoot", (double)shadow_over / both / DISTANCE_UM_PER_CM);
+    }
+    return json;
+}
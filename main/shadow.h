@@ -0,0 +1,69 @@
+#ifndef __SHADOW_H__
+#define __SHADOW_H__
+
+#include "topup_logic.h"
+
+#include <cJSON.h>
+#include <esp_err.h>
+#include <nvs.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SHADOW_HISTORY_LEN 8 // fills kept for comparison
+
+/*
+ * A second set of filter and topup parameters run on the live sample stream next to the active ones. It never
+ * touches the pump: it only records whether it would have started each topup and when it would have stopped it,
+ * so new parameters can be judged on real fills before they are switched on.
+ */
+typedef struct {
+    uint8_t enabled;
+    uint8_t num_pings;         // the first num_pings of every reading are filtered, at most the active count
+    uint8_t filter;            // distance_filter_t
+    uint8_t num_below_trigger;
+    int32_t trigger_level_um;
+} shadow_params_t;
+
+// One topup that ran the pump, as the active and shadow parameters saw it
+typedef struct {
+    int64_t start_time;          // epoch seconds, 0 if the time was not known
+    bool shadow_needed;          // the shadow would have started this topup
+    bool predicted;              // the pump stopped first, the shadow stop is extrapolated from the fill rate
+    bool shadow_timeout;         // the shadow would have run into the pump time limit
+    uint32_t active_ms;
+    uint32_t shadow_ms;          // when the shadow would have stopped the pump, 0 if it would not have started it
+    int32_t active_overshoot_um; // past the trigger level towards full when the pump stopped
+    int32_t shadow_overshoot_um;
+} shadow_fill_t;
+
+typedef struct {
+    uint32_t samples;
+    int32_t level_um;          // last shadow reading
+    uint32_t decisions;        // topup checks seen
+    uint32_t agreed;
+    uint32_t shadow_only;      // the shadow would have filled, the active parameters did not
+    uint32_t active_only;
+    uint32_t fills;            // topups compared in the history, the newest last
+    uint32_t eval_max_us;      // longest shadow evaluation of a sample
+    shadow_fill_t history[SHADOW_HISTORY_LEN];
+} shadow_status_t;
+
+esp_err_t shadow_init(nvs_handle_t handle, bool trigger_when_farther);
+
+// Runs a reading through the shadow parameters. Called from the sampler task, never blocks.
+void shadow_add_sample(int32_t level_um, const int32_t *pings_um, int num_pings);
+
+// A topup check decided whether water was needed, using the reading just added
+void shadow_decide(bool active_needed);
+
+// The pump started and stopped. The shadow tracks the readings in between.
+void shadow_fill_start(const topup_params_t *active, uint32_t max_topup_time_ms);
+void shadow_fill_end(void);
+
+// PATCH /shadow members: enabled, trigger_level (cm), num_below_trigger, num_pings and filter ("mean" or "median")
+esp_err_t shadow_patch(const cJSON *patch, char *err, size_t err_len);
+
+void shadow_get_status(shadow_params_t *params, shadow_status_t *status);
+cJSON *shadow_to_json(void);
+
+#endif // __SHADOW_H__
@@ -0,0 +1,67 @@
+#ifndef __STATS_BIN_H__
+#define __STATS_BIN_H__
+
+/*
+ * Binary form of /stats for machine clients, served on /stats.bin and on /stats to an Accept of STATS_BIN_TYPE.
+ * A stats_bin_t is followed by num_samples stats_bin_sample_t, oldest first. All fields are little endian, times are
+ * epoch milliseconds (0 if the clock was not set) and distances are micrometres. Fields are only ever appended, so a
+ * reader skips header_size bytes to reach the samples and ignores any fields it does not know about.
+ * tools/stats_decode.py reads it.
+ */
+
+#include <stdint.h>
+
+#define STATS_BIN_MAGIC "ESTS"
+#define STATS_BIN_VERSION 1
+#define STATS_BIN_TYPE "application/vnd.auto-topoff.stats"
+
+#define STATS_BIN_FLAG_LEVEL 0x01      // level_um holds a reading
+#define STATS_BIN_FLAG_LEVEL_WARM 0x02 // the reading was kept in RTC memory from before a reset
+#define STATS_BIN_FLAG_PUMP 0x04       // the pump is on
+#define STATS_BIN_FLAG_TIME 0x08       // the clock has been set, epoch times are valid
+#define STATS_BIN_FLAG_TOPUP 0x10      // the last_topup fields hold a journal record
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size; // sizeof(stats_bin_t) on the device
+    uint16_t sample_size;
+    uint16_t num_samples;
+    uint32_t flags;
+    int64_t now_ms;
+    int64_t uptime_ms;
+    uint32_t boot_count;
+
+    int32_t level_um;
+    int64_t level_ms; // when level_um was read
+    uint8_t pump_duty_pct;
+    uint8_t reserved[3];
+    uint32_t pump_total_ms; // pump on time since boot
+
+    // The newest topup journal record
+    int64_t last_topup_ms;
+    uint32_t last_topup_duration_ms;
+    int32_t last_topup_end_um;
+    uint8_t last_topup_outcome; // topup_outcome_t
+    uint8_t last_topup_source;  // topup_source_t
+    uint16_t reserved2;
+
+    // Config, as in app_config_t
+    uint32_t config_version;
+    int32_t trigger_level_um;
+    int32_t fill_level_um;
+    uint32_t max_topup_time_ms;
+    uint8_t schedule_mode;
+    uint8_t trigger_days;
+    uint8_t trigger_hour;
+    uint8_t trigger_minute;
+    uint8_t num_below_trigger;
+    uint8_t reserved3[3];
+} stats_bin_t;
+
+typedef struct __attribute__((packed)) {
+    int64_t at_ms;
+    int32_t level_um;
+} stats_bin_sample_t;
+
+#endif // __STATS_BIN_H__
@@ -0,0 +1,130 @@
+#include "time_service.h"
+#include "boot_timing.h"
+#include "log_events.h"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_netif_sntp.h>
+#include <esp_rtc_time.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <sdkconfig.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define MIN_VALID_EPOCH 1451606400 // 2016-01-01, anything earlier means the clock was never set
+#define RTC_ANCHOR_MAGIC 0x54494d45
+
+// Wall time at a known RTC slow clock reading. The RTC timer keeps counting through resets that keep RTC memory,
+// so the current time can be recovered from it without the network.
+typedef struct {
+    uint32_t magic;
+    int64_t epoch_us;
+    uint64_t rtc_us;
+} rtc_time_anchor_t;
+
+static const char *TAG = "time";
+RTC_NOINIT_ATTR static rtc_time_anchor_t anchor;
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+static time_service_status_t status = {.last_sync_age_s = -1};
+static int64_t last_sync_at; // esp_timer time of the last sync
+
+static int64_t now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int32_t clamp_i32(int64_t value) {
+    return value > INT32_MAX ? INT32_MAX : value < INT32_MIN ? INT32_MIN : (int32_t)value;
+}
+
+// Runs in the lwIP task after SNTP has started slewing the clock towards tv. Only offsets too large to slew
+// (the first sync after power on) are stepped, in which case the clock already reads tv.
+static void sync_callback(struct timeval *tv) {
+    int64_t ntp_us = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+    int64_t offset_us = ntp_us - now_us();
+    int64_t at = esp_timer_get_time();
+    struct timeval remaining = {0};
+    adjtime(NULL, &remaining);
+
+    portENTER_CRITICAL(&status_lock);
+    // Drift is only meaningful between two syncs, not after the first step from an unset or restored clock
+    if (status.source == TIME_SOURCE_NTP && at > last_sync_at) {
+        status.drift_ppb = clamp_i32(offset_us * 1000000000 / (at - last_sync_at));
+    }
+    status.source = TIME_SOURCE_NTP;
+    status.sync_count++;
+    status.last_offset_us = offset_us;
+    status.adjusting = remaining.tv_sec != 0 || remaining.tv_usec != 0;
+    last_sync_at = at;
+    portEXIT_CRITICAL(&status_lock);
+
+    anchor.epoch_us = ntp_us;
+    anchor.rtc_us = esp_rtc_get_time_us();
+    anchor.magic = RTC_ANCHOR_MAGIC;
+    boot_mark(BOOT_PHASE_TIME);
+    BINLOG(EV_TIME_SYNCED, clamp_i32(offset_us / 1000), status.drift_ppb);
+}
+
+static void restore_time(void) {
+    if (time(NULL) >= MIN_VALID_EPOCH) {
+        status.source = TIME_SOURCE_RTC; // the system clock survived the reset on its own
+        boot_mark(BOOT_PHASE_TIME);
+        return;
+    }
+    uint64_t rtc_us = esp_rtc_get_time_us();
+    if (anchor.magic != RTC_ANCHOR_MAGIC || rtc_us < anchor.rtc_us) {
+        ESP_LOGW(TAG, "No last known time, schedules wait for the first NTP sync");
+        return;
+    }
+    int64_t epoch_us = anchor.epoch_us + (int64_t)(rtc_us - anchor.rtc_us);
+    struct timeval tv = {.tv_sec = epoch_us / 1000000, .tv_usec = epoch_us % 1000000};
+    settimeofday(&tv, NULL);
+    status.source = TIME_SOURCE_RTC;
+    boot_mark(BOOT_PHASE_TIME);
+    BINLOG(EV_TIME_RESTORED, clamp_i32((rtc_us - anchor.rtc_us) / 1000000));
+}
+
+esp_err_t time_service_init(void) {
+    setenv("TZ", CONFIG_APP_TIMEZONE, 1);
+    tzset();
+    restore_time();
+
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_APP_SNTP_SERVER);
+    config.smooth_sync = true;
+    config.wait_for_sync = false;
+    config.sync_cb = sync_callback;
+    return esp_netif_sntp_init(&config);
+}
+
+bool time_service_is_valid(void) {
+    return time(NULL) >= MIN_VALID_EPOCH;
+}
+
+void time_service_get_status(time_service_status_t *out) {
+    portENTER_CRITICAL(&status_lock);
+    *out = status;
+    int64_t at = last_sync_at;
+    portEXIT_CRITICAL(&status_lock);
+    if (out->sync_count) {
+        out->last_sync_age_s = (esp_timer_get_time() - at) / 1000000;
+    }
+    if (out->adjusting) {
+        struct timeval remaining = {0};
+        adjtime(NULL, &remaining);
+        out->adjusting = remaining.tv_sec != 0 || remaining.tv_usec != 0;
+    }
+}
+
+const char *time_source_name(time_source_t source) {
+    switch (source) {
+    case TIME_SOURCE_RTC:
+        return "rtc";
+    case TIME_SOURCE_NTP:
+        return "ntp";
+    default:
+        return "none";
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef __TIME_SERVICE_H__
+#define __TIME_SERVICE_H__
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    TIME_SOURCE_NONE, // the clock has never been set, schedules do not run
+    TIME_SOURCE_RTC,  // carried over a reset in RTC memory, may have drifted
+    TIME_SOURCE_NTP,  // synchronised with the NTP server
+} time_source_t;
+
+typedef struct {
+    time_source_t source;
+    uint32_t sync_count;
+    int64_t last_sync_age_s;  // -1 if there has been no sync since boot
+    int64_t last_offset_us;   // correction applied by the last sync, positive when the clock was behind
+    int32_t drift_ppb;        // clock rate error measured between the last two syncs
+    bool adjusting;           // a smoothed correction is still being slewed in
+} time_service_status_t;
+
+/*
+ * Sets the timezone, restores the last known time from RTC memory if the clock was lost and starts SNTP in the
+ * background. Never waits for the network - corrections arrive later and are slewed in rather than stepped.
+ * Call after esp_netif_init().
+ */
+esp_err_t time_service_init(void);
+
+// True once the clock holds a usable wall time, from either source
+bool time_service_is_valid(void);
+
+void time_service_get_status(time_service_status_t *status);
+const char *time_source_name(time_source_t source);
+
+#endif // __TIME_SERVICE_H__
@@ -0,0 +1,250 @@
+#include "topup_journal.h"
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+
+#define JOURNAL_PARTITION_LABEL "journal"
+#define JOURNAL_PARTITION_SUBTYPE 0x40 // first custom data subtype, see partitions.csv
+#define RECORD_SIZE 16
+#define SECTOR_SIZE 4096
+#define SLOTS_PER_SECTOR (SECTOR_SIZE / RECORD_SIZE)
+#define SCAN_BATCH 16 // records read at a time while scanning
+
+// Packed layout, low bits first. The last byte is a CRC of the rest.
+#define BITS_SEQ 22
+#define BITS_TIME 32
+#define BITS_DURATION 13 // 100 ms steps
+#define BITS_LEVEL 16    // 0.1 mm steps, all ones if unknown
+#define BITS_SAMPLES 11
+#define BITS_ERRORS 4
+#define BITS_OUTCOME 3
+#define BITS_SOURCE 3
+#define LEVEL_UNKNOWN ((1 << BITS_LEVEL) - 1)
+
+_Static_assert(BITS_SEQ + BITS_TIME + BITS_DURATION + 2 * BITS_LEVEL + BITS_SAMPLES + BITS_ERRORS + BITS_OUTCOME +
+                       BITS_SOURCE <= 8 * (RECORD_SIZE - 1),
+               "record fields do not fit");
+
+static const char *TAG = "journal";
+static const esp_partition_t *partition;
+static SemaphoreHandle_t lock;
+static uint32_t num_slots;
+static uint32_t head;    // next slot to write
+static uint32_t written; // slots holding a record, always the ones just before head
+static uint32_t next_seq;
+
+static uint32_t saturate(uint32_t value, int bits) {
+    uint32_t max = bits == 32 ? UINT32_MAX : (1u << bits) - 1;
+    return value > max ? max : value;
+}
+
+static void put_bits(uint8_t *buf, int *pos, uint32_t value, int bits) {
+    for (int i = 0; i < bits; i++, (*pos)++) {
+        if ((value >> i) & 1) {
+            buf[*pos / 8] |= 1 << (*pos % 8);
+        }
+    }
+}
+
+static uint32_t get_bits(const uint8_t *buf, int *pos, int bits) {
+    uint32_t value = 0;
+    for (int i = 0; i < bits; i++, (*pos)++) {
+        value |= (uint32_t)((buf[*pos / 8] >> (*pos % 8)) & 1) << i;
+    }
+    return value;
+}
+
+static uint32_t pack_level(int32_t level_um) {
+    if (level_um < 0) {
+        return LEVEL_UNKNOWN;
+    }
+    uint32_t steps = level_um / 100;
+    return steps < LEVEL_UNKNOWN ? steps : LEVEL_UNKNOWN - 1;
+}
+
+static int32_t unpack_level(uint32_t packed) {
+    return packed == LEVEL_UNKNOWN ? -1 : (int32_t)packed * 100;
+}
+
+static void pack(const topup_record_t *record, uint8_t *buf) {
+    memset(buf, 0, RECORD_SIZE);
+    int pos = 0;
+    put_bits(buf, &pos, record->seq, BITS_SEQ);
+    put_bits(buf, &pos, record->start_time, BITS_TIME);
+    put_bits(buf, &pos, saturate((record->duration_ms + 50) / 100, BITS_DURATION), BITS_DURATION);
+    put_bits(buf, &pos, pack_level(record->start_level_um), BITS_LEVEL);
+    put_bits(buf, &pos, pack_level(record->end_level_um), BITS_LEVEL);
+    put_bits(buf, &pos, saturate(record->samples, BITS_SAMPLES), BITS_SAMPLES);
+    put_bits(buf, &pos, saturate(record->sensor_errors, BITS_ERRORS), BITS_ERRORS);
+    put_bits(buf, &pos, record->outcome, BITS_OUTCOME);
+    put_bits(buf, &pos, record->source, BITS_SOURCE);
+    buf[RECORD_SIZE - 1] = esp_rom_crc8_le(0, buf, RECORD_SIZE - 1);
+}
+
+static bool unpack(const uint8_t *buf, topup_record_t *record) {
+    if (esp_rom_crc8_le(0, buf, RECORD_SIZE - 1) != buf[RECORD_SIZE - 1]) {
+        return false;
+    }
+    int pos = 0;
+    record->seq = get_bits(buf, &pos, BITS_SEQ);
+    record->start_time = get_bits(buf, &pos, BITS_TIME);
+    record->duration_ms = get_bits(buf, &pos, BITS_DURATION) * 100;
+    record->start_level_um = unpack_level(get_bits(buf, &pos, BITS_LEVEL));
+    record->end_level_um = unpack_level(get_bits(buf, &pos, BITS_LEVEL));
+    record->samples = get_bits(buf, &pos, BITS_SAMPLES);
+    record->sensor_errors = get_bits(buf, &pos, BITS_ERRORS);
+    record->outcome = get_bits(buf, &pos, BITS_OUTCOME);
+    record->source = get_bits(buf, &pos, BITS_SOURCE);
+    return true;
+}
+
+static bool is_erased(const uint8_t *buf) {
+    for (int i = 0; i < RECORD_SIZE; i++) {
+        if (buf[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finds the newest record. Written slots are contiguous and end just before head.
+static esp_err_t scan(void) {
+    uint8_t batch[SCAN_BATCH][RECORD_SIZE];
+    bool found = false;
+    uint32_t newest_slot = 0;
+    uint32_t newest_seq = 0;
+    written = 0;
+    for (uint32_t slot = 0; slot < num_slots; slot += SCAN_BATCH) {
+        esp_err_t err = esp_partition_read(partition, slot * RECORD_SIZE, batch, sizeof(batch));
+        if (err != ESP_OK) {
+            return err;
+        }
+        for (int i = 0; i < SCAN_BATCH; i++) {
+            topup_record_t record;
+            if (is_erased(batch[i])) {
+                continue;
+            }
+            written++;
+            if (unpack(batch[i], &record) && (!found || record.seq > newest_seq)) {
+                found = true;
+                newest_seq = record.seq;
+                newest_slot = slot + i;
+            }
+        }
+    }
+    if (!found) {
+        head = 0;
+        next_seq = 0;
+        if (written) {
+            ESP_LOGW(TAG, "No readable records, erasing the journal");
+            written = 0;
+            return esp_partition_erase_range(partition, 0, partition->size);
+        }
+        return ESP_OK;
+    }
+    next_seq = (newest_seq + 1) & ((1u << BITS_SEQ) - 1);
+    head = (newest_slot + 1) % num_slots;
+    // Skip a record that was cut short by a reset, the slot cannot be written again until its sector is erased
+    while (head % SLOTS_PER_SECTOR) {
+        uint8_t buf[RECORD_SIZE];
+        esp_err_t err = esp_partition_read(partition, head * RECORD_SIZE, buf, sizeof(buf));
+        if (err != ESP_OK || is_erased(buf)) {
+            return err;
+        }
+        head = (head + 1) % num_slots;
+    }
+    return ESP_OK;
+}
+
+esp_err_t topup_journal_init(void) {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_PARTITION_SUBTYPE, JOURNAL_PARTITION_LABEL);
+    if (!partition) {
+        ESP_LOGE(TAG, "No \"%s\" partition, topups will not be recorded", JOURNAL_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (partition->size < 2 * SECTOR_SIZE) {
+        partition = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    lock = xSemaphoreCreateMutex();
+    if (!lock) {
+        partition = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    num_slots = partition->size / SECTOR_SIZE * SLOTS_PER_SECTOR;
+    esp_err_t err = scan();
+    if (err != ESP_OK) {
+        partition = NULL;
+    }
+    return err;
+}
+
+esp_err_t topup_journal_append(topup_record_t *record) {
+    if (!partition) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint8_t buf[RECORD_SIZE];
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (head % SLOTS_PER_SECTOR == 0) {
+        // Starting a sector, which drops the oldest records once the ring has wrapped
+        err = esp_partition_erase_range(partition, head * RECORD_SIZE, SECTOR_SIZE);
+        if (written > num_slots - SLOTS_PER_SECTOR) {
+            written = num_slots - SLOTS_PER_SECTOR;
+        }
+    }
+    if (err == ESP_OK) {
+        record->seq = next_seq;
+        pack(record, buf);
+        err = esp_partition_write(partition, head * RECORD_SIZE, buf, sizeof(buf));
+        // The slot is used up even if the write failed
+        head = (head + 1) % num_slots;
+        written++;
+        next_seq = (next_seq + 1) & ((1u << BITS_SEQ) - 1);
+    }
+    xSemaphoreGive(lock);
+    return err;
+}
+
+uint32_t topup_journal_count(void) {
+    if (!partition) {
+        return 0;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t count = written;
+    xSemaphoreGive(lock);
+    return count;
+}
+
+esp_err_t topup_journal_read(uint32_t index, topup_record_t *records, int max, int *num_read) {
+    *num_read = 0;
+    if (!partition) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (; index < written && *num_read < max && err == ESP_OK; index++) {
+        uint32_t slot = (head + num_slots - 1 - index) % num_slots;
+        uint8_t buf[RECORD_SIZE];
+        err = esp_partition_read(partition, slot * RECORD_SIZE, buf, sizeof(buf));
+        if (err == ESP_OK && unpack(buf, &records[*num_read])) {
+            (*num_read)++;
+        }
+    }
+    xSemaphoreGive(lock);
+    return err;
+}
+
+const char *topup_source_name(topup_source_t source) {
+    static const char *const names[] = {"schedule", "demand", "rule", "manual", "api", "continuous"};
+    return source < sizeof(names) / sizeof(names[0]) ? names[source] : "unknown";
+}
+
+const char *topup_outcome_name(topup_outcome_t outcome) {
+    static const char *const names[] = {"reached", "timeout", "sensor_error", "not_needed", "interlocked", "no_level", "budget", "stopped"};
+    return outcome < sizeof(names) / sizeof(names[0]) ? names[outcome] : "unknown";
+}
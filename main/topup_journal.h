@@ -0,0 +1,57 @@
+#ifndef __TOPUP_JOURNAL_H__
+#define __TOPUP_JOURNAL_H__
+
+#include <esp_err.h>
+#include <stdint.h>
+
+typedef enum {
+    TOPUP_SOURCE_SCHEDULE,   // fixed weekday schedule
+    TOPUP_SOURCE_DEMAND,     // demand planner
+    TOPUP_SOURCE_RULE,       // trigger rule
+    TOPUP_SOURCE_MANUAL,     // the button on the web page
+    TOPUP_SOURCE_API,        // any other /topup request
+    TOPUP_SOURCE_CONTINUOUS, // live readings crossed the trigger in continuous mode
+} topup_source_t;
+
+typedef enum {
+    TOPUP_OUTCOME_REACHED,
+    TOPUP_OUTCOME_TIMEOUT,
+    TOPUP_OUTCOME_SENSOR_ERROR,
+    TOPUP_OUTCOME_NOT_NEEDED,
+    TOPUP_OUTCOME_INTERLOCKED,
+    TOPUP_OUTCOME_NO_LEVEL, // no reading to start from
+    TOPUP_OUTCOME_BUDGET,   // stopped when the daily pump time budget ran out
+    TOPUP_OUTCOME_STOPPED,  // the pump was switched off through /pump
+} topup_outcome_t;
+
+typedef struct {
+    uint32_t seq;           // increases by one per record
+    uint32_t start_time;    // epoch seconds, 0 if the clock was not set
+    uint32_t duration_ms;   // pump on time, kept to 100 ms
+    int32_t start_level_um; // -1 if unknown, kept to 0.1 mm
+    int32_t end_level_um;
+    uint16_t samples;       // readings taken while pumping
+    uint8_t sensor_errors;
+    uint8_t outcome;        // topup_outcome_t
+    uint8_t source;         // topup_source_t
+} topup_record_t;
+
+/*
+ * Ring of topup records in the "journal" data partition. Records are bit-packed into 16 bytes with a CRC, so the
+ * 64 KB partition holds the last ~4000 topups. When the ring wraps the oldest sector is erased as a whole.
+ */
+esp_err_t topup_journal_init(void);
+
+// Fills in record->seq and writes the record
+esp_err_t topup_journal_append(topup_record_t *record);
+
+// Records written, including any the CRC later rejects
+uint32_t topup_journal_count(void);
+
+// Reads up to max records starting index records back from the newest, newest first. Unreadable records are skipped.
+esp_err_t topup_journal_read(uint32_t index, topup_record_t *records, int max, int *num_read);
+
+const char *topup_source_name(topup_source_t source);
+const char *topup_outcome_name(topup_outcome_t outcome);
+
+#endif // __TOPUP_JOURNAL_H__
@@ -0,0 +1,39 @@
+#include "topup_logic.h"
+
+bool topup_reached(const topup_params_t *params, uint8_t *num_below, int32_t level_um) {
+    if (topup_needed(params, level_um)) {
+        *num_below = 0;
+    } else if (*num_below < UINT8_MAX) {
+        (*num_below)++;
+    }
+    return *num_below >= params->num_below_trigger;
+}
+
+bool topup_crossed(const topup_params_t *params, uint8_t *num_past, uint8_t num_samples, int32_t level_um) {
+    if (!topup_needed(params, level_um)) {
+        *num_past = 0;
+    } else if (*num_past < UINT8_MAX) {
+        (*num_past)++;
+    }
+    return *num_past >= num_samples;
+}
+
+void topup_fill_begin(topup_fill_t *fill, uint32_t limit_ms, uint32_t now_ms) {
+    fill->start_ms = now_ms;
+    fill->limit_ms = limit_ms;
+    fill->num_below = 0;
+}
+
+topup_fill_state_t topup_fill_step(topup_fill_t *fill, const topup_params_t *params, bool read_ok, int32_t level_um,
+                                   uint32_t now_ms) {
+    if (!read_ok) {
+        return TOPUP_FILL_SENSOR_FAIL;
+    }
+    if (topup_reached(params, &fill->num_below, level_um)) {
+        return TOPUP_FILL_REACHED;
+    }
+    if (now_ms - fill->start_ms >= fill->limit_ms) {
+        return TOPUP_FILL_TIMEOUT;
+    }
+    return TOPUP_FILL_PUMPING;
+}
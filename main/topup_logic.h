@@ -0,0 +1,69 @@
+#ifndef __TOPUP_LOGIC_H__
+#define __TOPUP_LOGIC_H__
+
+/*
+ * The topup decisions, kept free of ESP-IDF so tools/trace_replay.c can run recorded readings through them.
+ * The firmware is built for the polarity in CONFIG_APP_TRIGGER_WHEN_FARTHER, so the comparisons carry no branch on
+ * it. Host tools define TOPUP_LOGIC_HOST and pick the polarity per run with trigger_when_farther instead.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef TOPUP_LOGIC_HOST
+#include <sdkconfig.h>
+#endif
+
+typedef struct {
+    int32_t trigger_level_um;
+    uint8_t num_below_trigger;   // consecutive readings back within the trigger level that end a topup
+#ifdef TOPUP_LOGIC_HOST
+    bool trigger_when_farther;   // sensor above the water, the distance grows as the level drops
+#endif
+} topup_params_t;
+
+#ifdef TOPUP_LOGIC_HOST
+#define TOPUP_WHEN_FARTHER(params) ((params)->trigger_when_farther)
+#elif CONFIG_APP_TRIGGER_WHEN_FARTHER
+#define TOPUP_WHEN_FARTHER(params) true
+#else
+#define TOPUP_WHEN_FARTHER(params) false
+#endif
+
+// Whether a reading calls for water
+static inline bool topup_needed(const topup_params_t *params, int32_t level_um) {
+    return TOPUP_WHEN_FARTHER(params) ? level_um >= params->trigger_level_um : level_um <= params->trigger_level_um;
+}
+
+// Feeds a reading taken while pumping. True once enough consecutive readings no longer need water.
+bool topup_reached(const topup_params_t *params, uint8_t *num_below, int32_t level_um);
+
+// Feeds a reading taken while idle. True once num_samples consecutive readings need water.
+bool topup_crossed(const topup_params_t *params, uint8_t *num_past, uint8_t num_samples, int32_t level_um);
+
+// How far the level still has to move to stop needing water, 0 or less once it is there
+static inline int32_t topup_remaining_um(const topup_params_t *params, int32_t level_um) {
+    return TOPUP_WHEN_FARTHER(params) ? level_um - params->trigger_level_um : params->trigger_level_um - level_um;
+}
+
+typedef enum {
+    TOPUP_FILL_PUMPING,
+    TOPUP_FILL_REACHED,
+    TOPUP_FILL_TIMEOUT,
+    TOPUP_FILL_SENSOR_FAIL,
+} topup_fill_state_t;
+
+// One fill, from the pump starting until it reaches the level, runs out of time or loses the sensor
+typedef struct {
+    uint32_t start_ms;
+    uint32_t limit_ms;
+    uint8_t num_below;
+} topup_fill_t;
+
+void topup_fill_begin(topup_fill_t *fill, uint32_t limit_ms, uint32_t now_ms);
+
+// Feeds the result of a reading taken while pumping. Anything but TOPUP_FILL_PUMPING ends the fill.
+topup_fill_state_t topup_fill_step(topup_fill_t *fill, const topup_params_t *params, bool read_ok, int32_t level_um,
+                                   uint32_t now_ms);
+
+#endif // __TOPUP_LOGIC_H__
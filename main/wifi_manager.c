@@ -0,0 +1,217 @@
+#include "wifi_manager.h"
+#include "boot_timing.h"
+#include "log_events.h"
+
+#include <esp_check.h>
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <protocol_examples_common.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <string.h>
+
+_Static_assert(CONFIG_APP_WIFI_BACKOFF_MIN_MS <= CONFIG_APP_WIFI_BACKOFF_MAX_MS, "Wi-Fi backoff limits are reversed");
+
+static const char *TAG = "wifi_mgr"; // "wifi" belongs to the driver
+// Guards status, outage_start, backoff_ms and ap_channel, which the event loop and the esp_timer task both use
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+static wifi_manager_status_t status;
+static int64_t outage_start; // esp_timer time of the disconnect, 0 while connected or before the first IP
+static esp_netif_t *sta_netif;
+static esp_timer_handle_t retry_timer;
+static int64_t started_at;   // esp_timer time Wi-Fi was started
+static uint32_t backoff_ms;  // delay before the next retry
+static uint8_t ap_channel;   // channel of the last AP, 0 if unknown
+
+static void schedule_retry(void);
+
+// Runs on the event loop or the esp_timer task, never blocks
+static void connect_now(void *arg) {
+    portENTER_CRITICAL(&status_lock);
+    bool first_attempt = status.attempts++ == 0;
+    uint8_t channel = ap_channel;
+    portEXIT_CRITICAL(&status_lock);
+
+    // The first retry only scans the channel the AP was on, which reconnects in a fraction of a full scan
+    wifi_config_t wifi_config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) == ESP_OK) {
+        wifi_config.sta.channel = first_attempt ? channel : 0;
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    }
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Connect failed (%s)", esp_err_to_name(err));
+        schedule_retry();
+    }
+}
+
+static void schedule_retry(void) {
+    portENTER_CRITICAL(&status_lock);
+    uint32_t delay_ms = backoff_ms;
+    backoff_ms = backoff_ms * 2 > CONFIG_APP_WIFI_BACKOFF_MAX_MS ? CONFIG_APP_WIFI_BACKOFF_MAX_MS : backoff_ms * 2;
+    portEXIT_CRITICAL(&status_lock);
+    esp_timer_stop(retry_timer);
+    esp_timer_start_once(retry_timer, (uint64_t)delay_ms * 1000);
+}
+
+static void on_wifi_event(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    if (event_id == WIFI_EVENT_STA_START) {
+        connect_now(NULL);
+    } else if (event_id == WIFI_EVENT_STA_CONNECTED) {
+        uint8_t channel = ((wifi_event_sta_connected_t *)event_data)->channel;
+        portENTER_CRITICAL(&status_lock);
+        ap_channel = channel;
+        portEXIT_CRITICAL(&status_lock);
+#if CONFIG_LWIP_IPV6
+        esp_netif_create_ip6_linklocal(sta_netif); // IPv6 only networks have no other address to wait for
+#endif
+    } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        uint8_t reason = ((wifi_event_sta_disconnected_t *)event_data)->reason;
+        portENTER_CRITICAL(&status_lock);
+        bool was_connected = status.connected;
+        status.connected = false;
+        status.rssi = 0;
+        status.last_reason = reason;
+        if (was_connected) {
+            status.outages++;
+            status.attempts = 0;
+            outage_start = esp_timer_get_time();
+            backoff_ms = CONFIG_APP_WIFI_BACKOFF_MIN_MS;
+        }
+        uint32_t attempts = status.attempts;
+        uint32_t delay_ms = backoff_ms;
+        portEXIT_CRITICAL(&status_lock);
+
+        if (was_connected) {
+            BINLOG(EV_WIFI_DISCONNECTED, reason);
+            connect_now(NULL);
+        } else {
+            BINLOG(EV_WIFI_RETRY, reason, attempts, delay_ms);
+            schedule_retry();
+        }
+    }
+}
+
+// Called for the first address after a connect, whichever family it is. Returns false if already connected.
+static bool mark_connected(void) {
+    int64_t now = esp_timer_get_time();
+    wifi_ap_record_t ap;
+    bool have_ap = esp_wifi_sta_get_ap_info(&ap) == ESP_OK;
+
+    portENTER_CRITICAL(&status_lock);
+    bool was_connected = status.connected;
+    uint32_t attempts = status.attempts;
+    uint32_t outage_ms = outage_start ? (now - outage_start) / 1000 : 0;
+    if (!was_connected) {
+        status.connected = true;
+        status.rssi = have_ap ? ap.rssi : 0;
+        status.attempts = 0;
+        if (!status.first_connect_ms) {
+            status.first_connect_ms = (now - started_at) / 1000;
+        }
+        if (outage_start) {
+            status.last_outage_ms = outage_ms;
+            status.total_outage_ms += outage_ms;
+            if (outage_ms > status.max_outage_ms) {
+                status.max_outage_ms = outage_ms;
+            }
+        }
+        outage_start = 0;
+        backoff_ms = CONFIG_APP_WIFI_BACKOFF_MIN_MS;
+    }
+    portEXIT_CRITICAL(&status_lock);
+    if (was_connected) {
+        return false;
+    }
+
+    esp_timer_stop(retry_timer);
+    boot_mark(BOOT_PHASE_WIFI);
+    BINLOG(EV_WIFI_CONNECTED, outage_ms, attempts);
+    return true;
+}
+
+#if CONFIG_LWIP_IPV4
+static void on_got_ip(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+    mark_connected();
+    ESP_LOGI(TAG, "Got IP " IPSTR, IP2STR(&event->ip_info.ip));
+}
+#endif
+
+#if CONFIG_LWIP_IPV6
+// The link-local address comes first, a global one follows if the network hands one out
+static void on_got_ip6(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    ip_event_got_ip6_t *event = (ip_event_got_ip6_t *)event_data;
+    if (event->esp_netif != sta_netif) {
+        return;
+    }
+    mark_connected();
+    ESP_LOGI(TAG, "Got IPv6 " IPV6STR, IPV62STR(event->ip6_info.ip));
+}
+#endif
+
+// The CI configs have the example menu read the SSID and password from the console instead of from Kconfig
+static void get_credentials(wifi_sta_config_t *sta) {
+#if CONFIG_EXAMPLE_WIFI_SSID_PWD_FROM_STDIN
+    char line[sizeof(sta->ssid) + sizeof(sta->password) + 2] = {0};
+    example_configure_stdin_stdout();
+    ESP_LOGW(TAG, "Please input ssid password:");
+    if (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *rest = NULL;
+        const char *ssid = strtok_r(line, " ", &rest);
+        const char *password = strtok_r(NULL, " ", &rest);
+        strncpy((char *)sta->ssid, ssid ? ssid : "", sizeof(sta->ssid));
+        strncpy((char *)sta->password, password ? password : "", sizeof(sta->password));
+    }
+#else
+    strncpy((char *)sta->ssid, CONFIG_EXAMPLE_WIFI_SSID, sizeof(sta->ssid));
+    strncpy((char *)sta->password, CONFIG_EXAMPLE_WIFI_PASSWORD, sizeof(sta->password));
+#endif
+    sta->threshold.authmode = sta->password[0] ? WIFI_AUTH_WPA2_PSK : WIFI_AUTH_OPEN;
+}
+
+esp_err_t wifi_manager_start(void) {
+    const esp_timer_create_args_t timer_args = {
+        .callback = connect_now,
+        .name = "wifi_retry",
+    };
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &retry_timer), TAG, "retry timer");
+    backoff_ms = CONFIG_APP_WIFI_BACKOFF_MIN_MS;
+
+    sta_netif = esp_netif_create_default_wifi_sta();
+    wifi_init_config_t init_config = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_RETURN_ON_ERROR(esp_wifi_init(&init_config), TAG, "init");
+    ESP_RETURN_ON_ERROR(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, on_wifi_event, NULL), TAG, "events");
+#if CONFIG_LWIP_IPV4
+    ESP_RETURN_ON_ERROR(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, on_got_ip, NULL), TAG, "events");
+#endif
+#if CONFIG_LWIP_IPV6
+    ESP_RETURN_ON_ERROR(esp_event_handler_register(IP_EVENT, IP_EVENT_GOT_IP6, on_got_ip6, NULL), TAG, "events");
+#endif
+
+    wifi_config_t wifi_config = {
+        .sta = {
+            .scan_method = WIFI_FAST_SCAN,
+            .sort_method = WIFI_CONNECT_AP_BY_SIGNAL,
+        },
+    };
+    get_credentials(&wifi_config.sta);
+    ESP_RETURN_ON_ERROR(esp_wifi_set_storage(WIFI_STORAGE_RAM), TAG, "storage");
+    ESP_RETURN_ON_ERROR(esp_wifi_set_mode(WIFI_MODE_STA), TAG, "mode");
+    ESP_RETURN_ON_ERROR(esp_wifi_set_config(WIFI_IF_STA, &wifi_config), TAG, "config");
+    started_at = esp_timer_get_time();
+    return esp_wifi_start(); // the STA_START event makes the first connection attempt
+}
+
+void wifi_manager_get_status(wifi_manager_status_t *out) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&status_lock);
+    *out = status;
+    out->current_outage_ms = outage_start ? (now - outage_start) / 1000 : 0;
+    portEXIT_CRITICAL(&status_lock);
+}
@@ -0,0 +1,31 @@
+#ifndef __WIFI_MANAGER_H__
+#define __WIFI_MANAGER_H__
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    bool connected;            // associated with an IP address
+    int8_t rssi;               // of the current AP, 0 while disconnected
+    uint8_t last_reason;       // wifi_err_reason_t of the last disconnect
+    uint32_t outages;          // disconnects after having had an IP, since boot
+    uint32_t attempts;         // connection attempts in the current outage
+    uint32_t first_connect_ms; // from Wi-Fi start to the first IP, 0 until then
+    uint32_t current_outage_ms;
+    uint32_t last_outage_ms;   // disconnect to IP address
+    uint32_t max_outage_ms;
+    uint64_t total_outage_ms;
+} wifi_manager_status_t;
+
+/*
+ * Keeps the station connected without ever blocking the caller. A dropped connection is retried straight away on
+ * the last AP's channel, then with exponential backoff between the limits in the "Wi-Fi" Kconfig menu. The SSID and
+ * password come from the "Example Connection Configuration" menu. When that menu is set to read them from stdin, as in
+ * the CI configs, this waits for a "ssid password" line on the console first.
+ */
+esp_err_t wifi_manager_start(void);
+
+void wifi_manager_get_status(wifi_manager_status_t *out);
+
+#endif // __WIFI_MANAGER_H__
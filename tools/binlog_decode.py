@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Decode a binary log dump taken from the device's /logs?format=bin endpoint.
+
+The dump carries its own event table, so this works with any firmware version:
+
+    curl -s http://<device>/logs?format=bin -o log.bin
+    python3 tools/binlog_decode.py log.bin
+"""
+import argparse
+import datetime
+import struct
+import sys
+
+HEADER = struct.Struct("<4sHHIIqq")
+ENTRY = struct.Struct("<IHBxq4i")
+LEVELS = {1: "E", 2: "W", 3: "I", 4: "D", 5: "V"}
+
+
+def read_cstr(data, offset):
+    end = data.index(b"\0", offset)
+    return data[offset:end].decode(), end + 1
+
+
+def decode(data, wall_clock):
+    magic, version, entry_size, num_events, num_entries, uptime_us, epoch_us = HEADER.unpack_from(data)
+    if magic != b"BLOG" or version != 1 or entry_size != ENTRY.size:
+        sys.exit("not a version 1 binlog dump")
+
+    offset = HEADER.size
+    events = []
+    for _ in range(num_events):
+        level = data[offset]
+        tag, offset = read_cstr(data, offset + 1)
+        fmt, offset = read_cstr(data, offset)
+        events.append((LEVELS.get(level, "V"), tag, fmt))
+
+    for _ in range(num_entries):
+        seq, event_id, nargs, timestamp_us, *args = ENTRY.unpack_from(data, offset)
+        offset += ENTRY.size
+        if seq == 0:
+            continue  # overwritten while the dump was being taken
+        if wall_clock:
+            when = datetime.datetime.fromtimestamp((epoch_us - uptime_us + timestamp_us) / 1e6).isoformat(sep=" ")
+        else:
+            when = "%d" % (timestamp_us // 1000)
+        if event_id >= len(events):
+            print("(%s) ? unknown event %d %s" % (when, event_id, args[:nargs]))
+            continue
+        level, tag, fmt = events[event_id]
+        message = fmt % tuple(args[: fmt.count("%") - 2 * fmt.count("%%")])
+        print("(%s) %s %s: %s" % (when, level, tag, message))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", help="file saved from /logs?format=bin")
+    parser.add_argument("--wall-clock", action="store_true", help="print wall clock times instead of uptime in ms")
+    args = parser.parse_args()
+    with open(args.dump, "rb") as f:
+        decode(f.read(), args.wall_clock)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,169 @@
+/*
+ * Stalls a stand-in for the topup task and checks that the pump failsafe's bookkeeping still bounds the pump's on time.
+ * A thread plays the hardware timer and its interrupt, and a busy wait plays a reading stuck in its retries:
+ *
+ *     cc -O2 -Imain -o failsafe_stall tools/failsafe_stall.c -lpthread
+ *     ./failsafe_stall
+ *
+ * Each fill arms the failsafe for the pump time limit plus a margin, as topup_task() does, and stalls on its first
+ * reading. The pump must never stay on past the failsafe limit by more than the timer's latency, a stall within the
+ * limit must not trip it, and the next on transition after a trip must hand the pin back to the PWM signal. A pump
+ * switched on by hand has no loop watching it at all. Exits with 1 if any check fails.
+ */
+#include "pump_failsafe_logic.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LIMIT_MS 300  // pump time limit
+#define MARGIN_MS 100 // failsafe margin past the limit for fills, PUMP_FAILSAFE_MARGIN_MS on the device
+#define READING_MS 50 // time a normal reading takes
+#define LATENCY_MS 20 // how late the timer thread may cut the pump off
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake;
+static pump_failsafe_state_t state;
+static int64_t deadline_us; // 0 while the timer is stopped
+static bool pin;            // the pump output
+static int64_t pin_on_us;
+static int64_t pin_off_us;
+static uint32_t reattached; // on transitions that had to hand the pin back
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Stands in for the one-shot gptimer and its alarm interrupt
+static void *timer_thread(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        if (!deadline_us) {
+            pthread_cond_wait(&wake, &lock);
+            continue;
+        }
+        int64_t now = now_us();
+        if (now < deadline_us) {
+            struct timespec until = {.tv_sec = deadline_us / 1000000, .tv_nsec = deadline_us % 1000000 * 1000};
+            pthread_cond_timedwait(&wake, &lock, &until);
+            continue;
+        }
+        deadline_us = 0;
+        if (pin) {
+            pin = false;
+            pin_off_us = now;
+        }
+        pump_failsafe_on_alarm(&state, now);
+    }
+    return NULL;
+}
+
+static void pump_on(uint32_t limit_ms) {
+    pthread_mutex_lock(&lock);
+    if (pump_failsafe_on_arm(&state, limit_ms)) {
+        reattached++;
+    }
+    deadline_us = now_us() + (int64_t)limit_ms * 1000;
+    pin = true;
+    pin_on_us = now_us();
+    pin_off_us = 0;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+static void pump_off(void) {
+    pthread_mutex_lock(&lock);
+    deadline_us = 0;
+    pump_failsafe_on_disarm(&state);
+    if (pin) {
+        pin = false;
+        pin_off_us = now_us();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static bool tripped(void) {
+    pthread_mutex_lock(&lock);
+    bool tripped = state.status.tripped;
+    pthread_mutex_unlock(&lock);
+    return tripped;
+}
+
+// Holds the caller like a reading busy waiting through its retries, without yielding
+static void stall_ms(uint32_t ms) {
+    int64_t until = now_us() + (int64_t)ms * 1000;
+    while (now_us() < until) {
+    }
+}
+
+// A fill as topup_task() runs it. Returns whether the failsafe ended it, and how long the pump pin was on.
+static bool fill(uint32_t stall, uint32_t *on_ms) {
+    pump_on(LIMIT_MS + MARGIN_MS);
+    int64_t start = now_us();
+    bool failsafe = false;
+    for (int reading = 0;; reading++) {
+        stall_ms(reading == 0 ? READING_MS + stall : READING_MS);
+        if (tripped()) {
+            failsafe = true;
+            break;
+        }
+        if (now_us() - start >= LIMIT_MS * 1000) {
+            break;
+        }
+    }
+    pump_off();
+    *on_ms = (pin_off_us - pin_on_us) / 1000;
+    return failsafe;
+}
+
+static int check(bool ok, const char *what) {
+    printf("  %s: %s\n", what, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+int main(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &attr);
+    pthread_t timer;
+    pthread_create(&timer, NULL, timer_thread, NULL);
+
+    static const uint32_t stalls[] = {0, 1000, 200, 3000};
+    int failures = 0;
+    uint32_t expected_trips = 0;
+    bool last_tripped = false;
+    for (size_t i = 0; i < sizeof(stalls) / sizeof(stalls[0]); i++) {
+        uint32_t on_ms;
+        uint32_t reattached_before = reattached;
+        bool failsafe = fill(stalls[i], &on_ms);
+        bool should_trip = READING_MS + stalls[i] > LIMIT_MS + MARGIN_MS;
+        printf("fill stalled %u ms: pump on %u ms, %s\n", stalls[i], on_ms,
+               failsafe ? "failsafe tripped" : "stopped by the loop");
+        failures += check(on_ms <= LIMIT_MS + MARGIN_MS + LATENCY_MS, "on time within the failsafe limit");
+        failures += check(failsafe == should_trip, should_trip ? "failsafe tripped" : "failsafe left alone");
+        failures += check(reattached - reattached_before == last_tripped, "pin handed back only after a trip");
+        expected_trips += should_trip;
+        last_tripped = failsafe;
+    }
+
+    // /pump?state=on arms the bare time limit and nothing polls it
+    pump_on(LIMIT_MS);
+    stall_ms(3 * LIMIT_MS);
+    bool manual_tripped = tripped();
+    pump_off();
+    uint32_t manual_ms = (pin_off_us - pin_on_us) / 1000;
+    printf("manual on, never switched off: pump on %u ms\n", manual_ms);
+    failures += check(manual_tripped && manual_ms <= LIMIT_MS + LATENCY_MS, "failsafe cut the pump off on time");
+    expected_trips++;
+
+    pthread_mutex_lock(&lock);
+    pump_failsafe_status_t status = state.status;
+    pthread_mutex_unlock(&lock);
+    printf("%u arms, %u trips\n", status.arms, status.trips);
+    failures += check(status.trips == expected_trips && !status.armed && !status.tripped, "trip count and final state");
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
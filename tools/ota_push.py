@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Push a firmware image to several units at once through their /ota endpoint and wait for each one to come back
+healthy on the new firmware:
+
+    idf.py build
+    python3 tools/ota_push.py build/http-server-distance-sensor.bin 192.168.1.20 192.168.1.21 192.168.1.22
+
+A unit counts as updated once /metrics shows a higher boot count and the new image has passed its health checks.
+One that rolls back shows up as back on its old partition.
+"""
+import argparse
+import concurrent.futures
+import hashlib
+import json
+import time
+import urllib.error
+import urllib.request
+
+
+def get_metrics(host, timeout):
+    with urllib.request.urlopen("http://%s/metrics" % host, timeout=timeout) as resp:
+        return json.load(resp)
+
+
+def push(host, image, sha256, deadline_s):
+    before = get_metrics(host, 10)
+    start = time.monotonic()
+    request = urllib.request.Request(
+        "http://%s/ota" % host,
+        data=image,
+        method="POST",
+        headers={"Content-Type": "application/octet-stream", "X-OTA-SHA256": sha256},
+    )
+    try:
+        with urllib.request.urlopen(request, timeout=120) as resp:
+            resp.read()
+    except urllib.error.HTTPError as e:
+        return "%s: rejected, %d %s" % (host, e.code, e.read().decode(errors="replace").strip())
+    sent = time.monotonic() - start
+
+    while time.monotonic() - start < deadline_s:
+        time.sleep(2)
+        try:
+            metrics = get_metrics(host, 5)
+        except (OSError, ValueError):
+            continue  # still rebooting
+        if metrics["boot"]["count"] == before["boot"]["count"]:
+            continue
+        ota = metrics["ota"]
+        if ota["running"] == before["ota"]["running"]:
+            return "%s: rolled back to %s" % (host, ota["running"])
+        if not ota["pending_verify"]:
+            return "%s: running %s from %s, sent in %.1f s, healthy after %.1f s" % (
+                host,
+                ota["version"],
+                ota["running"],
+                sent,
+                time.monotonic() - start,
+            )
+    return "%s: not healthy after %d s" % (host, deadline_s)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="application .bin from the build directory")
+    parser.add_argument("hosts", nargs="+")
+    parser.add_argument("--parallel", type=int, default=4, help="units updated at the same time (default 4)")
+    parser.add_argument("--deadline", type=int, default=600, help="seconds to wait for each unit (default 600)")
+    args = parser.parse_args()
+    with open(args.image, "rb") as f:
+        image = f.read()
+    sha256 = hashlib.sha256(image).hexdigest()
+    print("%s: %d bytes, sha256 %s" % (args.image, len(image), sha256))
+    with concurrent.futures.ThreadPoolExecutor(args.parallel) as pool:
+        futures = [pool.submit(push, host, image, sha256, args.deadline) for host in args.hosts]
+        for future in concurrent.futures.as_completed(futures):
+            try:
+                print(future.result())
+            except OSError as e:
+                print("failed: %s" % e)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,153 @@
+/*
+ * Runs the firmware's fill slot arbitration over real UDP multicast on a PC, so several units sharing a reservoir
+ * can be simulated on one host. Start a few in separate terminals:
+ *
+ *     cc -O2 -Imain -o peer_node tools/peer_node.c main/peer_lease.c
+ *     ./peer_node --id 1 & ./peer_node --id 2 & ./peer_node --id 3 &
+ *
+ * Each node asks for a fill every --every-s seconds (all at the same moment by default, the worst case) and holds
+ * the slot for --fill-s seconds. Grants are printed with wall clock times, so overlaps are easy to spot. Killing a
+ * node while it holds the slot shows the others carrying on once its lease runs out.
+ */
+#include "peer_lease.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_GROUP "239.255.77.1"
+#define DEFAULT_PORT 47700
+#define POLL_MS 50
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void log_line(uint32_t id, const char *what, int peers) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    printf("%ld.%03ld unit %u %s (%d peers)\n", (long)ts.tv_sec % 1000, ts.tv_nsec / 1000000, id, what, peers);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"id", required_argument, NULL, 'i'},
+        {"fill-s", required_argument, NULL, 'f'},
+        {"every-s", required_argument, NULL, 'e'},
+        {"gap-ms", required_argument, NULL, 'g'},
+        {"group", required_argument, NULL, 'a'},
+        {"port", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0},
+    };
+    uint32_t id = 0;
+    int fill_s = 5, every_s = 20, gap_ms = 2000, port = DEFAULT_PORT;
+    const char *group = DEFAULT_GROUP;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            id = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            fill_s = atoi(optarg);
+            break;
+        case 'e':
+            every_s = atoi(optarg);
+            break;
+        case 'g':
+            gap_ms = atoi(optarg);
+            break;
+        case 'a':
+            group = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s --id N [--fill-s S] [--every-s S] [--gap-ms MS] [--group ADDR] [--port P]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (id == 0) {
+        fprintf(stderr, "--id must be a non-zero unit ID\n");
+        return 2;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+    struct ip_mreq mreq = {.imr_multiaddr.s_addr = inet_addr(group), .imr_interface.s_addr = htonl(INADDR_ANY)};
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+        return 1;
+    }
+    unsigned char loop = 1;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    struct sockaddr_in dest = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = inet_addr(group)};
+
+    peer_lease_t lease;
+    peer_lease_init(&lease, id, gap_ms);
+    int64_t start = now_ms();
+    int64_t next_fill = start + 3000; // hear the others first
+    int64_t next_announce = start;
+    int64_t fill_end = 0;
+    int64_t asked_at = 0;
+    uint8_t announced_state = PEER_IDLE;
+
+    while (true) {
+        int64_t now = now_ms();
+        if (lease.state == PEER_IDLE && now >= next_fill) {
+            peer_lease_request(&lease, now);
+            asked_at = now;
+            next_fill += every_s * 1000;
+            log_line(id, "wants to fill", peer_lease_live_peers(&lease, now));
+        }
+        if (lease.state == PEER_WAITING && peer_lease_try_grant(&lease, now, fill_s * 1000 + 5000)) {
+            char what[48];
+            snprintf(what, sizeof(what), "FILL START after %lld ms", (long long)(now - asked_at));
+            log_line(id, what, peer_lease_live_peers(&lease, now));
+            fill_end = now + fill_s * 1000;
+        }
+        if (lease.state == PEER_HOLDING && now >= fill_end) {
+            peer_lease_release(&lease, now);
+            log_line(id, "FILL END", peer_lease_live_peers(&lease, now));
+        }
+
+        if (now >= next_announce || lease.state != announced_state) {
+            uint8_t msg[PEER_MSG_LEN];
+            peer_lease_announce(&lease, msg, now);
+            sendto(sock, msg, sizeof(msg), 0, (struct sockaddr *)&dest, sizeof(dest));
+            announced_state = lease.state;
+            next_announce = now + (lease.state == PEER_IDLE ? PEER_IDLE_ANNOUNCE_MS : PEER_ANNOUNCE_MS);
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        struct timeval tv = {.tv_usec = POLL_MS * 1000};
+        if (select(sock + 1, &fds, NULL, NULL, &tv) > 0) {
+            char buf[64];
+            ssize_t len = recv(sock, buf, sizeof(buf), 0);
+            if (len > 0) {
+                peer_lease_receive(&lease, buf, len, now_ms());
+            }
+        }
+    }
+}
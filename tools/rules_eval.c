@@ -0,0 +1,53 @@
+/*
+ * Compiles a topup rule with the firmware's own compiler and runs it against variables given on the command line,
+ * to try a rule before uploading it to /rules:
+ *
+ *     cc -O2 -Imain -o rules_eval tools/rules_eval.c main/rules.c
+ *     ./rules_eval '(hour >= 6 && hour < 22) && timeouts_24h < 2' hour=23 timeouts_24h=0
+ *
+ * Variables that are not given are 0.
+ */
+#include "rules.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s RULE [name=value ...]\nvariables:", argv[0]);
+        for (int i = 0; i < RULE_VAR_COUNT; i++) {
+            fprintf(stderr, " %s", rules_var_name(i));
+        }
+        fprintf(stderr, "\n");
+        return 2;
+    }
+    rules_program_t prog;
+    char err[64];
+    if (!rules_compile(argv[1], &prog, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+
+    int32_t vars[RULE_VAR_COUNT] = {0};
+    for (int arg = 2; arg < argc; arg++) {
+        char *eq = strchr(argv[arg], '=');
+        int i = 0;
+        while (eq && i < RULE_VAR_COUNT && (strlen(rules_var_name(i)) != (size_t)(eq - argv[arg]) ||
+                                             strncmp(rules_var_name(i), argv[arg], eq - argv[arg]) != 0)) {
+            i++;
+        }
+        if (!eq || i == RULE_VAR_COUNT) {
+            fprintf(stderr, "unknown variable in '%s'\n", argv[arg]);
+            return 2;
+        }
+        vars[i] = atoi(eq + 1);
+    }
+
+    printf("%d bytes:", prog.len);
+    for (int i = 0; i < prog.len; i++) {
+        printf(" %02x", prog.code[i]);
+    }
+    printf("\nresult %d\n", (int)rules_eval(&prog, vars, 1));
+    return 0;
+}
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+"""Decode the binary status served on /stats.bin, the format in main/stats_bin.h:
+
+    curl -s http://<device>/stats.bin -o stats.bin
+    python3 tools/stats_decode.py stats.bin
+
+decode() takes the raw bytes and returns a dict, for collectors that import this file.
+"""
+import argparse
+import json
+import struct
+import sys
+
+PREFIX = struct.Struct("<4sHHHH")
+STATS = struct.Struct("<4sHHHHIqqIiqB3xIqIiBBxxIiiIBBBBB3x")
+SAMPLE = struct.Struct("<qi")
+FIELDS = (
+    "flags now_ms uptime_ms boot_count level_um level_ms pump_duty_pct pump_total_ms last_topup_ms "
+    "last_topup_duration_ms last_topup_end_um last_topup_outcome last_topup_source config_version trigger_level_um "
+    "fill_level_um max_topup_time_ms schedule_mode trigger_days trigger_hour trigger_minute num_below_trigger"
+).split()
+FLAGS = {"level": 0x01, "level_warm": 0x02, "pump": 0x04, "time": 0x08, "topup": 0x10}
+
+
+def decode(data):
+    magic, version, header_size, sample_size, num_samples = PREFIX.unpack_from(data)
+    if magic != b"ESTS" or version != 1 or header_size < STATS.size or sample_size < SAMPLE.size:
+        raise ValueError("not a version 1 stats dump")
+    stats = dict(zip(FIELDS, STATS.unpack_from(data)[5:]))
+    flags = stats.pop("flags")
+    stats.update({name: bool(flags & bit) for name, bit in FLAGS.items()})
+    offset = header_size
+    stats["samples"] = []
+    for _ in range(num_samples):
+        stats["samples"].append(SAMPLE.unpack_from(data, offset))
+        offset += sample_size
+    return stats
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", help="file saved from /stats.bin")
+    args = parser.parse_args()
+    with open(args.dump, "rb") as f:
+        try:
+            stats = decode(f.read())
+        except ValueError as e:
+            sys.exit(str(e))
+    json.dump(stats, sys.stdout, indent=1)
+    print()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,229 @@
+/*
+ * Replays a raw ping trace taken from the device's /trace endpoint through the firmware's own reading and topup
+ * decision code, so a parameter change can be checked against real field data:
+ *
+ *     curl -s http://<device>/trace -o trace.bin
+ *     cc -O2 -DTOPUP_LOGIC_HOST -Icomponents/distance_sensor -Imain -o trace_replay tools/trace_replay.c \
+ *         components/distance_sensor/distance_filter.c main/topup_logic.c
+ *     ./trace_replay --trigger-cm 30 --filter median trace.bin
+ *
+ * Reading parameters default to the ones the device was running with, which are stored in the trace.
+ * Pings are consumed in order, so changing the pings per reading regroups the recorded pings.
+ */
+#include "distance_filter.h"
+#include "distance_trace.h"
+#include "topup_logic.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REPLAY_END (-1) // returned by the ping function once the trace runs out
+
+typedef struct {
+    const distance_trace_record_t *records;
+    uint32_t num_records;
+    uint32_t next;
+    uint32_t reading_time_ms; // time of the first ping of the current reading
+    uint32_t pings;
+    uint32_t ping_timeouts;
+    uint32_t echo_timeouts;
+} replay_t;
+
+typedef struct {
+    uint32_t readings;
+    uint32_t failed_readings;
+    uint32_t topups;
+    uint32_t reached;
+    uint32_t timeouts;
+    uint32_t sensor_fails;
+} replay_stats_t;
+
+static int replay_ping(void *ctx, int ping, bool retry, int32_t *echo_us) {
+    replay_t *replay = ctx;
+    if (replay->next == replay->num_records) {
+        return REPLAY_END;
+    }
+    const distance_trace_record_t *record = &replay->records[replay->next++];
+    if (ping == 0 && !retry) {
+        replay->reading_time_ms = record->time_ms;
+    }
+    replay->pings++;
+    switch (record->result) {
+    case DISTANCE_TRACE_OK:
+        *echo_us = record->echo_us;
+        return 0;
+    case DISTANCE_TRACE_PING_TIMEOUT:
+        replay->ping_timeouts++;
+        return ESP_ERR_ULTRASONIC_PING_TIMEOUT;
+    default:
+        replay->echo_timeouts++;
+        return ESP_ERR_ULTRASONIC_ECHO_TIMEOUT;
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options] trace.bin\n"
+            "  --trigger-cm CM     trigger level (required)\n"
+            "  --num-below N       readings within the trigger level that end a topup (default 3)\n"
+            "  --nearer            a topup is needed when the distance is below the trigger level\n"
+            "  --max-topup-s S     pump time limit (default 15)\n"
+            "  --pings N           pings per reading\n"
+            "  --retries N         retries of a failed ping\n"
+            "  --min-echo-us US    shortest accepted echo\n"
+            "  --filter mean|median\n"
+            "  --csv               print every reading\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"trigger-cm", required_argument, NULL, 't'},
+        {"num-below", required_argument, NULL, 'n'},
+        {"nearer", no_argument, NULL, 'r'},
+        {"max-topup-s", required_argument, NULL, 'm'},
+        {"pings", required_argument, NULL, 'p'},
+        {"retries", required_argument, NULL, 'R'},
+        {"min-echo-us", required_argument, NULL, 'e'},
+        {"filter", required_argument, NULL, 'f'},
+        {"csv", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    topup_params_t topup = {.trigger_level_um = -1, .num_below_trigger = 3, .trigger_when_farther = true};
+    int max_topup_ms = 15000;
+    int pings = -1, retries = -1, min_echo_us = -1, filter = -1;
+    bool csv = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            topup.trigger_level_um = (int32_t)(atof(optarg) * DISTANCE_UM_PER_CM);
+            break;
+        case 'n':
+            topup.num_below_trigger = atoi(optarg);
+            break;
+        case 'r':
+            topup.trigger_when_farther = false;
+            break;
+        case 'm':
+            max_topup_ms = atoi(optarg) * 1000;
+            break;
+        case 'p':
+            pings = atoi(optarg);
+            break;
+        case 'R':
+            retries = atoi(optarg);
+            break;
+        case 'e':
+            min_echo_us = atoi(optarg);
+            break;
+        case 'f':
+            filter = strcmp(optarg, "median") == 0 ? DISTANCE_FILTER_MEDIAN : DISTANCE_FILTER_MEAN;
+            break;
+        case 'c':
+            csv = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || topup.trigger_level_um < 0) {
+        usage(argv[0]);
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    distance_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, DISTANCE_TRACE_MAGIC, 4) != 0 ||
+        header.version != DISTANCE_TRACE_VERSION || header.record_size != sizeof(distance_trace_record_t)) {
+        fprintf(stderr, "not a version %d ping trace\n", DISTANCE_TRACE_VERSION);
+        return 1;
+    }
+    distance_trace_record_t *records = malloc((size_t)header.num_records * sizeof(distance_trace_record_t));
+    if (!records) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    header.num_records = fread(records, sizeof(distance_trace_record_t), header.num_records, f);
+    fclose(f);
+
+    distance_params_t params = {
+        .num_pings = pings > 0 ? pings : header.num_pings,
+        .max_retries = retries >= 0 ? retries : header.max_retries,
+        .min_echo_us = min_echo_us >= 0 ? min_echo_us : header.min_echo_us,
+        .filter = filter >= 0 ? (distance_filter_t)filter : (distance_filter_t)header.filter,
+    };
+
+    replay_t replay = {.records = records, .num_records = header.num_records};
+    // After the ring wraps the oldest reading is usually incomplete
+    while (replay.next < replay.num_records && !(records[replay.next].flags & DISTANCE_TRACE_FLAG_READING_START)) {
+        replay.next++;
+    }
+
+    replay_stats_t stats = {0};
+    bool pumping = false;
+    topup_fill_t fill;
+    if (csv) {
+        printf("time_ms,level_cm,result,state\n");
+    }
+    while (true) {
+        int32_t level_um = 0;
+        int res = distance_read_filtered(&params, replay_ping, &replay, &level_um);
+        if (res == REPLAY_END) {
+            break;
+        }
+        stats.readings++;
+        stats.failed_readings += res != 0;
+        const char *state;
+        if (!pumping) {
+            pumping = res == 0 && topup_needed(&topup, level_um);
+            if (pumping) {
+                topup_fill_begin(&fill, max_topup_ms, replay.reading_time_ms);
+            }
+            stats.topups += pumping;
+            state = pumping ? "start" : "idle";
+        } else {
+            // The same steps the firmware's topup loop takes after each reading
+            topup_fill_state_t step = topup_fill_step(&fill, &topup, res == 0, level_um, replay.reading_time_ms);
+            pumping = step == TOPUP_FILL_PUMPING;
+            switch (step) {
+            case TOPUP_FILL_PUMPING:
+                state = "pumping";
+                break;
+            case TOPUP_FILL_REACHED:
+                stats.reached++;
+                state = "reached";
+                break;
+            case TOPUP_FILL_TIMEOUT:
+                stats.timeouts++;
+                state = "timeout";
+                break;
+            default:
+                stats.sensor_fails++;
+                state = "sensor_fail";
+                break;
+            }
+        }
+        if (csv) {
+            printf("%u,%.2f,%d,%s\n", replay.reading_time_ms, level_um / (double)DISTANCE_UM_PER_CM, res, state);
+        }
+    }
+
+    uint32_t span_ms = replay.num_records ? records[replay.num_records - 1].time_ms - records[0].time_ms : 0;
+    FILE *out = csv ? stderr : stdout;
+    fprintf(out, "%u pings over %.1f h (%u dropped on the device), %u ping timeouts, %u echo timeouts\n",
+            replay.pings, span_ms / 3600000.0, header.dropped, replay.ping_timeouts, replay.echo_timeouts);
+    fprintf(out, "%u readings of %d pings (%s, %d retries, min echo %d us), %u failed\n", stats.readings,
+            params.num_pings, params.filter == DISTANCE_FILTER_MEDIAN ? "median" : "mean", params.max_retries,
+            (int)params.min_echo_us, stats.failed_readings);
+    fprintf(out, "%u topups started: %u reached the trigger level, %u timed out, %u sensor failures\n", stats.topups,
+            stats.reached, stats.timeouts, stats.sensor_fails);
+    free(records);
+    return 0;
+}
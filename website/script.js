@@ -3,6 +3,7 @@ let globalDays = 0;
 let globalHours = 0;
 let globalMinutes = 0;
 let globalTriggerLevel = 0;
+let configEtag = null;
 
   document.querySelectorAll(".day-button").forEach((button) => {
     button.addEventListener("click", () => {
@@ -10,7 +11,8 @@ let globalTriggerLevel = 0;
     });
   });
 
-  updateStats()
+  loadConfig()
+  .then(() => updateStats())
   .then(() => setDayButtons())
   .then(() => setTimePicker())
   .then(() => setTriggerInput());
@@ -19,6 +21,9 @@ let globalTriggerLevel = 0;
     updateStats();
   }, 10000);
 
+  showHistory("week");
+  loadJournal();
+
 const dayMapping = {
   0: "Mon",
   1: "Tues",
@@ -78,18 +83,40 @@ function togglePump(state) {
 // Set the trigger level
 function setTriggerLevel() {
   const level = document.getElementById("trigger-input").value;
-  fetch(`/set-trigger?level=${level}`, { method: "POST" })
-    .then((response) => response.text())
-    .then((data) => alert(data))
+  patchConfig({ trigger_level: Number(level) })
     .catch((err) => console.error("Error setting trigger level:", err));
-  updateStats();
 }
 
-// Test water topup feature
+// Read the settings and the ETag identifying their version
+async function loadConfig() {
+  const response = await fetch("/config");
+  configEtag = response.headers.get("ETag");
+  return response.json();
+}
+
+// Apply changed settings as one update. A stale ETag means another client saved first and the device answers 412.
+async function patchConfig(changes) {
+  const response = await fetch("/config", {
+    method: "PATCH",
+    headers: configEtag ? { "If-Match": configEtag } : {},
+    body: JSON.stringify(changes),
+  });
+  if (response.status === 412) {
+    alert("Settings were changed from another page, reloading them.");
+  } else if (!response.ok) {
+    alert(await response.text());
+  }
+  await loadConfig();
+  await updateStats();
+}
+
+// Test water topup feature. The device queues the topup and answers straight away, so the journal is reloaded
+// once the fill can have ended.
 function topUp() {
-  fetch(`/topup`)
-    .then((response) => response.text())
-    .catch((err) => console.error("Error topping up water:", errr));
+  fetch(`/topup?source=manual`)
+    .then(() => loadConfig())
+    .then((config) => setTimeout(loadJournal, config.max_topup_time_ms + 5000))
+    .catch((err) => console.error("Error topping up water:", err));
   updateStats();
 }
 
@@ -115,19 +142,91 @@ function setSchedule() {
     days |= 1 << (dayValue - 1);
   });
 
-  let schedule = {
-    time: {
-      hours: hours,
-      minutes,
-      minutes,
-    },
-    days: days,
-  };
-
-  fetch("/topup/schedule", {
-    method: "POST",
-    body: JSON.stringify(schedule),
-  })
-    .then((response) => console.log(response.text()))
+  patchConfig({ trigger_hour: hours, trigger_minute: minutes, trigger_days: days })
     .catch((err) => console.error("Error setting new schedule", err));
 }
+
+// Last few topups from the device's journal
+function loadJournal() {
+  fetch("/topups?limit=5")
+    .then((response) => response.json())
+    .then((data) => {
+      const rows = data.topups.map((t) => {
+        const when = t.start ? new Date(t.start * 1000).toLocaleString() : "-";
+        const level = t.start_level === null ? "-" : `${t.start_level.toFixed(1)} to ${t.end_level.toFixed(1)}`;
+        return `<tr><td>${when}</td><td>${t.source}</td><td>${t.outcome}</td><td>${t.duration_s.toFixed(1)}</td><td>${level}</td></tr>`;
+      });
+      document.getElementById("topup-journal").innerHTML = rows.join("") || "<tr><td colspan=\"5\">No topups yet</td></tr>";
+    })
+    .catch((err) => console.error("Error fetching topups:", err));
+}
+
+// Level history chart, drawn from the device's minute, hour or day rollups
+const historyViews = {
+  hours: { res: "minute", n: 240 },
+  week: { res: "hour", n: 168 },
+  months: { res: "day", n: 90 },
+};
+
+function showHistory(view) {
+  const { res, n } = historyViews[view];
+  fetch(`/rollup?res=${res}&n=${n}`)
+    .then((response) => response.json())
+    .then((data) => drawHistory(data))
+    .catch((err) => console.error("Error fetching history:", err));
+}
+
+function drawHistory(data) {
+  const canvas = document.getElementById("history-chart");
+  const ctx = canvas.getContext("2d");
+  const width = canvas.width;
+  const height = canvas.height;
+  ctx.clearRect(0, 0, width, height);
+
+  const levels = data.min.concat(data.max).filter((level) => level !== null);
+  if (levels.length === 0) {
+    ctx.fillText("No history yet", 10, 20);
+    return;
+  }
+  const low = Math.min(...levels);
+  const high = Math.max(...levels);
+  const span = high - low || 1;
+  const step = width / data.avg.length;
+  const x = (i) => (i + 0.5) * step;
+  // Larger distances are drawn lower, so the line falls as the water level does
+  const y = (level) => 20 + ((level - low) / span) * (height - 50);
+
+  // Pump run time as bars along the bottom
+  const maxPump = Math.max(...data.pump_s, 1);
+  ctx.fillStyle = "rgba(0, 170, 85, 0.5)";
+  data.pump_s.forEach((seconds, i) => {
+    const bar = (seconds / maxPump) * 20;
+    ctx.fillRect(i * step, height - bar, Math.max(step - 1, 1), bar);
+  });
+
+  // Min to max band with the mean on top
+  ctx.fillStyle = "rgba(0, 119, 204, 0.25)";
+  data.min.forEach((min, i) => {
+    if (min !== null) {
+      ctx.fillRect(i * step, y(min), Math.max(step - 1, 1), Math.max(y(data.max[i]) - y(min), 1));
+    }
+  });
+  ctx.strokeStyle = "#0077cc";
+  ctx.beginPath();
+  let drawing = false;
+  data.avg.forEach((avg, i) => {
+    if (avg === null) {
+      drawing = false;
+    } else if (drawing) {
+      ctx.lineTo(x(i), y(avg));
+    } else {
+      ctx.moveTo(x(i), y(avg));
+      drawing = true;
+    }
+  });
+  ctx.stroke();
+
+  ctx.fillStyle = "#333";
+  ctx.fillText(`${(low / 10).toFixed(1)} cm`, 4, 12);
+  ctx.fillText(`${(high / 10).toFixed(1)} cm`, 4, height - 24);
+}